@@ -11,6 +11,9 @@
 #define CLING_CODE_COMPLETE_CONSUMER
 
 #include "clang/Sema/CodeCompleteConsumer.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <functional>
 
 using namespace clang;
 
@@ -18,16 +21,41 @@ namespace cling {
   /// \brief Create a new printing code-completion consumer that prints its
   /// results to the given raw output stream.
   class ClingCodeCompleteConsumer : public CodeCompleteConsumer {
+  public:
+    /// \brief Receives a batch of completions; returns false to get no more.
+    typedef std::function<bool(std::vector<std::string>&)> BatchSink;
+
+  private:
     CodeCompletionTUInfo m_CCTUInfo;
+    /// \brief The current batch, when results are handed over in batches.
+    std::vector<std::string> m_Batch;
     /// \ brief Results of the completer to be printed by the text interface.
     std::vector<std::string> &m_Completions;
+    BatchSink m_Sink;
+    size_t m_BatchSize;
+    /// \brief The texts handed over already, as overloads share theirs.
+    llvm::StringSet<> m_Seen;
+
+    /// \brief Hand the results over to m_Sink, best ranked first.
+    void ProcessRankedResults(Sema &SemaRef, CodeCompletionContext Context,
+                              CodeCompletionResult *Results,
+                              unsigned NumResults);
 
   public:
     ClingCodeCompleteConsumer(const CodeCompleteOptions &CodeCompleteOpts,
                               std::vector<std::string> &completions)
       : CodeCompleteConsumer(CodeCompleteOpts, false),
         m_CCTUInfo(std::make_shared<GlobalCodeCompletionAllocator>()),
-        m_Completions(completions) {}
+        m_Completions(completions), m_BatchSize(0) {}
+
+    /// \brief Hand the completions over in batches of batchSize, best ranked
+    /// first, as the text to insert at the completion point.
+    ClingCodeCompleteConsumer(const CodeCompleteOptions &CodeCompleteOpts,
+                              BatchSink sink, size_t batchSize)
+      : CodeCompleteConsumer(CodeCompleteOpts, false),
+        m_CCTUInfo(std::make_shared<GlobalCodeCompletionAllocator>()),
+        m_Completions(m_Batch), m_Sink(std::move(sink)),
+        m_BatchSize(batchSize ? batchSize : 1) {}
     ~ClingCodeCompleteConsumer() {}
 
     /// \brief Prints the finalized code-completion results.
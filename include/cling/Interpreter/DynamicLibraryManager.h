@@ -16,6 +16,9 @@
 
 #include "llvm/Support/Path.h"
 
+#include <string>
+#include <vector>
+
 namespace cling {
   class InterpreterCallbacks;
   class InvocationOptions;
@@ -124,6 +127,10 @@ namespace cling {
     ///
     bool isLibraryLoaded(llvm::StringRef fullPath) const;
 
+    ///\brief The canonical paths of the libraries loaded, sorted.
+    ///
+    std::vector<std::string> getLoadedLibraries() const;
+
     ///\brief Explicitly tell the execution engine to use symbols from
     ///       a shared library that would otherwise not be used for symbol
     ///       resolution, e.g. because it was dlopened with RTLD_LOCAL.
@@ -15,9 +15,12 @@
 #include "llvm/ADT/StringRef.h"
 
 #include <cstdlib>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace llvm {
   class raw_ostream;
@@ -64,6 +67,7 @@ namespace cling {
     }
   }
   class ClangInternalState;
+  class ClingCodeCompleteConsumer;
   class CompilationOptions;
   class DynamicLibraryManager;
   class IncrementalExecutor;
@@ -224,6 +228,40 @@ namespace cling {
     };
     mutable const Transaction* m_CachedTrns[kNumTransactions] = {};
 
+    ///\brief The interpreter code completion runs in, importing declarations
+    /// from this one. It is expensive to set up, so it is kept from one
+    /// completion to the next.
+    ///
+    mutable std::unique_ptr<Interpreter> m_CompletionInterp;
+
+    ///\brief Whether a transaction that declared something m_CompletionInterp
+    /// imported was unloaded since it was created.
+    ///
+    mutable bool m_CompletionStale = false;
+
+    ///\brief The inputs that declared things at global scope, in the order
+    /// they were committed, with their transaction: what saveSnapshot()
+    /// compiles.
+    ///
+    std::vector<std::pair<const Transaction*, std::string>> m_Declarations;
+
+    ///\brief Whether to record into m_Declarations; not while initializing,
+    /// as the runtime is set up again by any interpreter.
+    ///
+    bool m_RecordDeclarations = false;
+
+    ///\brief Record the declarations of a committed input for snapshots.
+    ///
+    ///\param [in] input - The declarations, as they were compiled.
+    ///\param [in] T - The transaction they were committed in.
+    ///
+    void recordDeclarations(llvm::StringRef input, const Transaction* T);
+
+    ///\brief Reload the libraries of the snapshot the interpreter starts
+    /// from (cling --restore), whose declarations clang loads as a PCH.
+    ///
+    void restoreSnapshot();
+
     ///\brief Worker function, building block for interpreter's public
     /// interfaces.
     ///
@@ -267,6 +305,14 @@ namespace cling {
     CompilationResult CodeCompleteInternal(const std::string& input,
                                            unsigned offset);
 
+    ///\brief Code completes user input in the completion interpreter.
+    ///
+    ///\param [in] consumer - Receives the results; the completion
+    ///   interpreter takes it over.
+    ///
+    CompilationResult codeCompleteWith(const std::string& line, size_t& cursor,
+                                  ClingCodeCompleteConsumer* consumer) const;
+
     ///\brief Wraps a given input.
     ///
     /// The interpreter must be able to run statements on the fly, which is not
@@ -448,6 +494,41 @@ namespace cling {
     ///
     void dump(llvm::StringRef what, llvm::StringRef filter);
 
+    ///\brief Re-optimize the JITted functions that ran, with the branch
+    /// profile collected since (cling -fjit-pgo).
+    ///
+    ///\param[in] Out - where to report to.
+    ///
+    void optimizeWithProfile(llvm::raw_ostream& Out);
+
+    ///\brief Write a snapshot of the session, from which another interpreter
+    /// starts with the declarations, macros and libraries of this one
+    /// (cling --restore=<path>).
+    ///
+    /// The snapshot is a PCH, compiled from the inputs that declared things;
+    /// they are kept in <path>.h, which clang checks when loading the PCH.
+    /// Statements are not run again: the snapshot holds the declarations of
+    /// the session, not the values it computed. Sessions with SYCL device
+    /// code (-fsycl) cannot be saved.
+    ///
+    ///\param[in] path - The file to write.
+    ///
+    ///\returns true on success.
+    ///
+    bool saveSnapshot(llvm::StringRef path) const;
+
+    ///\brief Turn the recording of declarations for saveSnapshot() on or
+    /// off, e.g. around declarations any session makes again by itself.
+    ///
+    ///\param[in] record - Whether to record the next declarations.
+    ///
+    ///\returns whether they were recorded before.
+    ///
+    bool setRecordDeclarations(bool record) {
+      std::swap(record, m_RecordDeclarations);
+      return record;
+    }
+
     ///\brief Store the interpreter state in files
     /// Store the AST, the included files and the lookup tables
     ///
@@ -538,7 +619,8 @@ namespace cling {
     ///\brief Code completes user input.
     ///
     /// The interface circumvents the most of the extra work necessary to
-    /// code complete code.
+    /// code complete code. The completion runs in a child interpreter, created
+    /// on the first call and reused afterwards.
     ///
     /// @param[in] line - The input containing the string to be completed.
     /// @param[in] cursor - The offset for the completion point.
@@ -549,6 +631,20 @@ namespace cling {
     CompilationResult codeComplete(const std::string& line, size_t& cursor,
                                    std::vector<std::string>& completions) const;
 
+    ///\brief Code completes user input, handing the completions over in
+    /// batches, best ranked first, as the text to insert at the cursor.
+    ///
+    /// @param[in] line - The input containing the string to be completed.
+    /// @param[in] cursor - The offset for the completion point.
+    /// @param[in] sink - Receives each batch; returns false to get no more.
+    /// @param[in] batchSize - The number of completions in a batch.
+    ///
+    ///\returns Whether the operation was fully successful.
+    ///
+    CompilationResult codeComplete(const std::string& line, size_t& cursor,
+                   const std::function<bool(std::vector<std::string>&)>& sink,
+                   size_t batchSize) const;
+
     ///\brief Compiles input line, which doesn't contain statements.
     ///
     /// The interface circumvents the most of the extra work necessary to
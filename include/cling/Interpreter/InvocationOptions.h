@@ -10,6 +10,7 @@
 #ifndef CLING_INVOCATIONOPTIONS_H
 #define CLING_INVOCATIONOPTIONS_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -61,6 +62,7 @@ namespace cling {
     unsigned CUDAHost : 1;
     unsigned CUDADevice : 1;
     unsigned SYCL : 1;
+    unsigned SYCLAsync : 1;
     /// \brief The output path of any C++ PCMs we're building on demand.
     /// Equal to ModuleCachePath in the HeaderSearchOptions.
     std::string CachePath;
@@ -88,6 +90,17 @@ namespace cling {
     ///        directive for the MetaProcessor. Defaults to "."
     std::string MetaString;
 
+    ///\brief Directory of the on-disk cache of JIT objects; none if empty.
+    std::string JITCachePath;
+    ///\brief Size, in bytes, beyond which JIT objects are evicted.
+    uint64_t JITCacheLimit;
+    ///\brief Threads optimizing the partitions of a transaction, 0 to
+    /// optimize it as a whole.
+    unsigned ParallelJIT;
+
+    ///\brief Session snapshot to start from; none if empty.
+    std::string RestorePath;
+
     std::vector<std::string> LibsToLoad;
     std::vector<std::string> LibSearchPath;
     std::vector<std::string> Inputs;
@@ -98,6 +111,12 @@ namespace cling {
     unsigned ShowVersion : 1;
     unsigned Help : 1;
     unsigned NoRuntime : 1;
+    ///\brief Run transactions at -O0, re-optimizing their hot functions.
+    unsigned TieredJIT : 1;
+    ///\brief Profile the -O0 code, and optimize it with the profile.
+    unsigned JITProfile : 1;
+    ///\brief Compile each function only once linked code refers to it.
+    unsigned LazyJIT : 1;
     bool Verbose() const { return CompilerOpts.Verbose; }
 
     static void PrintHelp();
@@ -32,7 +32,8 @@ namespace cling {
   //                            PrintDebugCommand | DynamicExtensionsCommand |
   //                            HelpCommand | FileExCommand | FilesCommand |
   //                            ClassCommand | GCommand | StoreStateCommand |
-  //                            CompareStateCommand | StatsCommand | undoCommand
+  //                            CompareStateCommand | StatsCommand |
+  //                            undoCommand | PgoCommand
   //                 LCommand := 'L' FilePath
   //                 TCommand := 'T' FilePath FilePath
   //                 >Command := '>' FilePath
@@ -46,9 +47,13 @@ namespace cling {
   //                 DebugCommand := 'debug' [Constant]
   //                 StoreStateCommand := 'storeState' "Ident"
   //                 CompareStateCommand := 'compareState' "Ident"
-  //                 StatsCommand := 'stats' ['ast']
+  //                 StatsCommand := 'stats' ['ast' | 'sycl' ['json'] |
+  //                                          'jitmem' ['json'] |
+  //                                          'jitcache' ['json']]
   //                 traceCommand := 'trace' ['ast'] ["Ident"]
   //                 undoCommand := 'undo' [Constant]
+  //                 PgoCommand := 'pgo'
+  //                 SnapshotCommand := 'snapshot' FilePath
   //                 DynamicExtensionsCommand := 'dynamicExtensions' [Constant]
   //                 HelpCommand := 'help'
   //                 FileExCommand := 'fileEx'
@@ -101,6 +106,8 @@ namespace cling {
     bool iscompareStateCommand();
     bool isstatsCommand();
     bool istraceCommand();
+    bool ispgoCommand();
+    bool issnapshotCommand(MetaSema::ActionResult& actionResult);
     bool isundoCommand();
     bool isdynamicExtensionsCommand();
     bool ishelpCommand();
@@ -184,6 +184,18 @@ namespace cling {
     void actOnstatsCommand(llvm::StringRef name,
                            llvm::StringRef filter = llvm::StringRef()) const;
 
+    ///\brief Re-optimizes the JITted functions that ran, with their branch
+    /// profile (cling -fjit-pgo).
+    ///
+    void actOnpgoCommand() const;
+
+    ///\brief Writes a snapshot of the session, from which cling can start
+    /// (cling --restore=<file>).
+    ///
+    ///\param[in] file - The snapshot file.
+    ///
+    ActionResult actOnsnapshotCommand(llvm::StringRef file) const;
+
     ///\brief Switches on/off the experimental dynamic extensions (dynamic
     /// scopes) and late binding.
     ///
@@ -0,0 +1,66 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_UTILS_SYCL_COMPILE_SERVER_H
+#define CLING_UTILS_SYCL_COMPILE_SERVER_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cling {
+namespace utils {
+namespace sycl {
+
+  ///\brief Environment variable naming the socket of the SYCL compile server
+  /// that IncrementalSYCLDeviceCompiler sends its device jobs to.
+  const char* const ServerSocketEnv = "CLING_SYCL_SERVER";
+
+  ///\brief A program and its arguments (without the program itself).
+  typedef std::pair<std::string, std::vector<std::string>> Job;
+
+  ///\brief Result of a job run by the compile server.
+  enum JobStatus {
+    kJobRun,        ///< The job ran; its exit code is valid.
+    kJobRejected,   ///< The server refused to run the program.
+    kServerFailure, ///< The server could not be reached or hung up.
+  };
+
+  ///\brief Run a job on the compile server listening on a Unix socket. The
+  /// paths in the job must be absolute, as the server runs it in its own
+  /// working directory.
+  ///
+  ///\param [in] Socket - Path of the server's socket.
+  ///\param [in] J - The job to run.
+  ///\param [out] ExitCode - Exit code of the program, or -1 if it could not
+  /// be run.
+  ///\param [out] Output - What the program printed on stdout and stderr.
+  ///
+  ///\returns Whether the job ran.
+  JobStatus RunRemoteJob(const std::string& Socket, const Job& J,
+                         int& ExitCode, std::string& Output);
+
+  ///\brief Serve jobs on a Unix socket until the process is killed. Each
+  /// connection carries one job; up to Workers jobs run at the same time, so
+  /// the connections of several sessions share the cores of the host.
+  ///
+  ///\param [in] Socket - Path of the socket to create. A stale socket left
+  /// by a previous server is replaced.
+  ///\param [in] AllowedDir - Only programs in this directory are run.
+  ///\param [in] Workers - Maximum number of concurrent jobs.
+  ///\param [out] Err - Why the server could not start.
+  ///
+  ///\returns False if the socket could not be created.
+  bool Serve(const std::string& Socket, const std::string& AllowedDir,
+             unsigned Workers, std::string& Err);
+
+} // namespace sycl
+} // namespace utils
+} // namespace cling
+
+#endif // CLING_UTILS_SYCL_COMPILE_SERVER_H
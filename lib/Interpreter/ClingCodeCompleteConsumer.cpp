@@ -13,11 +13,16 @@
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Sema/Sema.h"
 
+#include <algorithm>
+
 namespace cling {
   void ClingCodeCompleteConsumer::ProcessCodeCompleteResults(Sema &SemaRef,
                                                    CodeCompletionContext Context,
                                                    CodeCompletionResult *Results,
                                                            unsigned NumResults) {
+    if (m_Sink)
+      return ProcessRankedResults(SemaRef, Context, Results, NumResults);
+
     std::stable_sort(Results, Results + NumResults);
 
     StringRef Filter = SemaRef.getPreprocessor().getCodeCompletionFilter();
@@ -57,6 +62,55 @@ namespace cling {
     }
   }
 
+  void ClingCodeCompleteConsumer::ProcessRankedResults(Sema &SemaRef,
+                                                   CodeCompletionContext Context,
+                                                   CodeCompletionResult *Results,
+                                                           unsigned NumResults) {
+    // Sema hands over everything visible in the scope: only what matches the
+    // typed prefix is ranked, and turned into text until the sink has enough.
+    StringRef Filter = SemaRef.getPreprocessor().getCodeCompletionFilter();
+    CodeCompletionResult *End = Results + NumResults;
+    if (!Filter.empty())
+      End = std::partition(Results, End,
+                           [this, Filter](const CodeCompletionResult &R) {
+                             return !isResultFilteredOut(Filter, R);
+                           });
+
+    // Lower priorities are better, then names.
+    std::stable_sort(Results, End,
+                     [](const CodeCompletionResult &L,
+                        const CodeCompletionResult &R) {
+                       if (L.Priority != R.Priority)
+                         return L.Priority < R.Priority;
+                       return L < R;
+                     });
+
+    for (CodeCompletionResult *I = Results; I != End; ++I) {
+      std::string Text;
+      if (I->Kind == CodeCompletionResult::RK_Keyword)
+        Text = I->Keyword;
+      else if (CodeCompletionString *CCS
+               = I->CreateCodeCompletionString(SemaRef, Context,
+                                               getAllocator(), m_CCTUInfo,
+                                               false)) {
+        if (const char *TypedText = CCS->getTypedText())
+          Text = TypedText;
+      }
+      if (Text.empty() || !m_Seen.insert(Text).second)
+        continue;
+
+      m_Completions.push_back(std::move(Text));
+      if (m_Completions.size() == m_BatchSize) {
+        if (!m_Sink(m_Completions))
+          return;
+        m_Completions.clear();
+      }
+    }
+    if (!m_Completions.empty())
+      m_Sink(m_Completions);
+    m_Completions.clear();
+  }
+
   bool ClingCodeCompleteConsumer::isResultFilteredOut(StringRef Filter,
                                                   CodeCompletionResult Result) {
     switch (Result.Kind) {
@@ -8,6 +8,8 @@
 //------------------------------------------------------------------------------
 
 #include "cling/Interpreter/DynamicLibraryManager.h"
+#include "SymbolLookupCache.h"
+
 #include "cling/Interpreter/InterpreterCallbacks.h"
 #include "cling/Interpreter/InvocationOptions.h"
 #include "cling/Utils/Paths.h"
@@ -18,6 +20,7 @@
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Path.h"
 
+#include <algorithm>
 #include <system_error>
 #include <sys/stat.h>
 
@@ -204,6 +207,7 @@ namespace cling {
     if (!insRes.second)
       return kLoadLibAlreadyLoaded;
     m_LoadedLibraries.insert(canonicalLoadedLib);
+    SymbolLookupCache::get().libraryLoaded(canonicalLoadedLib);
     return kLoadLibSuccess;
   }
 
@@ -229,6 +233,7 @@ namespace cling {
       cling::errs() << "cling::DynamicLibraryManager::unloadLibrary(): "
                     << errMsg << '\n';
     }
+    SymbolLookupCache::get().libraryUnloaded();
 
     if (InterpreterCallbacks* C = getCallbacks())
       C->LibraryUnloaded(dyLibHandle, canonicalLoadedLib);
@@ -244,8 +249,18 @@ namespace cling {
     return false;
   }
 
+  std::vector<std::string> DynamicLibraryManager::getLoadedLibraries() const {
+    std::vector<std::string> Libs;
+    Libs.reserve(m_LoadedLibraries.size());
+    for (const auto& Lib : m_LoadedLibraries)
+      Libs.push_back(Lib.getKey().str());
+    std::sort(Libs.begin(), Libs.end());
+    return Libs;
+  }
+
   void DynamicLibraryManager::ExposeHiddenSharedLibrarySymbols(void* handle) {
     llvm::sys::DynamicLibrary::addPermanentLibrary(const_cast<void*>(handle));
+    SymbolLookupCache::get().invalidate();
   }
 
   bool DynamicLibraryManager::isSharedLibrary(llvm::StringRef libFullPath,
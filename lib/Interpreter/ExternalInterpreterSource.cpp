@@ -14,6 +14,7 @@
 #include "clang/AST/ASTContext.h"
 #include "clang/AST/ASTDiagnostic.h"
 #include "clang/AST/ASTImporter.h"
+#include "clang/AST/DeclContextInternals.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Sema/Sema.h"
@@ -36,6 +37,7 @@ namespace {
 
     Decl *Imported(Decl *From, Decl *To) override {
       ASTImporter::Imported(From, To);
+      m_Source.addToImportedFrom(From);
 
       if (clang::TagDecl* toTagDecl = dyn_cast<TagDecl>(To)) {
         toTagDecl->setHasExternalLexicalStorage();
@@ -273,4 +275,29 @@ namespace cling {
     const_cast<DeclContext *>(childDeclContext)->
                                       setHasExternalVisibleStorage(false);
   }
+
+  bool ExternalInterpreterSource::hasImported(const Decl *parent) const {
+    if (m_ImportedFrom.count(parent))
+      return true;
+    // A namespace reopened by the parent is a new Decl, while what it
+    // declares might have been imported through the first one.
+    if (!isa<NamespaceDecl>(parent) && !isa<LinkageSpecDecl>(parent))
+      return false;
+    for (const Decl *D : cast<DeclContext>(parent)->noload_decls())
+      if (hasImported(D))
+        return true;
+    return false;
+  }
+
+  void ExternalInterpreterSource::reconcile() {
+    for (auto& IDeclContext : m_ImportedDeclContexts) {
+      DeclContext *childDeclContext =
+                            const_cast<DeclContext *>(IDeclContext.first);
+      childDeclContext->setHasExternalVisibleStorage(true);
+      // As DeclContext::reconcileExternalVisibleStorage() does.
+      if (StoredDeclsMap *Map = childDeclContext->getLookupPtr())
+        for (auto& Lookup : *Map)
+          Lookup.second.setHasExternalDecls();
+    }
+  }
 } // end namespace cling
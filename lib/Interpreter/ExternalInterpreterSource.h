@@ -14,6 +14,7 @@
 
 #include <string>
 #include <map>
+#include <set>
 
 namespace clang {
   class ASTContext;
@@ -53,6 +54,10 @@ namespace cling {
         ///
         std::map <clang::DeclarationName, clang::DeclarationName > m_ImportedDecls;
 
+        ///\brief The Decls of the first Interpreter that were imported.
+        ///
+        std::set<const clang::Decl *> m_ImportedFrom;
+
         ///\brief The ASTImporter which does the actual imports from the parent
         /// interpreter to the child interpreter.
         std::unique_ptr<clang::ASTImporter> m_Importer;
@@ -64,6 +69,12 @@ namespace cling {
 
         void completeVisibleDeclsMap(const clang::DeclContext *DC) override;
 
+        ///\brief Make what the parent declared since the last lookups
+        /// visible: the names found or missed before, and the contexts
+        /// already completed, are looked up in the parent again. The decls
+        /// imported before are reused.
+        void reconcile();
+
         bool FindExternalVisibleDeclsByName(
                               const clang::DeclContext *childCurrentDeclContext,
                               clang::DeclarationName childDeclName) override;
@@ -92,6 +103,14 @@ namespace cling {
                               clang::DeclContext *parent) {
           m_ImportedDeclContexts[child] = parent;
         }
+
+        void addToImportedFrom(const clang::Decl *parent) {
+          m_ImportedFrom.insert(parent);
+        }
+
+        ///\brief Whether a Decl of the first Interpreter, or one within it,
+        /// was imported: the child refers to it until it is recreated.
+        bool hasImported(const clang::Decl *parent) const;
     };
 } // end namespace cling
 
@@ -11,6 +11,7 @@
 #include "IncrementalJIT.h"
 #include "Threading.h"
 
+#include "cling/Interpreter/InvocationOptions.h"
 #include "cling/Interpreter/Value.h"
 #include "cling/Interpreter/Transaction.h"
 #include "cling/Utils/AST.h"
@@ -88,7 +89,8 @@ CreateHostTargetMachine(const clang::CompilerInstance& CI) {
 } // anonymous namespace
 
 IncrementalExecutor::IncrementalExecutor(clang::DiagnosticsEngine& diags,
-                                         const clang::CompilerInstance& CI):
+                                         const clang::CompilerInstance& CI,
+                                         const InvocationOptions& Opts):
   m_Callbacks(nullptr), m_externalIncrementalExecutor(nullptr)
 #if 0
   : m_Diags(diags)
@@ -103,7 +105,36 @@ IncrementalExecutor::IncrementalExecutor(clang::DiagnosticsEngine& diags,
                                           CI.getTargetOpts(),
                                           CI.getLangOpts(),
                                           *TM));
-  m_JIT.reset(new IncrementalJIT(*this, std::move(TM)));
+  std::unique_ptr<JITObjectCache> ObjCache;
+  if (!Opts.JITCachePath.empty())
+    ObjCache.reset(new JITObjectCache(Opts.JITCachePath, Opts.JITCacheLimit,
+                                      *TM));
+  m_JIT.reset(new IncrementalJIT(*this, std::move(TM), Opts.LazyJIT,
+                                 std::move(ObjCache)));
+
+  // The hot functions are optimized in the background, with a TargetMachine
+  // of their own.
+  if (Opts.TieredJIT) {
+    if (std::unique_ptr<TargetMachine> TierTM = CreateHostTargetMachine(CI))
+      m_TieredJIT.reset(new TieredJIT(*m_JIT, std::move(TierTM),
+                                      CI.getCodeGenOpts(), CI.getTargetOpts(),
+                                      CI.getLangOpts(), Opts.JITProfile));
+  }
+
+  // Each partition is compiled with a TargetMachine of its own. Lazily
+  // compiled functions are compiled one at a time anyway, and tiered ones at
+  // -O0.
+  if (Opts.ParallelJIT > 1 && !Opts.LazyJIT && !Opts.TieredJIT) {
+    std::vector<std::unique_ptr<TargetMachine>> PartTMs;
+    for (unsigned I = 0; I < Opts.ParallelJIT; ++I)
+      if (std::unique_ptr<TargetMachine> PartTM = CreateHostTargetMachine(CI))
+        PartTMs.push_back(std::move(PartTM));
+    if (PartTMs.size() > 1)
+      m_ParallelBackend.reset(new ParallelBackend(std::move(PartTMs),
+                                                  CI.getCodeGenOpts(),
+                                                  CI.getTargetOpts(),
+                                                  CI.getLangOpts()));
+  }
 }
 
 // Keep in source: ~unique_ptr<ClingJIT> needs ClingJIT
@@ -298,6 +329,16 @@ IncrementalExecutor::runStaticInitializersOnce(const Transaction& T) const {
   return kExeSuccess;
 }
 
+void IncrementalExecutor::optimizeWithProfile(llvm::raw_ostream& OS) {
+  if (!m_TieredJIT || !m_TieredJIT->isProfiling()) {
+    OS << "Profile-guided optimization is not enabled (cling -fjit-pgo)\n";
+    return;
+  }
+  size_t Queued = m_TieredJIT->optimizeProfiled();
+  OS << Queued << " function" << (Queued == 1 ? "" : "s")
+     << " queued for re-optimization with their profile\n";
+}
+
 void IncrementalExecutor::runAndRemoveStaticDestructors(Transaction* T) {
   assert(T && "Must be set");
   // Collect all the dtors bound to this transaction.
@@ -335,6 +376,7 @@ IncrementalExecutor::executeWrapper(llvm::StringRef function,
   ExecutionResult res = jitInitOrWrapper(function, fun);
   if (res != kExeSuccess)
     return res;
+  TieredJIT::RunningUserCode tier(m_TieredJIT.get());
   EnterUserCodeRAII euc(m_Callbacks);
   (*fun)(returnValue);
 
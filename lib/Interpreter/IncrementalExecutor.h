@@ -14,6 +14,8 @@
 
 #include "BackendPasses.h"
 #include "EnterUserCodeRAII.h"
+#include "ParallelBackend.h"
+#include "TieredJIT.h"
 
 #include "cling/Interpreter/InterpreterCallbacks.h"
 #include "cling/Interpreter/Transaction.h"
@@ -25,6 +27,7 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/StringRef.h"
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <memory>
@@ -45,6 +48,7 @@ namespace llvm {
 
 namespace cling {
   class IncrementalJIT;
+  class InvocationOptions;
   class Value;
 
   class IncrementalExecutor {
@@ -59,6 +63,13 @@ namespace cling {
     // optimizer etc passes
     std::unique_ptr<BackendPasses> m_BackendPasses;
 
+    ///\brief Re-optimizes hot functions if cling runs with -ftiered-jit.
+    std::unique_ptr<TieredJIT> m_TieredJIT;
+
+    ///\brief Optimizes large modules in partitions if cling runs with
+    /// -fparallel-jit.
+    std::unique_ptr<ParallelBackend> m_ParallelBackend;
+
     ///\brief Whom to call upon invocation of user code.
     InterpreterCallbacks* m_Callbacks;
 
@@ -151,7 +162,8 @@ namespace cling {
     };
 
     IncrementalExecutor(clang::DiagnosticsEngine& diags,
-                        const clang::CompilerInstance& CI);
+                        const clang::CompilerInstance& CI,
+                        const InvocationOptions& Opts);
 
     ~IncrementalExecutor();
 
@@ -165,6 +177,8 @@ namespace cling {
 
     ///\brief Unload a set of JIT symbols.
     bool unloadModule(const std::shared_ptr<llvm::Module>& M) const {
+      if (m_TieredJIT)
+        m_TieredJIT->forgetModule(M.get());
       // FIXME: Propagate the error in a more verbose way.
       if (auto Err = m_JIT->removeModule(M))
         return false;
@@ -198,10 +212,26 @@ namespace cling {
 
     ///\brief Emit a llvm::Module to the JIT.
     ///
+    /// With -ftiered-jit the module is compiled at -O0 and its hot functions
+    /// are re-optimized later, at optLevel but at least -O2. With
+    /// -fparallel-jit a large module is optimized and compiled in partitions,
+    /// concurrently.
+    ///
     /// @param[in] module - The module to pass to the execution engine.
     /// @param[in] optLevel - The optimization level to be used.
     void
     emitModule(const std::shared_ptr<llvm::Module>& module, int optLevel) const {
+      if (m_TieredJIT) {
+        m_TieredJIT->instrumentModule(*module, std::max(optLevel, 2));
+        optLevel = 0;
+      }
+      if (m_ParallelBackend) {
+        std::vector<ParallelBackend::ObjectPtr> Objects;
+        if (m_ParallelBackend->compile(*module, optLevel, Objects)) {
+          m_JIT->addModuleObjects(module.get(), std::move(Objects));
+          return;
+        }
+      }
       if (m_BackendPasses)
         m_BackendPasses->runOnModule(*module, optLevel);
 
@@ -243,6 +273,20 @@ namespace cling {
     /// print an error message if that fails.
     void* NotifyLazyFunctionCreators(const std::string&) const;
 
+    ///\brief Print the memory usage of the JITted code and data.
+    void printMemoryStats(llvm::raw_ostream& OS, bool JSON) const {
+      m_JIT->getMemoryStats().print(OS, JSON);
+    }
+
+    ///\brief Print the hits and size of the JIT object cache.
+    void printObjectCacheStats(llvm::raw_ostream& OS, bool JSON) const {
+      m_JIT->printObjectCacheStats(OS, JSON);
+    }
+
+    ///\brief Re-optimize the functions that ran, with their profile
+    /// (cling -fjit-pgo).
+    void optimizeWithProfile(llvm::raw_ostream& OS);
+
   private:
     ///\brief Report and empty m_unresolvedSymbols.
     ///\return true if m_unresolvedSymbols was non-empty.
@@ -10,11 +10,17 @@
 #include "IncrementalJIT.h"
 
 #include "IncrementalExecutor.h"
+#include "SymbolLookupCache.h"
 #include "cling/Utils/Platform.h"
 
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
 
 #if defined(__APPLE__) || defined (_MSC_VER)
 // Apple and Windows add an extra '_'
@@ -27,15 +33,29 @@ namespace {
 
 ///\brief Memory manager providing the lop-level link to the
 /// IncrementalExecutor, handles missing or special / replaced symbols.
-class ClingMemoryManager: public SectionMemoryManager {
+class ClingMemoryManager: public cling::JITMemoryManager {
 public:
-  ClingMemoryManager(cling::IncrementalExecutor& Exe) {}
+  ClingMemoryManager(cling::IncrementalExecutor& Exe,
+                     std::shared_ptr<cling::JITMemoryPool> Pool):
+    JITMemoryManager(std::move(Pool)) {}
 
   ///\brief Simply wraps the base class's function setting AbortOnFailure
   /// to false and instead using the error handling mechanism to report it.
   void* getPointerToNamedFunction(const std::string &Name,
                                   bool /*AbortOnFailure*/ =true) override {
-    return SectionMemoryManager::getPointerToNamedFunction(Name, false);
+    return RTDyldMemoryManager::getPointerToNamedFunction(Name, false);
+  }
+
+  ///\brief Look symbols of the process up through the SymbolLookupCache,
+  /// rather than searching all libraries each time.
+  uint64_t getSymbolAddress(const std::string &Name) override {
+    llvm::StringRef NameNP = Name;
+#ifdef __APPLE__
+    // As in getSymbolAddressInProcess(), the symbols of the libraries are
+    // looked up without the leading '_'.
+    NameNP.consume_front("_");
+#endif
+    return uint64_t(cling::SymbolLookupCache::get().lookup(NameNP));
   }
 };
 
@@ -50,6 +70,83 @@ public:
     cling::IncrementalJIT &m_JIT;
   };
 
+  ///\brief Declares, in a function's partition, the globals it refers to.
+  class DeclMaterializer: public ValueMaterializer {
+    Module& m_M;
+  public:
+    DeclMaterializer(Module& M) : m_M(M) {}
+
+    Value* materialize(Value* V) override {
+      auto* GV = dyn_cast<GlobalValue>(V);
+      if (!GV)
+        return nullptr;
+      GlobalValue* Decl;
+      if (auto* FTy = dyn_cast<FunctionType>(GV->getValueType())) {
+        Function* F = Function::Create(FTy, GlobalValue::ExternalLinkage,
+                                       GV->getName(), &m_M);
+        if (auto* Src = dyn_cast<Function>(GV)) {
+          F->setCallingConv(Src->getCallingConv());
+          F->setAttributes(Src->getAttributes());
+        }
+        Decl = F;
+      } else {
+        auto* Src = dyn_cast<GlobalVariable>(GV);
+        Decl = new GlobalVariable(m_M, GV->getValueType(),
+                                  Src && Src->isConstant(),
+                                  GlobalValue::ExternalLinkage, nullptr,
+                                  GV->getName(), nullptr,
+                                  GV->getThreadLocalMode(),
+                                  GV->getType()->getAddressSpace());
+      }
+      Decl->setVisibility(GV->getVisibility());
+      Decl->setDLLStorageClass(GV->getDLLStorageClass());
+      return ConstantExpr::getBitCast(Decl, GV->getType());
+    }
+  };
+
+  ///\brief Whether a function can be compiled on its own, once something
+  /// refers to it.
+  static bool isDeferrable(const Function& F) {
+    // Local functions cannot be referred to from another partition; only
+    // the ones that KeepLocalGVPass could not export are left.
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage() ||
+        F.hasLocalLinkage())
+      return false;
+    // Keep the debug info whole.
+    if (F.getSubprogram())
+      return false;
+    for (const BasicBlock& BB : F)
+      if (BB.hasAddressTaken())
+        return false;
+    return true;
+  }
+
+  ///\brief Copy a function into a module of its own, declaring what it
+  /// refers to.
+  static std::shared_ptr<Module> extractFunction(const Function& F) {
+    const Module& Src = *F.getParent();
+    auto M = std::make_shared<Module>(F.getName(), F.getContext());
+    M->setDataLayout(Src.getDataLayout());
+    M->setTargetTriple(Src.getTargetTriple());
+
+    Function* NewF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                                      F.getName(), M.get());
+    NewF->copyAttributesFrom(&F);
+    NewF->setComdat(nullptr);
+    ValueToValueMapTy VMap;
+    VMap[&F] = NewF;
+    auto NewArg = NewF->arg_begin();
+    for (const Argument& Arg : F.args()) {
+      NewArg->setName(Arg.getName());
+      VMap[&Arg] = &*NewArg++;
+    }
+    DeclMaterializer Materializer(*M);
+    SmallVector<ReturnInst*, 8> Returns;
+    CloneFunctionInto(NewF, &F, VMap, /*ModuleLevelChanges*/ true, Returns,
+                      "", nullptr, nullptr, &Materializer);
+    return M;
+  }
+
 } // unnamed namespace
 
 namespace cling {
@@ -65,23 +162,13 @@ class Azog: public RTDyldMemoryManager {
     uint8_t *m_End     = nullptr;
     uint8_t *m_Current = nullptr;
 
-    void allocate(RTDyldMemoryManager *exeMM,
+    void allocate(cling::JITMemoryManager *exeMM,
+                  cling::JITMemoryManager::Sections& Owner,
                   uintptr_t Size, uint32_t Align,
-                  bool code, bool isReadOnly) {
+                  cling::JITMemoryPool::Kind Kind) {
 
       uintptr_t RequiredSize = Size;
-      if (code)
-        m_Start = exeMM->allocateCodeSection(RequiredSize, Align,
-                                             0 /* SectionID */,
-                                             "codeReserve");
-      else if (isReadOnly)
-        m_Start = exeMM->allocateDataSection(RequiredSize, Align,
-                                             0 /* SectionID */,
-                                             "rodataReserve",isReadOnly);
-      else
-        m_Start = exeMM->allocateDataSection(RequiredSize, Align,
-                                             0 /* SectionID */,
-                                             "rwataReserve",isReadOnly);
+      m_Start = exeMM->allocate(Kind, RequiredSize, Align, Owner);
       m_Current = m_Start;
       m_End = m_Start + RequiredSize;
     }
@@ -126,6 +213,9 @@ class Azog: public RTDyldMemoryManager {
   AllocInfo m_ROData;
   AllocInfo m_RWData;
 
+  ///\brief The memory of this object, given back when it is removed.
+  cling::JITMemoryManager::Sections m_Sections;
+
 #ifdef CLING_WIN_SEH_EXCEPTIONS
   uintptr_t getBaseAddr() const {
     if (LLVM_LIKELY(m_Code.m_Start && m_ROData.m_Start && m_RWData.m_Start)) {
@@ -145,12 +235,17 @@ class Azog: public RTDyldMemoryManager {
   // FIXME: This is directly mirroring a structure in RTDyldMemoryManager that
   // is private. Get Win64 exceptions into LLVM or add an accessor for it.
   platform::windows::EHFrameInfos m_EHFrames;
+#else
+  ///\brief The EH frames registered for this object; its memory may be
+  /// reused once it is removed, so they cannot outlive it.
+  std::vector<std::pair<uint8_t*, size_t>> m_EHFrames;
 #endif
 
 public:
   Azog(cling::IncrementalJIT& Jit): m_jit(Jit) {}
+  ~Azog() { deregisterEHFrames(); }
 
-  RTDyldMemoryManager* getExeMM() const { return m_jit.m_ExeMM.get(); }
+  cling::JITMemoryManager* getExeMM() const { return m_jit.m_ExeMM.get(); }
 
   uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
                                unsigned SectionID,
@@ -160,7 +255,8 @@ public:
       Addr = m_Code.getNextAddr(Size, Alignment);
     }
     if (!Addr) {
-      Addr = getExeMM()->allocateCodeSection(Size, Alignment, SectionID, SectionName);
+      Addr = getExeMM()->allocate(cling::JITMemoryPool::kCode, Size,
+                                  Alignment, m_Sections);
       m_jit.m_SectionsAllocatedSinceLastLoad.insert(Addr);
     }
 
@@ -178,8 +274,9 @@ public:
       Addr = m_RWData.getNextAddr(Size,Alignment);
     }
     if (!Addr) {
-      Addr = getExeMM()->allocateDataSection(Size, Alignment, SectionID,
-                                                   SectionName, IsReadOnly);
+      Addr = getExeMM()->allocate(IsReadOnly ? cling::JITMemoryPool::kROData
+                                             : cling::JITMemoryPool::kRWData,
+                                  Size, Alignment, m_Sections);
       m_jit.m_SectionsAllocatedSinceLastLoad.insert(Addr);
     }
     return Addr;
@@ -188,9 +285,12 @@ public:
   void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
                               uintptr_t RODataSize, uint32_t RODataAlign,
                               uintptr_t RWDataSize, uint32_t RWDataAlign) override {
-    m_Code.allocate(getExeMM(),CodeSize, CodeAlign, true, false);
-    m_ROData.allocate(getExeMM(),RODataSize, RODataAlign, false, true);
-    m_RWData.allocate(getExeMM(),RWDataSize, RWDataAlign, false, false);
+    m_Code.allocate(getExeMM(), m_Sections, CodeSize, CodeAlign,
+                    cling::JITMemoryPool::kCode);
+    m_ROData.allocate(getExeMM(), m_Sections, RODataSize, RODataAlign,
+                      cling::JITMemoryPool::kROData);
+    m_RWData.allocate(getExeMM(), m_Sections, RWDataSize, RWDataAlign,
+                      cling::JITMemoryPool::kRWData);
 
     m_jit.m_SectionsAllocatedSinceLastLoad.insert(m_Code.m_Start);
     m_jit.m_SectionsAllocatedSinceLastLoad.insert(m_ROData.m_Start);
@@ -207,7 +307,8 @@ public:
     const platform::windows::RuntimePRFunction PRFunc = { Addr, Size };
     m_EHFrames.emplace_back(PRFunc);
 #else
-    return getExeMM()->registerEHFrames(Addr, LoadAddr, Size);
+    registerEHFramesInProcess(Addr, Size);
+    m_EHFrames.emplace_back(Addr, Size);
 #endif
   }
 
@@ -216,7 +317,9 @@ public:
     platform::DeRegisterEHFrames(getBaseAddr(), m_EHFrames);
     platform::windows::EHFrameInfos().swap(m_EHFrames);
 #else
-    return getExeMM()->deregisterEHFrames();
+    for (auto& Frame : m_EHFrames)
+      deregisterEHFramesInProcess(Frame.first, Frame.second);
+    m_EHFrames.clear();
 #endif
   }
 
@@ -271,16 +374,22 @@ public:
 }; // class Azog
 
 IncrementalJIT::IncrementalJIT(IncrementalExecutor& exe,
-                               std::unique_ptr<TargetMachine> TM):
+                               std::unique_ptr<TargetMachine> TM,
+                               bool LazyFunctions,
+                               std::unique_ptr<JITObjectCache> ObjCache):
   m_Parent(exe),
   m_TM(std::move(TM)),
   m_TMDataLayout(m_TM->createDataLayout()),
-  m_ExeMM(std::make_shared<ClingMemoryManager>(m_Parent)),
+  m_ObjectCache(std::move(ObjCache)),
+  m_MemoryPool(std::make_shared<cling::JITMemoryPool>()),
+  m_ExeMM(std::make_shared<ClingMemoryManager>(m_Parent, m_MemoryPool)),
   m_NotifyObjectLoaded(*this),
-  m_ObjectLayer(m_SymbolMap, [this] () { return llvm::make_unique<Azog>(*this); },
+  m_ObjectLayer(m_Symbols, [this] () { return llvm::make_unique<Azog>(*this); },
                 m_NotifyObjectLoaded, NotifyFinalizedT(*this)),
-  m_CompileLayer(m_ObjectLayer, llvm::orc::SimpleCompiler(*m_TM)),
-  m_LazyEmitLayer(m_CompileLayer) {
+  m_CompileLayer(m_ObjectLayer,
+                 llvm::orc::SimpleCompiler(*m_TM, m_ObjectCache.get())),
+  m_LazyEmitLayer(m_CompileLayer),
+  m_LazyFunctions(LazyFunctions) {
 
   // Force the JIT to query for symbols local to itself, i.e. if it resides in a
   // shared library it will resolve symbols from there first. This is done to
@@ -328,47 +437,118 @@ IncrementalJIT::IncrementalJIT(IncrementalExecutor& exe,
 }
 
 
+void IncrementalJIT::NotifyObjectLoadedT::operator()(
+    llvm::orc::RTDyldObjectLinkingLayerBase::ObjHandleT H,
+    const llvm::orc::RTDyldObjectLinkingLayer::ObjectPtr &Object,
+    const llvm::LoadedObjectInfo &Info) const {
+  m_JIT.m_UnfinalizedSections[H]
+    = std::move(m_JIT.m_SectionsAllocatedSinceLastLoad);
+  m_JIT.m_SectionsAllocatedSinceLastLoad = SectionAddrSet();
+
+  // FIXME: NotifyObjectEmitted requires a RuntimeDyld::LoadedObjectInfo
+  // object. In order to get it one should call
+  // RTDyld.loadObject(*ObjToLoad->getBinary()) according to r306058.
+  // Moreover this should be done in the finalizer. Currently we are
+  // disabling this since we have globally disabled this functionality in
+  // IncrementalJIT.cpp (m_GDBListener = 0).
+  //
+  // if (auto GDBListener = m_JIT.m_GDBListener)
+  //   GDBListener->NotifyObjectEmitted(*Object->getBinary(), Info);
+
+  const object::ObjectFile& Obj = *Object->getBinary();
+  for (const auto &Symbol: Obj.symbols()) {
+    auto Flags = Symbol.getFlags();
+    if (Flags & (object::BasicSymbolRef::SF_Undefined |
+                 object::BasicSymbolRef::SF_FormatSpecific))
+      continue;
+    // FIXME: this should be uncommented once we serve incremental
+    // modules from a TU module.
+    //if (!(Flags & llvm::object::BasicSymbolRef::SF_Exported))
+    //  continue;
+    auto NameOrError = Symbol.getName();
+    if (!NameOrError) {
+      consumeError(NameOrError.takeError());
+      continue;
+    }
+    JITSymbolTable::Symbol* S = m_JIT.m_Symbols.intern(NameOrError.get());
+    if (S->Address)
+      continue;
+
+    // A strong definition is where RuntimeDyld loaded its section. A weak
+    // one might have been resolved to another definition, and a common one
+    // has no section: ask the object layer about those.
+    JITTargetAddress Addr = 0;
+    if ((Flags & object::BasicSymbolRef::SF_Exported) &&
+        !(Flags & (object::BasicSymbolRef::SF_Weak |
+                   object::BasicSymbolRef::SF_Common |
+                   object::BasicSymbolRef::SF_Absolute))) {
+      auto SecOrErr = Symbol.getSection();
+      auto AddrOrErr = Symbol.getAddress();
+      if (SecOrErr && AddrOrErr && *SecOrErr != Obj.section_end()) {
+        if (uint64_t Load = Info.getSectionLoadAddress(**SecOrErr))
+          Addr = Load + *AddrOrErr - (*SecOrErr)->getAddress();
+      }
+      if (!SecOrErr)
+        consumeError(SecOrErr.takeError());
+      if (!AddrOrErr)
+        consumeError(AddrOrErr.takeError());
+    }
+    if (!Addr) {
+      JITSymbol Sym = m_JIT.m_CompileLayer.findSymbolIn(H, S->name(), true);
+      if (auto AddrOrErr = Sym.getAddress())
+        Addr = *AddrOrErr;
+      else
+        consumeError(AddrOrErr.takeError());
+    }
+    S->Address = Addr;
+  }
+}
+
 llvm::JITSymbol
-IncrementalJIT::getInjectedSymbols(const std::string& Name) const {
-  using JITSymbol = llvm::JITSymbol;
-  auto SymMapI = m_SymbolMap.find(Name);
-  if (SymMapI != m_SymbolMap.end())
-    return JITSymbol(SymMapI->second, llvm::JITSymbolFlags::Exported);
+IncrementalJIT::getInjectedSymbols(llvm::StringRef Name) const {
+  if (JITTargetAddress Addr = m_Symbols.lookup(Name))
+    return llvm::JITSymbol(Addr, llvm::JITSymbolFlags::Exported);
 
-  return JITSymbol(nullptr);
+  return llvm::JITSymbol(nullptr);
 }
 
 std::pair<void*, bool>
 IncrementalJIT::lookupSymbol(llvm::StringRef Name, void *InAddr, bool Jit) {
   // FIXME: See comments on DLSym below.
 #if !defined(LLVM_ON_WIN32)
-  void* Addr = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(Name);
+  void* Addr = SymbolLookupCache::get().lookup(Name);
 #else
   void* Addr = const_cast<void*>(platform::DLSym(Name));
 #endif
 
   if (InAddr && (!Addr || Jit)) {
     if (Jit) {
-      std::string Key(Name);
 #ifdef MANGLE_PREFIX
-      Key.insert(0, MANGLE_PREFIX);
+      llvm::SmallString<128> Key(MANGLE_PREFIX);
+      Key += Name;
+#else
+      llvm::StringRef Key = Name;
 #endif
-      m_SymbolMap[Key] = llvm::JITTargetAddress(InAddr);
+      m_Symbols.intern(Key)->Address = llvm::JITTargetAddress(InAddr);
     }
     llvm::sys::DynamicLibrary::AddSymbol(Name, InAddr);
+    SymbolLookupCache::get().symbolAdded(Name);
     return std::make_pair(InAddr, true);
   }
   return std::make_pair(Addr, false);
 }
     
 llvm::JITSymbol
-IncrementalJIT::getSymbolAddressWithoutMangling(const std::string& Name,
+IncrementalJIT::getSymbolAddressWithoutMangling(llvm::StringRef Name,
                                                 bool AlsoInProcess) {
-  if (auto Sym = getInjectedSymbols(Name))
-    return Sym;
+  // Most lookups are for symbols that were emitted already: one probe of
+  // m_Symbols, without allocating.
+  const JITSymbolTable::Symbol* S = m_Symbols.find(Name);
+  if (S && S->Address)
+    return llvm::JITSymbol(S->Address, llvm::JITSymbolFlags::Exported);
 
   if (AlsoInProcess) {
-    if (llvm::JITSymbol SymInfo = m_ExeMM->findSymbol(Name)) {
+    if (llvm::JITSymbol SymInfo = m_ExeMM->findSymbol(Name.str())) {
       if (auto AddrOrErr = SymInfo.getAddress())
         return llvm::JITSymbol(*AddrOrErr, llvm::JITSymbolFlags::Exported);
       else
@@ -388,29 +568,41 @@ IncrementalJIT::getSymbolAddressWithoutMangling(const std::string& Name,
 #endif
   }
 
-  if (auto Sym = m_LazyEmitLayer.findSymbol(Name, false))
-    return Sym;
+  // The names of the symbols defined by modules were interned when they were
+  // indexed.
+  if (!S)
+    return llvm::JITSymbol(nullptr);
+  auto IIndex = m_SymbolIndex.find(S);
+  if (IIndex != m_SymbolIndex.end()) {
+    // A module that is being emitted does not provide symbols yet; an older
+    // one might.
+    const std::string NameStr = Name;
+    for (auto H : IIndex->second)
+      if (auto Sym = m_LazyEmitLayer.findSymbolIn(H, NameStr, false))
+        return Sym;
+  }
 
   return llvm::JITSymbol(nullptr);
 }
 
-void IncrementalJIT::addModule(const std::shared_ptr<llvm::Module>& module) {
-  // If this module doesn't have a DataLayout attached then attach the
-  // default.
-  module->setDataLayout(m_TMDataLayout);
-
+std::shared_ptr<llvm::JITSymbolResolver> IncrementalJIT::makeResolver() {
   // LLVM MERGE FIXME: update this to use new interfaces.
-  auto Resolver = llvm::orc::createLambdaResolver(
-    [&](const std::string &S) {
+  return llvm::orc::createLambdaResolver(
+    [this](const std::string &S) {
       if (auto Sym = getInjectedSymbols(S)) {
         if (auto AddrOrErr = Sym.getAddress())
           return JITSymbol((uint64_t)*AddrOrErr, Sym.getFlags());
         else
           llvm_unreachable("Handle the error case");
       }
+      // Objects linked together resolve each other's symbols before those
+      // of the process, as if they were one.
+      for (auto H : m_LinkingObjects)
+        if (auto Sym = m_ObjectLayer.findSymbolIn(H, S, false))
+          return Sym;
       return m_ExeMM->findSymbol(S);
     },
-    [&](const std::string &Name) {
+    [this](const std::string &Name) {
       if (auto Sym = getSymbolAddressWithoutMangling(Name, true)) {
         if (auto AddrOrErr = Sym.getAddress())
           return JITSymbol(*AddrOrErr, Sym.getFlags());
@@ -442,7 +634,7 @@ void IncrementalJIT::addModule(const std::shared_ptr<llvm::Module>& module) {
       /// to book-keep emitted sections in the IncrementalJIT). (ROOT-10426)
       decltype(m_ExeMM) outerExeMM;
       swap(outerExeMM, m_ExeMM);
-      m_ExeMM = std::make_shared<ClingMemoryManager>(m_Parent);
+      m_ExeMM = std::make_shared<ClingMemoryManager>(m_Parent, m_MemoryPool);
       decltype(m_UnfinalizedSections) outerUnfinalizedSections;
       swap(m_UnfinalizedSections, outerUnfinalizedSections);
       uint64_t addr = uint64_t(getParent().NotifyLazyFunctionCreators(*NameNP));
@@ -450,24 +642,167 @@ void IncrementalJIT::addModule(const std::shared_ptr<llvm::Module>& module) {
       swap(m_UnfinalizedSections, outerUnfinalizedSections);
       return JITSymbol(addr, llvm::JITSymbolFlags::Weak);
     });
+}
 
-  if (auto H = m_LazyEmitLayer.addModule(module, std::move(Resolver)))
-    m_UnloadPoints[module.get()] = *H;
-  else
+void IncrementalJIT::addModule(const std::shared_ptr<llvm::Module>& module) {
+  // If this module doesn't have a DataLayout attached then attach the
+  // default.
+  module->setDataLayout(m_TMDataLayout);
+
+  if (!m_LazyFunctions) {
+    addToLazyEmitLayer(module.get(), module);
+    return;
+  }
+
+  // Each function gets a module of its own, the rest stays together. The
+  // LazyEmitLayer compiles a partition once a symbol of it is looked up,
+  // i.e. when code referring to it is linked or run.
+  std::set<const llvm::GlobalValue*> Deferred;
+  for (const llvm::Function& F : module->functions())
+    if (isDeferrable(F))
+      Deferred.insert(&F);
+  // An alias must stay with what it aliases.
+  for (const llvm::GlobalAlias& GA : module->aliases())
+    Deferred.erase(GA.getBaseObject());
+
+  std::vector<std::shared_ptr<llvm::Module>> Parts;
+  {
+    llvm::ValueToValueMapTy VMap;
+    auto ShouldClone = [&Deferred](const llvm::GlobalValue* GV) {
+      return !Deferred.count(GV);
+    };
+    Parts.push_back(llvm::CloneModule(module.get(), VMap, ShouldClone));
+  }
+  for (const llvm::GlobalValue* GV : Deferred)
+    Parts.push_back(extractFunction(*llvm::cast<llvm::Function>(GV)));
+  for (auto& Part : Parts)
+    addToLazyEmitLayer(module.get(), std::move(Part));
+}
+
+void IncrementalJIT::addToLazyEmitLayer(llvm::Module* Owner,
+                                        std::shared_ptr<llvm::Module> Part) {
+  llvm::Module& M = *Part;
+  if (auto H = m_LazyEmitLayer.addModule(std::move(Part), makeResolver())) {
+    m_UnloadPoints[Owner].push_back(*H);
+    indexModule(Owner, M, *H);
+  } else
     llvm_unreachable("Handle the error case");
 }
 
+void IncrementalJIT::indexModule(llvm::Module* Owner,
+                                 const llvm::Module& Part, ModuleHandleT H) {
+  llvm::Mangler Mang;
+  auto& Names = m_ModuleSymbols[Owner];
+  auto addSymbol = [&](const llvm::GlobalValue& GV) {
+    // As in the LazyEmittingLayer, modules don't provide declarations or
+    // common symbols; nor do they emit available_externally definitions.
+    if (GV.isDeclaration() || GV.hasCommonLinkage() ||
+        GV.hasAvailableExternallyLinkage())
+      return;
+    llvm::SmallString<128> Name;
+    Mang.getNameWithPrefix(Name, &GV, false);
+    const JITSymbolTable::Symbol* S = m_Symbols.intern(Name);
+    m_SymbolIndex[S].push_back(H);
+    Names.emplace_back(S, H);
+  };
+  for (const auto& F : Part.functions())
+    addSymbol(F);
+  for (const auto& GV : Part.globals())
+    addSymbol(GV);
+  for (const auto& GA : Part.aliases())
+    addSymbol(GA);
+}
+
+void IncrementalJIT::unindexModule(llvm::Module* Owner) {
+  auto ISymbols = m_ModuleSymbols.find(Owner);
+  if (ISymbols == m_ModuleSymbols.end())
+    return;
+  for (auto& NameHandle : ISymbols->second) {
+    auto IIndex = m_SymbolIndex.find(NameHandle.first);
+    if (IIndex == m_SymbolIndex.end())
+      continue;
+    auto& Handles = IIndex->second;
+    Handles.erase(std::remove(Handles.begin(), Handles.end(),
+                              NameHandle.second),
+                  Handles.end());
+    if (Handles.empty())
+      m_SymbolIndex.erase(IIndex);
+  }
+  m_ModuleSymbols.erase(ISymbols);
+}
+
 llvm::Error
 IncrementalJIT::removeModule(const std::shared_ptr<llvm::Module>& module) {
+  auto IObjects = m_ModuleObjects.find(module.get());
+  if (IObjects != m_ModuleObjects.end()) {
+    for (auto H : IObjects->second)
+      if (auto Err = m_ObjectLayer.removeObject(H))
+        return Err;
+    m_ModuleObjects.erase(IObjects);
+  }
+
   // FIXME: Track down what calls this routine on a not-yet-added module. Once
   // this is resolved we can remove this check enabling the assert.
   auto IUnload = m_UnloadPoints.find(module.get());
   if (IUnload == m_UnloadPoints.end())
     return llvm::Error::success();
-  auto Handle = IUnload->second;
-  assert(*Handle && "Trying to remove a non existent module!");
+  auto Handles = std::move(IUnload->second);
   m_UnloadPoints.erase(IUnload);
-  return m_LazyEmitLayer.removeModule(Handle);
+  unindexModule(module.get());
+  for (auto Handle : Handles) {
+    assert(*Handle && "Trying to remove a non existent module!");
+    if (auto Err = m_LazyEmitLayer.removeModule(Handle))
+      return Err;
+  }
+  return llvm::Error::success();
+}
+
+uint64_t IncrementalJIT::addTierObject(llvm::Module* Owner,
+                                       ObjectLayerT::ObjectPtr Object,
+                                       const std::string& Name) {
+  auto H = m_ObjectLayer.addObject(std::move(Object), makeResolver());
+  if (!H) {
+    llvm::consumeError(H.takeError());
+    return 0;
+  }
+  m_ModuleObjects[Owner].push_back(*H);
+  if (auto Err = m_ObjectLayer.emitAndFinalize(*H)) {
+    llvm::consumeError(std::move(Err));
+    return 0;
+  }
+  if (auto Sym = m_ObjectLayer.findSymbolIn(*H, Mangle(Name), false)) {
+    if (auto AddrOrErr = Sym.getAddress())
+      return *AddrOrErr;
+    else
+      llvm::consumeError(AddrOrErr.takeError());
+  }
+  return 0;
+}
+
+void
+IncrementalJIT::addModuleObjects(llvm::Module* Owner,
+                                 std::vector<ObjectLayerT::ObjectPtr> Objects) {
+  // All objects must be known before any is finalized: finalizing one
+  // finalizes, first, those it refers to.
+  auto& Handles = m_ModuleObjects[Owner];
+  const size_t First = Handles.size();
+  for (auto& Object : Objects) {
+    auto H = m_ObjectLayer.addObject(std::move(Object), makeResolver());
+    if (!H) {
+      cling::errs() << "IncrementalJIT: cannot add object: "
+                    << llvm::toString(H.takeError()) << '\n';
+      continue;
+    }
+    Handles.push_back(*H);
+  }
+  const auto Added = llvm::makeArrayRef(Handles).slice(First);
+  m_LinkingObjects.insert(m_LinkingObjects.end(), Added.begin(), Added.end());
+  for (auto H : Added)
+    if (auto Err = m_ObjectLayer.finalizeObject(H))
+      cling::errs() << "IncrementalJIT: cannot link object: "
+                    << llvm::toString(std::move(Err)) << '\n';
+  m_LinkingObjects.erase(m_LinkingObjects.end() - Added.size(),
+                         m_LinkingObjects.end());
 }
 
 }// end namespace cling
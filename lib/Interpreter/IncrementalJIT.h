@@ -10,8 +10,16 @@
 #ifndef CLING_INCREMENTAL_JIT_H
 #define CLING_INCREMENTAL_JIT_H
 
+#include "JITMemoryManager.h"
+#include "JITObjectCache.h"
+#include "JITSymbolTable.h"
+
 #include "cling/Utils/Output.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/ExecutionEngine/JITEventListener.h"
@@ -39,58 +47,23 @@ class Azog;
 class IncrementalExecutor;
 
 class IncrementalJIT {
-public:
-  using SymbolMapT = llvm::StringMap<llvm::JITTargetAddress>;
-
-private:
   friend class Azog;
 
   ///\brief The IncrementalExecutor who owns us.
   IncrementalExecutor& m_Parent;
   llvm::JITEventListener* m_GDBListener; // owned by llvm::ManagedStaticBase
 
-  SymbolMapT m_SymbolMap;
+  ///\brief The symbols of the emitted objects and those injected through
+  /// lookupSymbol(), by interned name. The names of the symbols that
+  /// modules will define are interned as the modules are added.
+  JITSymbolTable m_Symbols;
 
   class NotifyObjectLoadedT {
   public:
     NotifyObjectLoadedT(IncrementalJIT &jit) : m_JIT(jit) {}
     void operator()(llvm::orc::RTDyldObjectLinkingLayerBase::ObjHandleT H,
                     const llvm::orc::RTDyldObjectLinkingLayer::ObjectPtr &Object,
-                    const llvm::LoadedObjectInfo &Info) const {
-      m_JIT.m_UnfinalizedSections[H]
-        = std::move(m_JIT.m_SectionsAllocatedSinceLastLoad);
-      m_JIT.m_SectionsAllocatedSinceLastLoad = SectionAddrSet();
-
-      // FIXME: NotifyObjectEmitted requires a RuntimeDyld::LoadedObjectInfo
-      // object. In order to get it one should call
-      // RTDyld.loadObject(*ObjToLoad->getBinary()) according to r306058.
-      // Moreover this should be done in the finalizer. Currently we are
-      // disabling this since we have globally disabled this functionality in
-      // IncrementalJIT.cpp (m_GDBListener = 0).
-      //
-      // if (auto GDBListener = m_JIT.m_GDBListener)
-      //   GDBListener->NotifyObjectEmitted(*Object->getBinary(), Info);
-
-      for (const auto &Symbol: Object->getBinary()->symbols()) {
-        auto Flags = Symbol.getFlags();
-        if (Flags & llvm::object::BasicSymbolRef::SF_Undefined)
-          continue;
-        // FIXME: this should be uncommented once we serve incremental
-        // modules from a TU module.
-        //if (!(Flags & llvm::object::BasicSymbolRef::SF_Exported))
-        //  continue;
-        auto NameOrError = Symbol.getName();
-        if (!NameOrError)
-          continue;
-        auto Name = NameOrError.get();
-        if (m_JIT.m_SymbolMap.find(Name) == m_JIT.m_SymbolMap.end()) {
-          llvm::JITSymbol Sym
-            = m_JIT.m_CompileLayer.findSymbolIn(H, Name, true);
-          if (auto Addr = Sym.getAddress())
-            m_JIT.m_SymbolMap[Name] = *Addr;
-        }
-      }
-    }
+                    const llvm::LoadedObjectInfo &Info) const;
 
   private:
     IncrementalJIT &m_JIT;
@@ -100,11 +73,11 @@ private:
   public:
     using Base_t = llvm::orc::RTDyldObjectLinkingLayer;
     using NotifyFinalizedFtor = Base_t::NotifyFinalizedFtor;
-    RemovableObjectLinkingLayer(SymbolMapT &SymMap,
+    RemovableObjectLinkingLayer(JITSymbolTable &Symbols,
                                 Base_t::MemoryManagerGetter MM,
                                 NotifyObjectLoadedT NotifyLoaded,
                                 NotifyFinalizedFtor NotifyFinalized)
-      : Base_t(MM, NotifyLoaded, NotifyFinalized), m_SymbolMap(SymMap)
+      : Base_t(MM, NotifyLoaded, NotifyFinalized), m_Symbols(Symbols)
     {}
 
     llvm::Error
@@ -118,17 +91,27 @@ private:
       const AccessSymbolTable* HSymTable
         = static_cast<const AccessSymbolTable*>(H->get());
       for (auto&& NameSym: HSymTable->getSymbolTable()) {
-        auto iterSymMap = m_SymbolMap.find(NameSym.first());
-        if (iterSymMap == m_SymbolMap.end())
-          continue;
+        JITSymbolTable::Symbol* S = m_Symbols.find(NameSym.first());
         // Is this this symbol (address)?
-        if (iterSymMap->second == NameSym.second.getAddress())
-          m_SymbolMap.erase(iterSymMap);
+        if (S && S->Address == NameSym.second.getAddress())
+          S->Address = 0;
       }
       return llvm::orc::RTDyldObjectLinkingLayer::removeObject(H);
     }
+
+    ///\brief Finalize an object, unless it was finalized already to resolve
+    /// the symbols of another one.
+    llvm::Error
+    finalizeObject(llvm::orc::RTDyldObjectLinkingLayerBase::ObjHandleT H) {
+      struct AccessFinalized: public LinkedObject {
+        bool isFinalized() const { return Finalized; }
+      };
+      if (static_cast<const AccessFinalized*>(H->get())->isFinalized())
+        return llvm::Error::success();
+      return emitAndFinalize(H);
+    }
   private:
-    SymbolMapT& m_SymbolMap;
+    JITSymbolTable& m_Symbols;
   };
 
   typedef RemovableObjectLinkingLayer ObjectLayerT;
@@ -140,9 +123,15 @@ private:
   std::unique_ptr<llvm::TargetMachine> m_TM;
   llvm::DataLayout m_TMDataLayout;
 
+  ///\brief Objects compiled by earlier sessions, or null.
+  std::unique_ptr<JITObjectCache> m_ObjectCache;
+
+  ///\brief The pages of all sections emitted by this JIT.
+  std::shared_ptr<JITMemoryPool> m_MemoryPool;
+
   ///\brief The RTDyldMemoryManager used to communicate with the
   /// IncrementalExecutor to handle missing or special symbols.
-  std::shared_ptr<llvm::RTDyldMemoryManager> m_ExeMM;
+  std::shared_ptr<JITMemoryManager> m_ExeMM;
 
   NotifyObjectLoadedT m_NotifyObjectLoaded;
 
@@ -164,8 +153,36 @@ private:
   std::map<ObjectLayerT::ObjHandleT, SectionAddrSet, ObjHandleCompare>
     m_UnfinalizedSections;
 
-  ///\brief Mapping between \c llvm::Module* and \c ModuleHandleT.
-  std::map<llvm::Module*, ModuleHandleT> m_UnloadPoints;
+  ///\brief Mapping between \c llvm::Module* and the \c ModuleHandleT of
+  /// the module, or of its partitions if functions are compiled lazily.
+  std::map<llvm::Module*, llvm::SmallVector<ModuleHandleT, 1>> m_UnloadPoints;
+
+  ///\brief Whether each function of a module is compiled only once linked
+  /// code refers to it (cling -flazy-jit).
+  bool m_LazyFunctions;
+
+  ///\brief For each symbol defined by an added module, the modules defining
+  /// it, oldest first. Lookups go straight to the right module instead of
+  /// asking each module of the LazyEmittingLayer in turn.
+  llvm::DenseMap<const JITSymbolTable::Symbol*,
+                 llvm::SmallVector<ModuleHandleT, 1>> m_SymbolIndex;
+
+  ///\brief The symbols each module added to m_SymbolIndex and the handle
+  /// they were added for, so that unloading a module costs its own size
+  /// only.
+  std::map<llvm::Module*,
+           std::vector<std::pair<const JITSymbolTable::Symbol*,
+                                 ModuleHandleT>>>
+    m_ModuleSymbols;
+
+  ///\brief Objects added by addTierObject() or addModuleObjects(), removed
+  /// with their module.
+  std::map<llvm::Module*, std::vector<ObjectLayerT::ObjHandleT>>
+    m_ModuleObjects;
+
+  ///\brief Objects added by addModuleObjects() that are being linked: they
+  /// resolve each other's symbols.
+  std::vector<ObjectLayerT::ObjHandleT> m_LinkingObjects;
 
   std::string Mangle(llvm::StringRef Name) {
     stdstrstream MangledName;
@@ -173,11 +190,30 @@ private:
     return MangledName.str();
   }
 
-  llvm::JITSymbol getInjectedSymbols(const std::string& Name) const;
+  llvm::JITSymbol getInjectedSymbols(llvm::StringRef Name) const;
+
+  ///\brief Add a module, or one of its partitions, to the LazyEmitLayer.
+  ///\param Owner - the module as passed to addModule().
+  ///\param Part - what to add: the module itself or one of its partitions.
+  void addToLazyEmitLayer(llvm::Module* Owner,
+                          std::shared_ptr<llvm::Module> Part);
+
+  ///\brief Add the symbols defined by a module (partition) to
+  /// m_SymbolIndex, on behalf of Owner.
+  void indexModule(llvm::Module* Owner, const llvm::Module& Part,
+                   ModuleHandleT H);
+
+  ///\brief Remove the symbols added on behalf of Owner from m_SymbolIndex.
+  void unindexModule(llvm::Module* Owner);
+
+  ///\brief The resolver of the symbols referenced by emitted objects.
+  std::shared_ptr<llvm::JITSymbolResolver> makeResolver();
 
 public:
   IncrementalJIT(IncrementalExecutor& exe,
-                 std::unique_ptr<llvm::TargetMachine> TM);
+                 std::unique_ptr<llvm::TargetMachine> TM,
+                 bool LazyFunctions = false,
+                 std::unique_ptr<JITObjectCache> ObjCache = nullptr);
 
   ///\brief Get the address of a symbol from the JIT or the memory manager,
   /// mangling the name as needed. Use this to resolve symbols as coming
@@ -186,11 +222,15 @@ public:
   ///   (prefixed by '_') to make IR versus symbol names.
   /// \param AlsoInProcess - Sometimes you only care about JITed symbols. If so,
   ///   pass `false` here to not resolve the symbol through dlsym().
-  uint64_t getSymbolAddress(const std::string& Name, bool AlsoInProcess) {
+  uint64_t getSymbolAddress(llvm::StringRef Name, bool AlsoInProcess) {
+    // Mangle on the stack: this is called for each global the interpreter
+    // looks up.
+    llvm::SmallString<128> Mangled;
+    llvm::Mangler::getNameWithPrefix(Mangled, Name, m_TMDataLayout);
     // FIXME: We should decide if we want to handle the error here or make the
     // return type of the function llvm::Expected<uint64_t> relying on the
     // users to decide how to handle the error.
-    if (auto S = getSymbolAddressWithoutMangling(Mangle(Name), AlsoInProcess)) {
+    if (auto S = getSymbolAddressWithoutMangling(Mangled, AlsoInProcess)) {
       if (auto AddrOrErr = S.getAddress())
         return *AddrOrErr;
       else
@@ -202,14 +242,45 @@ public:
 
   ///\brief Get the address of a symbol from the JIT or the memory manager.
   /// Use this to resolve symbols of known, target-specific names.
-  llvm::JITSymbol getSymbolAddressWithoutMangling(const std::string& Name,
+  llvm::JITSymbol getSymbolAddressWithoutMangling(llvm::StringRef Name,
                                                   bool AlsoInProcess);
 
   void addModule(const std::shared_ptr<llvm::Module>& module);
   llvm::Error removeModule(const std::shared_ptr<llvm::Module>& module);
 
+  ///\brief Link an object compiled from (part of) a module that was added
+  /// before, and return the address of one of its symbols. The object is
+  /// removed with that module.
+  /// \param Owner - the module the object was compiled from.
+  /// \param Object - the object.
+  /// \param Name - the symbol to look for, as named in the IR.
+  /// \returns The address of the symbol, or 0 if the object could not be
+  ///   linked.
+  uint64_t addTierObject(llvm::Module* Owner, ObjectLayerT::ObjectPtr Object,
+                         const std::string& Name);
+
+  ///\brief Link the objects compiled from the partitions of a module, in
+  /// place of the module. They are removed with that module.
+  /// \param Owner - the module the objects were compiled from.
+  /// \param Objects - the objects, which may refer to each other.
+  void addModuleObjects(llvm::Module* Owner,
+                        std::vector<ObjectLayerT::ObjectPtr> Objects);
+
   IncrementalExecutor& getParent() const { return m_Parent; }
 
+  const JITMemoryStats& getMemoryStats() const {
+    return m_MemoryPool->getStats();
+  }
+
+  void printObjectCacheStats(llvm::raw_ostream& OS, bool JSON) const {
+    if (m_ObjectCache)
+      m_ObjectCache->printStats(OS, JSON);
+    else if (JSON)
+      OS << "{}\n";
+    else
+      OS << "JIT object cache is not enabled (cling --jit-cache=<dir>)\n";
+  }
+
   void RemoveUnfinalizedSection(
                      llvm::orc::RTDyldObjectLinkingLayerBase::ObjHandleT H) {
     m_UnfinalizedSections.erase(H);
@@ -2,14 +2,40 @@
 #include "cling/Interpreter/Interpreter.h"
 #include "cling/Interpreter/Transaction.h"
 #include "cling/MetaProcessor/InputValidator.h"
+#include "cling/Utils/Platform.h"
 #include "cling/Utils/SourceNormalization.h"
 
+#include "clang/AST/Decl.h"
+#include "clang/AST/DeclCXX.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/MultiplexConsumer.h"
 
 #include "clang/Basic/LangOptions.h"
 #include "clang/Basic/SourceManager.h"
+#include "clang/Basic/VirtualFileSystem.h"
 #include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Sema/Sema.h"
+#include "clang/Sema/SemaConsumer.h"
+
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
 
 using namespace clang;
 namespace cling {
@@ -29,101 +55,767 @@ namespace cling {
     return std::string(buf_begin, buf_end);
   }
 
+  namespace {
+    ///\brief Prefix of the name of the function wrapping a statement entry
+    /// while its declarations are extracted.
+    const char* const extractFunctionName = "__cling_custom_sycl_extract_";
+
+    ///\brief The statement entries whose declarations are extracted by a
+    /// single parse. Each input is dumped into a wrapper function of its own,
+    /// whose declarations are made global once it is parsed, so that the
+    /// following entries can refer to them.
+    struct ExtractRun {
+      ///\brief Unique numbers of the entries.
+      std::vector<size_t> uniques;
+      ///\brief Offsets of the input of each entry in the dumped file.
+      std::vector<std::pair<unsigned, unsigned>> ranges;
+      ///\brief Extracted declarations of each entry.
+      std::vector<std::string> declCode;
+      ///\brief Input of each entry without the extracted declarations.
+      std::vector<std::string> body;
+
+      ///\brief Marker written before the input of the i-th entry.
+      std::string beginMarker(size_t i) const {
+        return "/*__cling_sycl_begin_" + std::to_string(uniques[i]) + "*/\n";
+      }
+      ///\brief Marker written after the input of the i-th entry.
+      std::string endMarker(size_t i) const {
+        return "\n/*__cling_sycl_end_" + std::to_string(uniques[i]) + "*/";
+      }
+    };
+  } // unnamed namespace
+
   // Rewrite ASTConsumer to implement Decl Extractor to make the Decl inside
   // the wrap function Global
-  class InterpreterConsumer : public ASTConsumer {
+  class InterpreterConsumer : public SemaConsumer {
   private:
     const ASTContext& m_context;
-    IncrementalSYCLDeviceCompiler::MapUnique& m_UniqueToEntry;
-    int lastUnique;
-    const std::vector<const char*> clearTargets = {"= <null expr>"};
-    // Clear Unexpected Output introduced by Decl::print
-    void clearPrint(std::string& input) {
-      for (auto targetCString : clearTargets) {
-        std::string target(targetCString);
-        size_t pos = 0;
-        while (pos < input.length() &&
-               (pos = input.find(target, pos)) != std::string::npos) {
-          input.erase(pos, target.length());
-        }
-      }
+    ExtractRun& m_Run;
+    Rewriter m_Rewriter;
+    Sema* m_Sema = nullptr;
+
+    ///\brief Move a declaration of a wrapper function to the global scope,
+    /// as the host does, for the rest of the parse.
+    void makeGlobal(Decl* D) {
+      NamedDecl* ND = dyn_cast<NamedDecl>(D);
+      if (!ND || !ND->getDeclName() || !m_Sema)
+        return;
+      TranslationUnitDecl* TU = m_context.getTranslationUnitDecl();
+      ND->getDeclContext()->removeDecl(ND);
+      ND->setDeclContext(TU);
+      ND->setLexicalDeclContext(TU);
+      TU->addDecl(ND);
+      m_Sema->PushOnScopeChains(ND, m_Sema->TUScope,
+                                /*AddToContext*/ false);
     }
 
   public:
-    explicit InterpreterConsumer(
-        const ASTContext& context,
-        IncrementalSYCLDeviceCompiler::MapUnique& UniqueToEntry, int lastUnique)
-        : m_context(context), m_UniqueToEntry(UniqueToEntry),
-          lastUnique(lastUnique) {}
+    explicit InterpreterConsumer(ASTContext& context, ExtractRun& Run)
+        : m_context(context), m_Run(Run),
+          m_Rewriter(context.getSourceManager(), context.getLangOpts()) {
+      m_Run.declCode.assign(m_Run.uniques.size(), std::string());
+      m_Run.body.assign(m_Run.uniques.size(), std::string());
+    }
     virtual ~InterpreterConsumer() {}
+    void InitializeSema(Sema& S) { m_Sema = &S; }
+    void ForgetSema() { m_Sema = nullptr; }
     bool HandleTopLevelDecl(clang::DeclGroupRef DGR) {
-      std::string DumpText;
-      llvm::raw_string_ostream dump(DumpText);
+      const SourceManager& SM = m_context.getSourceManager();
       for (auto it = DGR.begin(); it != DGR.end(); it++) {
-        Decl* D = *it;
-        if (D->isFunctionOrFunctionTemplate()) {
-          // Extract only the decl inside wrapper function
-          FunctionDecl* FD = cast<FunctionDecl>(D);
-          std::string FunctionName = FD->getNameAsString();
-          if (FunctionName.find("__cling_custom_sycl_") != 0)
+        FunctionDecl* FD = dyn_cast<FunctionDecl>(*it);
+        if (!FD || !FD->hasBody() || !FD->getDeclName().isIdentifier() ||
+            !FD->getName().startswith(extractFunctionName))
+          continue;
+        // Extract only the decl inside wrapper function
+        CompoundStmt* CS = cast<CompoundStmt>(FD->getBody());
+        for (CompoundStmt::body_iterator I = CS->body_begin(),
+                                         EI = CS->body_end();
+             I != EI; ++I) {
+          DeclStmt* DS = dyn_cast<DeclStmt>(*I);
+          if (!DS)
             continue;
-          int unique = std::stoi(FunctionName.substr(20));
-          // Only handle the new wrapper
-          if (unique > lastUnique) {
-            CompoundStmt* CS = dyn_cast<CompoundStmt>(FD->getBody());
-            for (CompoundStmt::body_iterator I = CS->body_begin(),
-                                             EI = CS->body_end();
-                 I != EI; ++I) {
-              DeclStmt* DS = dyn_cast<DeclStmt>(*I);
-              if (!DS) {
-                // dump << std::string("void __cling_wrapper__costom__") +
-                //                 std::to_string(++m_counter) +
-                //                 std::string("(){\n");
-                // (*I)->printPretty(dump, NULL, PrintingPolicy(LangOptions()));
-                // dump << ";\n}\n";
-                continue;
-              }
-              for (DeclStmt::decl_iterator J = DS->decl_begin();
-                   J != DS->decl_end(); ++J) {
-                // Use Decl::print to dump the AST into cpp 
-                (*J)->print(dump);
-                // dump << getRawSourceCode(m_context, (*J)->getSourceRange());
-                dump << ";\n";
-              }
-            }
-	    // replace the code of code entry
-            if (m_UniqueToEntry.count(unique)) {
-              dump << m_UniqueToEntry[unique]->code;
-              dump.flush();
-              clearPrint(DumpText);
-              m_UniqueToEntry[unique]->code = std::move(DumpText);
-            }
-          }
+          // Find the entry the declaration was written in.
+          unsigned offset =
+              SM.getFileOffset(SM.getExpansionLoc(DS->getLocStart()));
+          size_t i = 0;
+          while (i < m_Run.ranges.size() && offset >= m_Run.ranges[i].second)
+            ++i;
+          if (i == m_Run.ranges.size() || offset < m_Run.ranges[i].first)
+            continue;
+          // Move the declaration, as written, out of the wrapper.
+          m_Run.declCode[i] +=
+              getRawSourceCode(m_context, DS->getSourceRange()) + "\n";
+          m_Rewriter.RemoveText(
+              CharSourceRange::getTokenRange(DS->getSourceRange()));
+          for (Decl* D : DS->decls())
+            makeGlobal(D);
         }
       }
-      dump.flush();
       return true;
     }
+
+    void HandleTranslationUnit(ASTContext& context) {
+      const RewriteBuffer& RB =
+          m_Rewriter.getEditBuffer(context.getSourceManager().getMainFileID());
+      std::string Rewritten(RB.begin(), RB.end());
+      for (size_t i = 0; i < m_Run.uniques.size(); ++i) {
+        const std::string begin = m_Run.beginMarker(i);
+        size_t pos = Rewritten.find(begin);
+        size_t end = Rewritten.find(m_Run.endMarker(i), pos);
+        if (pos == std::string::npos || end == std::string::npos)
+          continue;
+        pos += begin.length();
+        m_Run.body[i] = Rewritten.substr(pos, end - pos);
+      }
+    }
   };
 
-  class InterpreterClassAction : public ASTFrontendAction {
-    IncrementalSYCLDeviceCompiler::MapUnique& m_UniqueToEntry;
-    int lastUnique;
+  // Extract the declarations and write the resulting AST to a PCH, which the
+  // next parse is chained on.
+  class InterpreterClassAction : public GeneratePCHAction {
+    ExtractRun& m_Run;
 
   public:
-    explicit InterpreterClassAction(
-        IncrementalSYCLDeviceCompiler::MapUnique& UniqueToEntry, int lastUnique)
-        : m_UniqueToEntry(UniqueToEntry), lastUnique(lastUnique) {}
+    explicit InterpreterClassAction(ExtractRun& Run) : m_Run(Run) {}
     virtual std::unique_ptr<clang::ASTConsumer>
     CreateASTConsumer(clang::CompilerInstance& Compiler,
                       llvm::StringRef InFile) {
-      InterpreterConsumer* consumer =
-          new InterpreterConsumer(Compiler.getASTContext(), m_UniqueToEntry,
-                                  lastUnique);
-      return std::unique_ptr<clang::ASTConsumer>(consumer);
+      std::unique_ptr<ASTConsumer> PCHWriter =
+          GeneratePCHAction::CreateASTConsumer(Compiler, InFile);
+      if (!PCHWriter)
+        return nullptr;
+      std::vector<std::unique_ptr<ASTConsumer>> Consumers;
+      Consumers.emplace_back(
+          new InterpreterConsumer(Compiler.getASTContext(), m_Run));
+      Consumers.push_back(std::move(PCHWriter));
+      return llvm::make_unique<MultiplexConsumer>(std::move(Consumers));
     }
   };
 
+  namespace {
+    const char* const wrapperSuffix = "\n;\n}";
+
+    ///\brief Wrap the input of a statement entry in its wrapper function.
+    std::string wrapStatement(const std::string& Input, size_t unique) {
+      return "void __cling_custom_sycl_" + std::to_string(unique) +
+             "() {\n" + Input + wrapperSuffix;
+    }
+
+    ///\brief The input of a statement entry, as passed to wrapStatement().
+    std::string unwrapStatement(const std::string& code) {
+      size_t begin = code.find("{\n") + 2;
+      return code.substr(begin, code.length() - strlen(wrapperSuffix) - begin);
+    }
+
+    ///\brief Write the code of a DumpCodeEntry and add ';' if necessary.
+    void dumpEntryCode(llvm::raw_ostream& OS, const std::string& code,
+                       unsigned int isStatement) {
+      OS << code;
+      // Find the last valid character and add ';' if necessary
+      for (auto sit = code.rbegin(); sit != code.rend(); sit++) {
+        if (*sit != ' ') {
+          if (isStatement == 0) {
+            if (*sit == '}')
+              OS << ";\n";
+            else
+              OS << "\n";
+          } else {
+            if (*sit == ';')
+              OS << '\n';
+            else
+              OS << ";\n";
+          }
+          break;
+        }
+      }
+    }
+
+    ///\brief Write the part of a DumpCodeEntry which later units depend on:
+    /// the whole declaration, or the declarations extracted out of a wrapper
+    /// function. The wrapper itself is never referenced again.
+    void dumpEntryDecls(llvm::raw_ostream& OS, const DumpCodeEntry& Entry) {
+      if (Entry.isStatement)
+        OS << Entry.declCode;
+      else
+        dumpEntryCode(OS, Entry.code, Entry.isStatement);
+    }
+
+    ///\brief Replace every occurrence of the identifier From by To.
+    void replaceIdentifier(std::string& input, const std::string& From,
+                           const std::string& To) {
+      auto isIdentChar = [](char c) { return isalnum(c) || c == '_'; };
+      size_t pos = 0;
+      while ((pos = input.find(From, pos)) != std::string::npos) {
+        size_t end = pos + From.length();
+        if ((pos > 0 && isIdentChar(input[pos - 1])) ||
+            (end < input.length() && isIdentChar(input[end]))) {
+          pos = end;
+          continue;
+        }
+        input.replace(pos, From.length(), To);
+        pos += To.length();
+      }
+    }
+
+    ///\brief Replace every occurrence of From by To.
+    void replaceAll(std::string& input, const std::string& From,
+                    const std::string& To) {
+      size_t pos = 0;
+      while ((pos = input.find(From, pos)) != std::string::npos) {
+        input.replace(pos, From.length(), To);
+        pos += To.length();
+      }
+    }
+
+    ///\brief Run a program without going through the shell.
+    ///
+    ///\returns The exit code of the program, or -1 if it could not be run.
+    int runProgram(const std::string& Program,
+                   const std::vector<std::string>& Args) {
+      std::vector<const char*> Argv;
+      Argv.push_back(Program.c_str());
+      for (auto& Arg : Args)
+        Argv.push_back(Arg.c_str());
+      Argv.push_back(nullptr);
+      std::string ErrMsg;
+      int Result = llvm::sys::ExecuteAndWait(Program, Argv.data(), nullptr,
+                                             nullptr, 0, 0, &ErrMsg);
+      if (Result < 0)
+        llvm::errs() << "SYCL: could not run " << Program << ": " << ErrMsg
+                     << "\n";
+      return Result;
+    }
+
+    ///\brief Split a job line printed by the driver's -### into arguments.
+    /// Every argument is quoted, with '"', '\\' and '$' escaped.
+    std::vector<std::string> splitJobLine(llvm::StringRef Line) {
+      std::vector<std::string> Args;
+      size_t pos = 0;
+      while ((pos = Line.find('"', pos)) != llvm::StringRef::npos) {
+        std::string Arg;
+        for (++pos; pos < Line.size() && Line[pos] != '"'; ++pos) {
+          if (Line[pos] == '\\' && pos + 1 < Line.size())
+            ++pos;
+          Arg += Line[pos];
+        }
+        Args.push_back(std::move(Arg));
+        ++pos;
+      }
+      return Args;
+    }
+
+    ///\brief True if every non-empty line of the code is a preprocessor
+    /// directive.
+    bool isPreprocessorOnly(const std::string& code) {
+      llvm::SmallVector<llvm::StringRef, 4> Lines;
+      llvm::StringRef(code).split(Lines, '\n', -1, false);
+      bool hasDirective = false;
+      for (llvm::StringRef Line : Lines) {
+        Line = Line.trim();
+        if (Line.empty())
+          continue;
+        if (!Line.startswith("#"))
+          return false;
+        hasDirective = true;
+      }
+      return hasDirective;
+    }
+
+    ///\brief True if a keyword may precede the name of a declaration, e.g.
+    /// int or const, as opposed to e.g. return or throw.
+    bool mayPrecedeDeclName(const Token& Tok) {
+      return !Tok.isOneOf(tok::kw_return, tok::kw_case, tok::kw_goto,
+                          tok::kw_throw, tok::kw_delete, tok::kw_new,
+                          tok::kw_else, tok::kw_do, tok::kw_sizeof,
+                          tok::kw_namespace);
+    }
+
+    ///\brief True if the macro is defined by the user, as opposed to a
+    /// builtin, predefined or system macro.
+    bool isUserMacro(Preprocessor& PP, const MacroInfo* MI) {
+      if (!MI || MI->isBuiltinMacro())
+        return false;
+      SourceLocation Loc = MI->getDefinitionLoc();
+      return Loc.isValid() && !PP.getSourceManager().isInSystemHeader(Loc) &&
+             PP.getSourceManager().getFileID(Loc) != PP.getPredefinesFileID();
+    }
+
+    ///\brief Collect the name of a declaration written outside of the system
+    /// headers, and those of the declarations of the namespaces and linkage
+    /// specifications it opens.
+    void collectDeclNames(const SourceManager& SM, const Decl* D,
+                          std::unordered_set<std::string>& Names) {
+      SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+      if (Loc.isInvalid() || SM.isInSystemHeader(Loc))
+        return;
+      if (const NamedDecl* ND = dyn_cast<NamedDecl>(D))
+        if (ND->getIdentifier())
+          Names.insert(ND->getName().str());
+      if (isa<NamespaceDecl>(D) || isa<LinkageSpecDecl>(D))
+        for (const Decl* Child : cast<DeclContext>(D)->decls())
+          collectDeclNames(SM, Child, Names);
+    }
+
+    ///\brief Collect the names declared by a transaction and the
+    /// transactions nested in it.
+    void collectDeclNames(const SourceManager& SM, const Transaction& T,
+                          std::unordered_set<std::string>& Names) {
+      for (auto I = T.decls_begin(), E = T.decls_end(); I != E; ++I)
+        for (const Decl* D : I->m_DGR)
+          collectDeclNames(SM, D, Names);
+      for (auto I = T.nested_begin(), E = T.nested_end(); I != E; ++I)
+        collectDeclNames(SM, **I, Names);
+    }
+
+    ///\brief Lex the code and collect the names it uses and declares at the
+    /// outermost level, and whether it launches a kernel. This is a cheap
+    /// approximation of what the SYCL compiler would see: it errs towards
+    /// reporting names as declared, which only costs an extra compilation.
+    void scanCode(Preprocessor& PP, const std::string& code,
+                  CodeNames& Names) {
+      static const char* const kernelNames[] = {
+          "parallel_for", "parallel_for_work_group", "single_task",
+          "kernel_parallel_for", "kernel_single_task", "sycl_kernel"};
+      Lexer RawLex(SourceLocation(), PP.getLangOpts(), code.data(),
+                   code.data(), code.data() + code.size());
+      // Previous two tokens at the outermost level, and the last identifier
+      // of a typedef.
+      Token Prev, PrevPrev;
+      Prev.startToken();
+      PrevPrev.startToken();
+      std::string TypedefName;
+      bool inTypedef = false;
+      unsigned depth = 0;
+      Token Tok;
+      do {
+        RawLex.LexFromRawLexer(Tok);
+        if (Tok.is(tok::hash) && Tok.isAtStartOfLine())
+          Names.hasDirectives = true;
+        if (Tok.is(tok::raw_identifier))
+          PP.LookUpIdentifierInfo(Tok);
+        if (Tok.is(tok::identifier)) {
+          if (Tok.getIdentifierInfo()->hasMacroDefinition())
+            Names.usesMacros |=
+                isUserMacro(PP, PP.getMacroInfo(Tok.getIdentifierInfo()));
+          std::string Name = Tok.getIdentifierInfo()->getName();
+          for (const char* kernelName : kernelNames)
+            Names.launchesKernel |= Name == kernelName;
+          if (depth == 0) {
+            if (Prev.isOneOf(tok::kw_struct, tok::kw_class, tok::kw_union,
+                             tok::kw_enum) ||
+                (Prev.is(tok::kw_namespace) && PrevPrev.isNot(tok::kw_using)))
+              Names.declared.insert(Name);
+            if (inTypedef)
+              TypedefName = Name;
+          }
+          Names.used.insert(std::move(Name));
+        }
+        if (depth == 0) {
+          // A name followed by one of these and preceded by a type is
+          // declared, e.g. "int x = 1;" or "std::vector<int> v(10);", but
+          // not "x = 1;" or "f(x);".
+          if (Tok.isOneOf(tok::equal, tok::semi, tok::l_brace, tok::l_square,
+                          tok::l_paren, tok::comma) &&
+              Prev.is(tok::identifier) &&
+              (PrevPrev.isOneOf(tok::identifier, tok::greater, tok::star,
+                                tok::amp, tok::ampamp) ||
+               (PrevPrev.getIdentifierInfo() && mayPrecedeDeclName(PrevPrev))))
+            Names.declared.insert(Prev.getIdentifierInfo()->getName().str());
+          if (Tok.is(tok::kw_typedef))
+            inTypedef = true;
+          if (Tok.is(tok::semi) && inTypedef) {
+            Names.declared.insert(TypedefName);
+            inTypedef = false;
+          }
+          PrevPrev = Prev;
+          Prev = Tok;
+        }
+        if (Tok.isOneOf(tok::l_brace, tok::l_paren, tok::l_square))
+          ++depth;
+        else if (Tok.isOneOf(tok::r_brace, tok::r_paren, tok::r_square) &&
+                 depth > 0)
+          --depth;
+      } while (Tok.isNot(tok::eof));
+    }
+
+    ///\brief Create the CompilerInvocation and Diagnostics of a
+    /// CompilerInstance running on the dumped code.
+    void createCompilerInstance(CompilerInstance& CI,
+                                const std::vector<const char*>& Args) {
+      // Create complie options
+      clang::CompilerInvocation::CreateFromArgs(CI.getInvocation(), Args.data(),
+                                                Args.data() + Args.size(),
+                                                CI.getDiagnostics());
+
+      // create Diagnostics after create args to suppress all warnings
+      CI.createDiagnostics();
+      assert(CI.hasDiagnostics());
+    }
+
+    ///\brief Add the wall time of a scope to a phase of SYCLCompileStats.
+    class PhaseTimer {
+      SYCLCompileStats& m_Stats;
+      SYCLCompileStats::Phase m_Phase;
+      std::chrono::steady_clock::time_point m_Start;
+
+    public:
+      PhaseTimer(SYCLCompileStats& Stats, SYCLCompileStats::Phase Phase)
+          : m_Stats(Stats), m_Phase(Phase),
+            m_Start(std::chrono::steady_clock::now()) {}
+      ~PhaseTimer() {
+        std::chrono::duration<double> Elapsed =
+            std::chrono::steady_clock::now() - m_Start;
+        m_Stats.add(m_Phase, Elapsed.count());
+      }
+    };
+
+    ///\brief Serves the memory files of IncrementalSYCLDeviceCompiler without
+    /// copying them, so that it stays valid while they change.
+    class MemoryFileSystem : public vfs::FileSystem {
+    public:
+      typedef std::unordered_map<std::string, std::pair<std::string, time_t>>
+          FileMap;
+
+    private:
+      class MemoryFile : public vfs::File {
+        vfs::Status m_Status;
+        llvm::StringRef m_Content;
+
+      public:
+        MemoryFile(vfs::Status Status, llvm::StringRef Content)
+            : m_Status(std::move(Status)), m_Content(Content) {}
+        llvm::ErrorOr<vfs::Status> status() { return m_Status; }
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+        getBuffer(const llvm::Twine& Name, int64_t FileSize,
+                  bool RequiresNullTerminator, bool IsVolatile) {
+          return llvm::MemoryBuffer::getMemBuffer(m_Content, Name.str(),
+                                                  RequiresNullTerminator);
+        }
+        std::error_code close() { return std::error_code(); }
+      };
+
+      const FileMap& m_Files;
+      std::string m_WorkingDir;
+
+      const FileMap::value_type* find(const llvm::Twine& Path) const {
+        auto it = m_Files.find(Path.str());
+        return it == m_Files.end() ? nullptr : &*it;
+      }
+
+      static vfs::Status getStatus(const FileMap::value_type& File) {
+        // Every write gets a new modification time, which also tells the
+        // versions of a file apart.
+        return vfs::Status(
+            File.first, llvm::sys::fs::UniqueID(~0ULL, File.second.second),
+            llvm::sys::toTimePoint(File.second.second), 0, 0,
+            File.second.first.size(), llvm::sys::fs::file_type::regular_file,
+            llvm::sys::fs::all_read);
+      }
+
+    public:
+      explicit MemoryFileSystem(const FileMap& Files) : m_Files(Files) {}
+
+      llvm::ErrorOr<vfs::Status> status(const llvm::Twine& Path) {
+        if (const FileMap::value_type* File = find(Path))
+          return getStatus(*File);
+        return std::make_error_code(std::errc::no_such_file_or_directory);
+      }
+
+      llvm::ErrorOr<std::unique_ptr<vfs::File>>
+      openFileForRead(const llvm::Twine& Path) {
+        if (const FileMap::value_type* File = find(Path))
+          return std::unique_ptr<vfs::File>(
+              new MemoryFile(getStatus(*File), File->second.first));
+        return std::make_error_code(std::errc::no_such_file_or_directory);
+      }
+
+      vfs::directory_iterator dir_begin(const llvm::Twine& Dir,
+                                        std::error_code& EC) {
+        EC = std::make_error_code(std::errc::no_such_file_or_directory);
+        return vfs::directory_iterator();
+      }
+
+      llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const {
+        return m_WorkingDir;
+      }
+
+      std::error_code setCurrentWorkingDirectory(const llvm::Twine& Path) {
+        m_WorkingDir = Path.str();
+        return std::error_code();
+      }
+    };
+
+    ///\brief Keeps the declarations of the SYCL compiler out of the snapshots
+    /// of the interpreter, as any session declares its own.
+    class NoRecordRAII {
+      Interpreter* m_Interpreter;
+      bool m_Record;
+
+    public:
+      explicit NoRecordRAII(Interpreter* Interp)
+          : m_Interpreter(Interp),
+            m_Record(Interp->setRecordDeclarations(false)) {}
+      ~NoRecordRAII() { m_Interpreter->setRecordDeclarations(m_Record); }
+    };
+
+    std::string readFile(const std::string& filename) {
+      auto Buffer = llvm::MemoryBuffer::getFile(filename);
+      if (!Buffer)
+        return std::string();
+      return (*Buffer)->getBuffer();
+    }
+
+    ///\brief Split the rule of a dependency file ("target: dep dep \\\n dep")
+    /// into the names of the dependencies. Spaces in names are escaped.
+    std::vector<std::string> parseDependencyFile(llvm::StringRef Content) {
+      std::vector<std::string> Deps;
+      size_t Colon = Content.find(": ");
+      if (Colon == llvm::StringRef::npos)
+        return Deps;
+      std::string Dep;
+      for (size_t i = Colon + 2; i < Content.size(); ++i) {
+        char C = Content[i];
+        if (C == '\\' && i + 1 < Content.size()) {
+          if (Content[i + 1] == ' ') {
+            Dep += Content[++i];
+            continue;
+          }
+          if (Content[i + 1] == '\n' || Content[i + 1] == '\r')
+            C = Content[++i];
+        }
+        if (!isspace(static_cast<unsigned char>(C))) {
+          Dep += C;
+        } else if (!Dep.empty()) {
+          Deps.push_back(std::move(Dep));
+          Dep.clear();
+        }
+      }
+      if (!Dep.empty())
+        Deps.push_back(std::move(Dep));
+      return Deps;
+    }
+
+    ///\brief Rewrites the declarations a unit adds to the prefix of the next
+    /// units, which would otherwise instantiate the kernels of the unit again:
+    /// functions launching kernels lose their body, and variables initialized
+    /// by a kernel launch are declared extern.
+    class StripKernelsConsumer : public ASTConsumer {
+      ASTContext& m_context;
+      Preprocessor& m_PP;
+      Rewriter m_Rewriter;
+      ///\brief Offset of the declarations to rewrite, which extend to the end
+      /// of the main file.
+      unsigned m_Begin;
+      std::string& m_Result;
+
+      bool isRewritable(SourceRange SR) const {
+        const SourceManager& SM = m_context.getSourceManager();
+        return SR.getBegin().isFileID() && SR.getEnd().isFileID() &&
+               SM.isWrittenInMainFile(SR.getBegin()) &&
+               SM.getFileOffset(SR.getBegin()) >= m_Begin;
+      }
+
+      bool launchesKernel(SourceRange SR) const {
+        CodeNames Names;
+        scanCode(m_PP, getRawSourceCode(m_context, SR), Names);
+        return Names.launchesKernel;
+      }
+
+      void stripFunction(FunctionDecl* FD) {
+        // Templates, constant evaluation and return type deduction need the
+        // body, and a constructor would keep its member initializers.
+        if (!FD->doesThisDeclarationHaveABody() || FD->isDependentContext() ||
+            FD->isConstexpr() || isa<CXXConstructorDecl>(FD) ||
+            FD->getReturnType()->getContainedAutoType())
+          return;
+        CompoundStmt* Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+        if (!Body || !launchesKernel(Body->getSourceRange()))
+          return;
+        // A member or namespace member defined out of line is already
+        // declared.
+        if (FD->isOutOfLine())
+          m_Rewriter.RemoveText(FD->getSourceRange());
+        else
+          m_Rewriter.ReplaceText(Body->getSourceRange(), ";");
+      }
+
+      void stripVariable(VarDecl* VD) {
+        if (!VD->isFileVarDecl() || !VD->hasInit() || VD->isConstexpr() ||
+            VD->isStaticDataMember() || VD->getType()->isDependentType() ||
+            !launchesKernel(VD->getInit()->getSourceRange()))
+          return;
+        std::string Decl;
+        llvm::raw_string_ostream OS(Decl);
+        VD->getType().print(OS, m_context.getPrintingPolicy(), VD->getName());
+        OS.flush();
+        // Closure and unnamed types cannot be spelled; keep the definition.
+        if (Decl.find("(lambda at ") != std::string::npos ||
+            Decl.find("(anonymous") != std::string::npos ||
+            Decl.find("(unnamed") != std::string::npos)
+          return;
+        m_Rewriter.ReplaceText(VD->getSourceRange(), "extern " + Decl);
+      }
+
+      ///\brief Rewrite a declaration; variables are only rewritten if they
+      /// are declared on their own, not as a declarator of a list.
+      void strip(Decl* D, bool SingleDecl) {
+        if (D->isImplicit() || !isRewritable(D->getSourceRange()))
+          return;
+        if (isa<NamespaceDecl>(D) || isa<LinkageSpecDecl>(D) ||
+            isa<CXXRecordDecl>(D)) {
+          DeclContext* DC = cast<DeclContext>(D);
+          if (DC->isDependentContext())
+            return;
+          std::vector<Decl*> Decls(DC->decls_begin(), DC->decls_end());
+          for (size_t i = 0; i < Decls.size(); ++i) {
+            SourceLocation Begin = Decls[i]->getLocStart();
+            strip(Decls[i],
+                  (i == 0 || Decls[i - 1]->getLocStart() != Begin) &&
+                      (i + 1 == Decls.size() ||
+                       Decls[i + 1]->getLocStart() != Begin));
+          }
+        } else if (FunctionDecl* FD = dyn_cast<FunctionDecl>(D)) {
+          stripFunction(FD);
+        } else if (VarDecl* VD = dyn_cast<VarDecl>(D)) {
+          if (SingleDecl)
+            stripVariable(VD);
+        }
+      }
+
+    public:
+      StripKernelsConsumer(ASTContext& context, Preprocessor& PP,
+                           unsigned Begin, std::string& Result)
+          : m_context(context), m_PP(PP),
+            m_Rewriter(context.getSourceManager(), context.getLangOpts()),
+            m_Begin(Begin), m_Result(Result) {}
+
+      bool HandleTopLevelDecl(DeclGroupRef DGR) {
+        for (Decl* D : DGR)
+          strip(D, DGR.isSingleDecl());
+        return true;
+      }
+
+      void HandleTranslationUnit(ASTContext& context) {
+        const SourceManager& SM = context.getSourceManager();
+        const RewriteBuffer& RB = m_Rewriter.getEditBuffer(SM.getMainFileID());
+        // Nothing before m_Begin was edited.
+        m_Result = std::string(RB.begin(), RB.end()).substr(m_Begin);
+      }
+    };
+
+    class StripKernelsAction : public ASTFrontendAction {
+      unsigned m_Begin;
+      std::string& m_Result;
+
+    public:
+      StripKernelsAction(unsigned Begin, std::string& Result)
+          : m_Begin(Begin), m_Result(Result) {}
+      std::unique_ptr<ASTConsumer>
+      CreateASTConsumer(CompilerInstance& Compiler,
+                        llvm::StringRef InFile) {
+        return std::unique_ptr<ASTConsumer>(
+            new StripKernelsConsumer(Compiler.getASTContext(),
+                                     Compiler.getPreprocessor(), m_Begin,
+                                     m_Result));
+      }
+    };
+  } // unnamed namespace
+
+  bool KernelInfoHeader::parse(const std::string& content,
+                               const std::string& suffix) {
+    std::string header(content);
+    // These arrays are defined at namespace scope by every integration header.
+    for (const char* name :
+         {"kernel_names", "kernel_signatures", "kernel_signature_start"})
+      replaceIdentifier(header, name, std::string(name) + suffix);
+
+    const std::string specBegin = "template <> struct KernelInfo<";
+    const std::string specEnd = "\n};\n";
+    const std::string nameBegin = "getName() { return \"";
+    size_t epiloguePos = header.rfind("} // namespace detail");
+    if (epiloguePos == std::string::npos)
+      return false;
+    size_t pos = header.find(specBegin);
+    if (pos == std::string::npos || pos > epiloguePos)
+      pos = epiloguePos;
+    prologue = header.substr(0, pos);
+    kernels.clear();
+    while (pos < epiloguePos) {
+      size_t end = header.find(specEnd, pos);
+      size_t namePos = header.find(nameBegin, pos);
+      if (end == std::string::npos || namePos == std::string::npos ||
+          namePos > end)
+        return false;
+      namePos += nameBegin.length();
+      std::string name =
+          header.substr(namePos, header.find('"', namePos) - namePos);
+      end += specEnd.length();
+      kernels.emplace_back(std::move(name), header.substr(pos, end - pos));
+      pos = header.find(specBegin, end);
+      if (pos == std::string::npos || pos > epiloguePos)
+        pos = epiloguePos;
+    }
+    epilogue = header.substr(epiloguePos);
+
+    // Walk back from the first specialization to the openings of the
+    // namespaces closed by the epilogue, skipping the arrays in between.
+    size_t closings = std::count(epilogue.begin(), epilogue.end(), '}');
+    size_t openEnd = std::string::npos;
+    size_t depth = 0;
+    for (size_t i = prologue.length(); i-- > 0 && closings;) {
+      if (prologue[i] == '}') {
+        ++depth;
+      } else if (prologue[i] == '{') {
+        if (depth) {
+          --depth;
+          continue;
+        }
+        if (openEnd == std::string::npos)
+          openEnd = i + 1;
+        if (--closings == 0) {
+          size_t lineBegin = prologue.rfind('\n', i);
+          lineBegin = lineBegin == std::string::npos ? 0 : lineBegin + 1;
+          opening = prologue.substr(lineBegin, openEnd - lineBegin) + "\n";
+        }
+      }
+    }
+    return closings == 0;
+  }
+
+  std::string KernelInfoHeader::getKernelKey(size_t i) const {
+    std::string key = kernels[i].second;
+    // The specialization refers to its rows of the signature array as
+    // kernel_signatures<suffix>[i+<offset>]; the rows follow a comment with
+    // the kernel name.
+    size_t ref = key.find("kernel_signatures");
+    size_t refEnd = key.find(']', ref);
+    size_t rows = prologue.find("//--- " + kernels[i].first + "\n");
+    if (ref == std::string::npos || refEnd == std::string::npos ||
+        rows == std::string::npos)
+      return key;
+    size_t rowsEnd = std::min(prologue.find("\n\n", rows),
+                              prologue.find("};", rows));
+    if (rowsEnd == std::string::npos)
+      return key;
+    key.replace(ref, refEnd + 1 - ref, prologue, rows, rowsEnd - rows);
+    return key;
+  }
+
+  DeviceCodeUnit::DeviceCodeUnit(size_t lastUnique, size_t id,
+                                 const std::string& dir)
+      : lastUnique(lastUnique), id(id) {
+    auto getPath = [&dir](const std::string& name) {
+      llvm::SmallString<256> Path(dir);
+      llvm::sys::path::append(Path, name);
+      return std::string(Path.str());
+    };
+    const std::string name = "DeviceUnit_" + std::to_string(id);
+    sourceFile = getPath(name + ".cpp");
+    bitcodeFile = getPath(name + ".bc");
+    headerFile = getPath("KernelInfo_" + std::to_string(id) + ".h");
+    depsFile = getPath(name + ".d");
+  }
+
   DumpCodeEntry::DumpCodeEntry(unsigned int isStatement,
                                const std::string& input, Transaction* T,
                                bool declSuccess /* = false*/)
@@ -132,50 +824,136 @@ namespace cling {
     m_unique = IncrementalSYCLDeviceCompiler::m_UniqueCounter;
   }
 
+  const char* const SYCLCompileStats::PhaseNames[kNumPhases] = {
+      "split",    "refactor", "preamble", "dump",   "cache",
+      "frontend", "link",     "wait",     "unload", "declare"};
+
+  void IncrementalSYCLDeviceCompilerBase::printStats(llvm::raw_ostream& OS,
+                                                     bool JSON) {
+    if (JSON)
+      OS << "{}\n";
+    else
+      OS << "SYCL device compiler is not enabled (cling -fsycl)\n";
+  }
+
   // Initialize static members of IncrementalSYCLDeviceCompiler
   size_t IncrementalSYCLDeviceCompiler::m_UniqueCounter = 0;
   const std::string IncrementalSYCLDeviceCompiler::dumpFile = "DumpFile.cpp";
-  const std::string IncrementalSYCLDeviceCompiler::kernelInfoFile =
-      "KernelInfo.h";
   const std::string IncrementalSYCLDeviceCompiler::spvFile = "DeviceCode.spv";
+  const std::string IncrementalSYCLDeviceCompiler::linkedFile =
+      "DeviceCode.bc";
+  const std::string IncrementalSYCLDeviceCompiler::preambleFile =
+      "SYCLPreamble.h";
+  const std::string IncrementalSYCLDeviceCompiler::preamblePCHFile =
+      "SYCLPreamble.pch";
+  const std::string IncrementalSYCLDeviceCompiler::devicePreamblePCHFile =
+      "SYCLPreambleDevice.pch";
 
   IncrementalSYCLDeviceCompiler::IncrementalSYCLDeviceCompiler(
       Interpreter* interp, std::string SYCL_BIN_PATH, const char* llvmdir)
       : m_Interpreter(interp), SYCL_BIN_PATH(std::move(SYCL_BIN_PATH)) {
     m_InputValidator.reset(new InputValidator());
-    HeadTransaction = new Transaction*;
-    *HeadTransaction = NULL;
     secureCode = false;
-    std::ofstream File;
-    File.open(dumpFile, std::ios::in | std::ios::out | std::ios::trunc);
-    File.close();
 
-    getSYCLCompileOpt(interp, m_Args, llvmdir);
+    // Sessions started in the same directory must not share their files.
+    llvm::SmallString<256> SessionDir;
+    if (llvm::sys::fs::createUniqueDirectory("cling-sycl", SessionDir))
+      llvm::errs() << "SYCL: could not create a session directory, using the "
+                      "current directory\n";
+    else
+      m_SessionDir.assign(SessionDir.begin(), SessionDir.end());
+    m_DumpPath = getSessionPath(dumpFile);
+    m_SPVPath = getSessionPath(spvFile);
+    m_LinkedPath = getSessionPath(linkedFile);
+    m_PreamblePath = getSessionPath(preambleFile);
+    m_PreamblePCHPath = getSessionPath(preamblePCHFile);
+    m_DevicePreamblePCHPath = getSessionPath(devicePreamblePCHFile);
+
+    getSYCLCompileOpt(interp, m_Args, llvmdir, m_DumpPath);
+    m_Async = interp->getOptions().CompilerOpts.SYCLAsync;
+
+    if (const char* CacheDir = getenv("CLING_SYCL_CACHE_DIR")) {
+      m_CacheDir = CacheDir;
+    } else {
+      llvm::SmallString<256> Path;
+      if (llvm::sys::path::user_cache_directory(Path, "cling", "sycl"))
+        m_CacheDir.assign(Path.begin(), Path.end());
+    }
+
+    // The server runs the jobs in its own directory, so their paths have to
+    // be absolute, as those in the session directory are.
+    if (const char* Server = getenv(utils::sycl::ServerSocketEnv))
+      if (!m_SessionDir.empty())
+        m_ServerSocket = Server;
   }
 
   IncrementalSYCLDeviceCompiler::~IncrementalSYCLDeviceCompiler() {
-    delete HeadTransaction;
+    finishBackground();
     m_InputValidator.reset(0);
     for (auto arg : m_Args) {
       delete[] arg;
     }
-    remove(dumpFile.c_str());
-    remove(kernelInfoFile.c_str());
-    remove(spvFile.c_str());
+    for (auto& Unit : m_Units) {
+      remove(Unit.sourceFile.c_str());
+      remove(Unit.bitcodeFile.c_str());
+      remove(Unit.headerFile.c_str());
+    }
+    if (!m_SessionDir.empty()) {
+      llvm::sys::fs::remove_directories(m_SessionDir);
+      return;
+    }
+    remove(m_SPVPath.c_str());
+    remove(m_LinkedPath.c_str());
+    remove(m_PreamblePath.c_str());
+    remove(m_PreamblePCHPath.c_str());
+    remove(m_DevicePreamblePCHPath.c_str());
+  }
+
+  std::string
+  IncrementalSYCLDeviceCompiler::getSessionPath(const std::string& name) const {
+    if (m_SessionDir.empty())
+      return name;
+    llvm::SmallString<256> Path(m_SessionDir);
+    llvm::sys::path::append(Path, name);
+    return Path.str();
+  }
+
+  void IncrementalSYCLDeviceCompiler::writeMemoryFile(
+      const std::string& path, const std::string& content) {
+    auto& File = m_MemoryFiles[path];
+    if (File.second && File.first == content)
+      return;
+    File.first = content;
+    // A new modification time invalidates the PCHs built on the old content.
+    File.second = ++m_MemoryFileTime;
+  }
+
+  void IncrementalSYCLDeviceCompiler::spillMemoryFile(const std::string& path) {
+    auto it = m_MemoryFiles.find(path);
+    if (it == m_MemoryFiles.end())
+      return;
+    std::error_code EC;
+    llvm::raw_fd_ostream File(path, EC, llvm::sys::fs::F_Text);
+    File << it->second.first;
+  }
+
+  llvm::IntrusiveRefCntPtr<vfs::FileSystem>
+  IncrementalSYCLDeviceCompiler::getFileSystem() {
+    if (m_FileSystem)
+      return m_FileSystem;
+    llvm::IntrusiveRefCntPtr<vfs::OverlayFileSystem> Overlay(
+        new vfs::OverlayFileSystem(vfs::getRealFileSystem()));
+    Overlay->pushOverlay(new MemoryFileSystem(m_MemoryFiles));
+    m_FileSystem = Overlay;
+    return m_FileSystem;
   }
 
   std::string
   IncrementalSYCLDeviceCompiler::SyclWrapInput(const std::string& Input,
                                                unsigned int is_statement) {
-    std::string Wrapper(Input);
-    if (is_statement) {
-      std::string Header = std::string("void __cling_custom_sycl_") +
-                           std::to_string(m_UniqueCounter) +
-                           std::string("() {\n");
-      Wrapper.insert(0, Header);
-      Wrapper.append("\n;\n}");
-    }
-    return Wrapper;
+    if (is_statement)
+      return wrapStatement(Input, m_UniqueCounter);
+    return Input;
   }
 
   void IncrementalSYCLDeviceCompiler::insertCodeEntry(unsigned int is_statement,
@@ -195,10 +973,14 @@ namespace cling {
     // entered by user input
     if ((isStatement == 0) && (!ExtractDeclFlag))
       return true;
+    ++m_Stats.inputs;
     std::istringstream input_holder(input);
     std::string line;
     std::string complete_input;
+    CodeNames Names;
     m_Uniques.clear();
+    std::unique_ptr<PhaseTimer> SplitTimer(
+        new PhaseTimer(m_Stats, SYCLCompileStats::kSplit));
     // When integrated with jupyter notebook , the jupyter server may send a complete cpp file, 
     // need to use InputValidator to split the original cpp into several closed decl and stmt,
     // then wrap them in wrap_function 
@@ -214,6 +996,7 @@ namespace cling {
       complete_input.clear();
       m_InputValidator->reset(&complete_input);
       size_t wrapPoint = std::string::npos;
+      const size_t firstNew = m_Uniques.size();
       // Wrap the complete input and dump them
       wrapPoint = utils::getWrapPoint(complete_input,
                                       m_Interpreter->getCI()->getLangOpts());
@@ -226,127 +1009,995 @@ namespace cling {
         std::string wrappedinput(complete_input.substr(wrapPoint));
         insertCodeEntry(1, wrappedinput, T);
       }
-      // Extract declarations out of wrapper functions into the global scope
-      if (!refactorCode()) {
-        return false;
-      }
-      lastUnique = m_Uniques.back();
+      CodeNames ChunkNames;
+      scanCode(m_Interpreter->getCI()->getPreprocessor(), complete_input,
+               ChunkNames);
+      for (size_t i = firstNew; i < m_Uniques.size(); ++i)
+        UniqueToEntry[m_Uniques[i]]->launchesKernel =
+            ChunkNames.launchesKernel;
+      Names.launchesKernel |= ChunkNames.launchesKernel;
+      Names.hasDirectives |= ChunkNames.hasDirectives;
+      Names.usesMacros |= ChunkNames.usesMacros;
+      Names.used.insert(ChunkNames.used.begin(), ChunkNames.used.end());
+      Names.declared.insert(ChunkNames.declared.begin(),
+                            ChunkNames.declared.end());
+    }
+    // Code without device code is only recorded; it is refactored and
+    // compiled together with the next input that needs the SYCL compiler.
+    const bool deviceRelevant = isDeviceRelevant(Names);
+    SplitTimer.reset();
+    if (!deviceRelevant) {
+      ++m_Stats.skippedInputs;
+      setExtractDeclFlag(false);
+      return true;
     }
+    // Extract declarations out of wrapper functions into the global scope
+    if (!refactorPending())
+      return false;
     // Call SYCL compiler to generate kernel info and spv file
-    return compileImpl();
+    if (!compileImpl())
+      return false;
+    m_CollectTransactionNames = Names.hasDirectives;
+    return true;
   }
 
-  void IncrementalSYCLDeviceCompiler::dump(const std::string& target) {
-    std::error_code EC;
-    llvm::raw_fd_ostream File(target, EC, llvm::sys::fs::F_Text);
-    for (auto& CodeEntry : EntryList) {
-      File << CodeEntry.code;
-      // Find the last valid character and add ';' if necessary
-      for (auto sit = CodeEntry.code.rbegin(); sit != CodeEntry.code.rend();
-           sit++) {
-        if (*sit != ' ') {
-          if (CodeEntry.isStatement == 0) {
-            if (*sit == '}')
-              File << ";\n";
-            else
-              File << "\n";
-            break;
-          } else {
-            if (*sit == ';')
-              File << '\n';
-            else
-              File << ";\n";
-            break;
-          }
-        }
-      }
+  bool IncrementalSYCLDeviceCompiler::isDeviceRelevant(const CodeNames& Names) {
+    // The lexer sees neither the declarations of an included header nor the
+    // expansion of a macro, which may both define or launch kernels.
+    bool relevant =
+        Names.launchesKernel || Names.hasDirectives || Names.usesMacros;
+    for (auto& Name : Names.used) {
+      if (relevant)
+        break;
+      relevant = m_KernelDeclaredNames.count(Name);
+    }
+    for (auto& Name : Names.declared) {
+      if (relevant)
+        break;
+      relevant = m_KernelUsedNames.count(Name);
     }
-    File.close();
+    if (!relevant)
+      return false;
+    m_KernelUsedNames.insert(Names.used.begin(), Names.used.end());
+    m_KernelDeclaredNames.insert(Names.declared.begin(), Names.declared.end());
+    return true;
+  }
+
+  bool IncrementalSYCLDeviceCompiler::refactorPending() {
+    std::vector<size_t> Statements;
+    for (auto& CodeEntry : EntryList)
+      if ((int)CodeEntry.m_unique > lastUnique && CodeEntry.isStatement)
+        Statements.push_back(CodeEntry.m_unique);
+    // Declaration entries are kept as they are; the next parse reads them.
+    if (!Statements.empty() && !refactorCode(Statements))
+      return false;
+    if (!EntryList.empty() && (int)EntryList.back().m_unique > lastUnique)
+      lastUnique = EntryList.back().m_unique;
+    return true;
   }
 
-  bool IncrementalSYCLDeviceCompiler::refactorCode() {
-    // Dump every code entry to a file and declarations in last several code
-    // entries are not extracted to global scope
-    dump(dumpFile);
+  bool IncrementalSYCLDeviceCompiler::refactorCode(
+      const std::vector<size_t>& uniques) {
+    updatePreamble();
+
+    // Dump the code entries the prefix PCH does not cover, which were
+    // refactored already, followed by the entries to refactor, each
+    // statement entry in a wrapper function of its own.
+    ExtractRun Run;
+    Run.uniques = uniques;
+    PrefixPCH Prefix;
+    Prefix.lastUnique = EntryList.back().m_unique;
+    Prefix.source =
+        getSessionPath("SYCLPrefix_" + std::to_string(m_PrefixPCHCounter) +
+                       ".cpp");
+    Prefix.pch =
+        getSessionPath("SYCLPrefix_" + std::to_string(m_PrefixPCHCounter) +
+                       ".pch");
+    {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kDump);
+      std::string Code;
+      llvm::raw_string_ostream OS(Code);
+      for (auto& CodeEntry : EntryList) {
+        if (!m_PrefixPCHs.empty() &&
+            CodeEntry.m_unique <= m_PrefixPCHs.back().lastUnique)
+          continue;
+        if ((int)CodeEntry.m_unique <= lastUnique || !CodeEntry.isStatement) {
+          dumpEntryCode(OS, CodeEntry.code, CodeEntry.isStatement);
+          continue;
+        }
+        const size_t i = Run.ranges.size();
+        OS << "void " << extractFunctionName << CodeEntry.m_unique
+           << "() {\n" << Run.beginMarker(i);
+        unsigned begin = OS.tell();
+        OS << unwrapStatement(CodeEntry.code);
+        Run.ranges.emplace_back(begin, OS.tell());
+        OS << Run.endMarker(i) << "\n;\n}\n";
+      }
+      OS.flush();
+      m_Stats.bytesDumped += Code.size();
+      writeMemoryFile(Prefix.source, Code);
+    }
 
     // Initialize CompilerInstance
     CompilerInstance CI;
-    // Create complie options
-    clang::CompilerInvocation::CreateFromArgs(CI.getInvocation(), m_Args.data(),
-                                              m_Args.data() + m_Args.size(),
-                                              CI.getDiagnostics());
-
-    // create Diagnostics after create args to suppress all warnings
-    CI.createDiagnostics();
-    assert(CI.hasDiagnostics());
-
-    std::unique_ptr<FrontendAction> action(
-        new InterpreterClassAction(UniqueToEntry, lastUnique));
-    if (!CI.ExecuteAction(*action)) {
+    std::vector<const char*> Args;
+    for (auto arg : m_Args)
+      Args.push_back(m_DumpPath == arg ? Prefix.source.c_str() : arg);
+    if (!m_PrefixPCHs.empty()) {
+      Args.push_back("-include-pch");
+      Args.push_back(m_PrefixPCHs.back().pch.c_str());
+    } else if (m_HasPreamblePCH) {
+      Args.push_back("-include-pch");
+      Args.push_back(m_PreamblePCHPath.c_str());
+    }
+    Args.push_back("-emit-pch");
+    Args.push_back("-o");
+    Args.push_back(Prefix.pch.c_str());
+    createCompilerInstance(CI, Args);
+    CI.setVirtualFileSystem(getFileSystem());
+
+    std::unique_ptr<FrontendAction> action(new InterpreterClassAction(Run));
+    bool Success;
+    {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kRefactor);
+      Success = CI.ExecuteAction(*action);
+    }
+    if (!Success) {
+      m_MemoryFiles.erase(Prefix.source);
+      remove(Prefix.pch.c_str());
       removeCodeByTransaction(NULL);
       return false;
     }
+    ++m_PrefixPCHCounter;
+    // Without the PCH, the next parse reads these entries again.
+    if (llvm::sys::fs::exists(Prefix.pch))
+      m_PrefixPCHs.push_back(std::move(Prefix));
+    else
+      m_MemoryFiles.erase(Prefix.source);
 
-    // Dump every code entry to a file again and declarations in all
-    // code entries are extracted to global scope
-    dump(dumpFile);
+    // Put the extracted declarations before the wrapper functions, which no
+    // longer contain them.
+    for (size_t i = 0; i < uniques.size(); ++i) {
+      DumpCodeEntry& Entry = *UniqueToEntry[uniques[i]];
+      Entry.declCode = Run.declCode[i];
+      if (!Run.declCode[i].empty())
+        Entry.code = Run.declCode[i] + wrapStatement(Run.body[i], uniques[i]);
+    }
     return true;
   }
 
+  void IncrementalSYCLDeviceCompiler::dropPrefixPCHsFrom(size_t unique) {
+    while (!m_PrefixPCHs.empty() && m_PrefixPCHs.back().lastUnique >= unique) {
+      m_MemoryFiles.erase(m_PrefixPCHs.back().source);
+      remove(m_PrefixPCHs.back().pch.c_str());
+      m_PrefixPCHs.pop_back();
+    }
+  }
+
   bool IncrementalSYCLDeviceCompiler::compileImpl() {
     setExtractDeclFlag(false);
+    // The previous units have to be complete before they are linked again.
+    finishBackground();
     secureCode = true;
-    std::ofstream File;
-    File.open(kernelInfoFile, std::ios::in | std::ios::out | std::ios::trunc);
-    File.close();
-    std::string command =
-        SYCL_BIN_PATH +
-        "/clang++ -w -fsycl-device-only  -fno-sycl-use-bitcode "
-        "-Xclang -fsycl-int-header=" +
-        kernelInfoFile + " -c " + dumpFile + " -o " + spvFile;
 
-    // Add include paths entered by .I command in cling
-    for (auto& arg : m_ICommandInclude) {
-      command = command + " " + arg;
+    // Only the entries after the last unit need to be compiled.
+    const bool hasNewEntries =
+        !EntryList.empty() &&
+        (m_Units.empty() ||
+         EntryList.back().m_unique > m_Units.back().lastUnique);
+    if (hasNewEntries) {
+      std::vector<DeviceCodeUnit> Units = splitNewEntries();
+      if (!compileUnits(Units)) {
+        for (auto& Unit : Units) {
+          remove(Unit.sourceFile.c_str());
+          remove(Unit.bitcodeFile.c_str());
+          remove(Unit.headerFile.c_str());
+          remove(Unit.depsFile.c_str());
+        }
+        secureCode = false;
+        removeCodeByTransaction(NULL);
+        return false;
+      }
+      for (auto& Unit : Units)
+        m_Units.push_back(std::move(Unit));
+      m_UnitsDirty = true;
     }
 
-    // Use SYCL device compiler to generate Kernel info and Device code
-    int sysReturn = std::system(command.c_str());
-    if (sysReturn != 0) {
+    if (!m_UnitsDirty) {
+      secureCode = false;
+      return true;
+    }
+
+    if (!linkUnits() || !declareKernelInfo()) {
       secureCode = false;
       removeCodeByTransaction(NULL);
       return false;
     }
 
-    // Unload the previous kernel info header
-    if (HeadTransaction && *HeadTransaction) {
-      m_Interpreter->unload(**HeadTransaction);
-      *HeadTransaction = NULL;
+    m_UnitsDirty = false;
+    secureCode = false;
+    return true;
+  }
+
+  std::vector<DeviceCodeUnit>
+  IncrementalSYCLDeviceCompiler::splitNewEntries() {
+    std::vector<size_t> KernelEntries;
+    for (auto& CodeEntry : EntryList) {
+      if (!m_Units.empty() && CodeEntry.m_unique <= m_Units.back().lastUnique)
+        continue;
+      if (CodeEntry.launchesKernel)
+        KernelEntries.push_back(CodeEntry.m_unique);
     }
 
-    std::ifstream headFile;
-    headFile.open(kernelInfoFile);
-    std::ostringstream tmp;
-    tmp << headFile.rdbuf();
-    std::string headFileContent = tmp.str();
-    headFile.close();
+    // Every unit compiles the declarations before it again, so the kernels
+    // are spread over no more units than there are cores.
+    const size_t MaxUnits = std::max(1u, std::thread::hardware_concurrency());
+    const size_t PerUnit = (KernelEntries.size() + MaxUnits - 1) / MaxUnits;
+    std::vector<DeviceCodeUnit> Units;
+    for (size_t i = PerUnit; i < KernelEntries.size(); i += PerUnit)
+      Units.emplace_back(KernelEntries[i - 1], m_UnitCounter++, m_SessionDir);
+    Units.emplace_back(EntryList.back().m_unique, m_UnitCounter++,
+                       m_SessionDir);
+    return Units;
+  }
 
-    // Load the new kernel info header
-    if (m_Interpreter->declare(headFileContent.c_str(), HeadTransaction) !=
-        Interpreter::kSuccess) {
-      secureCode = false;
-      removeCodeByTransaction(NULL);
+  bool IncrementalSYCLDeviceCompiler::compileUnits(
+      std::vector<DeviceCodeUnit>& Units) {
+    updatePreamble();
+
+    typedef std::vector<std::pair<std::string, std::string>> Artifacts;
+    std::vector<Artifacts> UnitArtifacts;
+    std::vector<size_t> Uncached;
+    std::string Prefix(m_Prefix);
+    auto Entry = EntryList.begin();
+    while (Entry != EntryList.end() && !m_Units.empty() &&
+           Entry->m_unique <= m_Units.back().lastUnique)
+      ++Entry;
+    for (size_t i = 0; i < Units.size(); ++i) {
+      DeviceCodeUnit& Unit = Units[i];
+      // Dump the declarations of the previous units followed by the entries
+      // of the unit.
+      std::string Source(Prefix);
+      std::string newDecls;
+      bool launchesKernel = false;
+      std::unique_ptr<PhaseTimer> Timer(
+          new PhaseTimer(m_Stats, SYCLCompileStats::kDump));
+      {
+        llvm::raw_string_ostream Code(Source);
+        llvm::raw_string_ostream Decls(newDecls);
+        for (; Entry != EntryList.end() && Entry->m_unique <= Unit.lastUnique;
+             ++Entry) {
+          dumpEntryCode(Code, Entry->code, Entry->isStatement);
+          dumpEntryDecls(Decls, *Entry);
+          launchesKernel |= Entry->launchesKernel;
+        }
+      }
+      {
+        std::error_code EC;
+        llvm::raw_fd_ostream File(Unit.sourceFile, EC, llvm::sys::fs::F_Text);
+        File << Source;
+      }
+      m_Stats.bytesDumped += Source.size();
+      Timer.reset();
+      if (launchesKernel)
+        stripKernels(Prefix, newDecls);
+      Prefix += newDecls;
+      Unit.prefixSize = Prefix.size();
+
+      // Use SYCL device compiler to generate Kernel info and Device code,
+      // unless the same unit was compiled before.
+      UnitArtifacts.push_back(
+          {{".bc", Unit.bitcodeFile}, {".h", Unit.headerFile}});
+      Timer.reset(new PhaseTimer(m_Stats, SYCLCompileStats::kCache));
+      Unit.sourceKey = getCacheKey(Source, Unit);
+      if (!Unit.sourceKey.empty())
+        Unit.cacheKey = getArtifactsKey(Unit.sourceKey,
+                                        getCachedDeps(Unit.sourceKey));
+      if (!fetchFromCache(Unit.cacheKey, UnitArtifacts.back()))
+        Uncached.push_back(i);
+    }
+
+    if (!Uncached.empty()) {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kFrontend);
+      std::vector<utils::sycl::Job> Jobs;
+      for (size_t i : Uncached)
+        Jobs.push_back(getFrontendJob(Units[i]));
+      if (!runDeviceJobs(Jobs, m_Stats))
+        return false;
+    }
+    for (size_t i : Uncached) {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kCache);
+      // The headers are known once the frontend ran, even if only for the
+      // kernel info header.
+      recordDeps(Units[i]);
+      if (!Units[i].pendingBitcode)
+        storeInCache(Units[i].cacheKey, UnitArtifacts[i]);
+    }
+
+    for (auto& Unit : Units) {
+      if (!Unit.header.parse(readFile(Unit.headerFile),
+                             "_" + std::to_string(Unit.id))) {
+        llvm::errs() << "SYCL: unexpected layout of " << Unit.headerFile
+                     << "\n";
+        return false;
+      }
+    }
+
+    m_Prefix = std::move(Prefix);
+    return true;
+  }
+
+  void IncrementalSYCLDeviceCompiler::stripKernels(const std::string& Prefix,
+                                                   std::string& Decls) {
+    PhaseTimer Timer(m_Stats, SYCLCompileStats::kRefactor);
+    writeMemoryFile(m_DumpPath, Prefix + Decls);
+    CompilerInstance CI;
+    std::vector<const char*> Args(m_Args);
+    if (m_HasPreamblePCH) {
+      Args.push_back("-include-pch");
+      Args.push_back(m_PreamblePCHPath.c_str());
+    }
+    createCompilerInstance(CI, Args);
+    CI.setVirtualFileSystem(getFileSystem());
+
+    std::string Stripped;
+    StripKernelsAction action(Prefix.size(), Stripped);
+    if (CI.ExecuteAction(action) && !CI.getDiagnostics().hasErrorOccurred())
+      Decls = std::move(Stripped);
+  }
+
+  std::vector<std::string> IncrementalSYCLDeviceCompiler::getDriverArgs(
+      const DeviceCodeUnit& Unit) const {
+    std::vector<std::string> Args = {"-w",
+                                     "-fsycl-device-only",
+                                     "-Xclang",
+                                     "-fsycl-int-header=" + Unit.headerFile,
+                                     "-MMD",
+                                     "-MF",
+                                     Unit.depsFile,
+                                     "-c",
+                                     Unit.sourceFile,
+                                     "-o",
+                                     Unit.bitcodeFile};
+    // Add include paths entered by .I command in cling
+    Args.insert(Args.end(), m_ICommandInclude.begin(),
+                m_ICommandInclude.end());
+    return Args;
+  }
+
+  void IncrementalSYCLDeviceCompiler::resolveDeviceCC1(
+      const DeviceCodeUnit& Unit) {
+    m_DeviceCC1Resolved = true;
+    m_DeviceCC1Args.clear();
+    m_DeviceCC1Files = {Unit.sourceFile, Unit.bitcodeFile, Unit.headerFile,
+                        Unit.depsFile};
+
+    std::string command = "'" + SYCL_BIN_PATH + "/clang++' -###";
+    for (auto& Arg : getDriverArgs(Unit)) {
+      std::string Quoted(Arg);
+      replaceAll(Quoted, "'", "'\\''");
+      command += " '" + Quoted + "'";
+    }
+
+    llvm::SmallVector<char, 4096> Buf;
+    if (!utils::platform::Popen(command, Buf, true))
+      return;
+
+    // Only a single frontend job can be run directly; anything else (e.g. a
+    // separate translation to SPIR-V) is left to the driver.
+    llvm::SmallVector<llvm::StringRef, 16> Lines;
+    llvm::StringRef(Buf.data(), Buf.size()).split(Lines, '\n');
+    std::vector<std::string> Job;
+    for (llvm::StringRef Line : Lines) {
+      if (!Line.startswith(" \""))
+        continue;
+      if (!Job.empty())
+        return;
+      Job = splitJobLine(Line);
+    }
+    if (Job.size() < 2 || Job[1] != "-cc1")
+      return;
+    m_DeviceCC1Args = std::move(Job);
+  }
+
+  std::vector<std::string>
+  IncrementalSYCLDeviceCompiler::getDeviceFrontendArgs(
+      const DeviceCodeUnit& Unit, bool HeaderOnly) const {
+    const std::string UnitFiles[] = {Unit.sourceFile, Unit.bitcodeFile,
+                                     Unit.headerFile, Unit.depsFile};
+    std::vector<std::string> Args;
+    for (auto it = m_DeviceCC1Args.begin() + 1; it != m_DeviceCC1Args.end();
+         ++it) {
+      std::string Arg = *it;
+      if (HeaderOnly) {
+        // The header is emitted by Sema; skip the code generation.
+        if (Arg == "-emit-llvm-bc") {
+          Arg = "-fsyntax-only";
+        } else if (Arg == "-o") {
+          if (++it == m_DeviceCC1Args.end())
+            break;
+          continue;
+        }
+      }
+      for (size_t i = 0; i < m_DeviceCC1Files.size(); ++i)
+        replaceAll(Arg, m_DeviceCC1Files[i], UnitFiles[i]);
+      Args.push_back(std::move(Arg));
+    }
+    if (m_HasDevicePreamblePCH) {
+      Args.push_back("-include-pch");
+      Args.push_back(m_DevicePreamblePCHPath);
+    }
+    return Args;
+  }
+
+  utils::sycl::Job
+  IncrementalSYCLDeviceCompiler::getFrontendJob(DeviceCodeUnit& Unit) {
+    if (!m_DeviceCC1Resolved)
+      resolveDeviceCC1(Unit);
+
+    if (m_DeviceCC1Args.empty())
+      return utils::sycl::Job(SYCL_BIN_PATH + "/clang++", getDriverArgs(Unit));
+
+    if (m_DevicePreamblePCHStale)
+      buildDevicePreamblePCH();
+
+    Unit.pendingBitcode = m_Async;
+    return utils::sycl::Job(m_DeviceCC1Args.front(),
+                            getDeviceFrontendArgs(Unit, m_Async));
+  }
+
+  bool IncrementalSYCLDeviceCompiler::runDeviceJobs(
+      const std::vector<utils::sycl::Job>& Jobs, SYCLCompileStats& Stats) {
+    if (Jobs.empty())
+      return true;
+
+    // The server bounds the jobs of all sessions by the cores of the host;
+    // without it, each job runs on a thread of its own, up to one per core.
+    std::atomic<size_t> Next(0), ServerJobs(0), LocalJobs(0);
+    std::atomic<bool> Success(true), ServerDown(false);
+    std::mutex OutputLock;
+    auto Work = [&]() {
+      for (size_t i = Next++; i < Jobs.size(); i = Next++) {
+        const utils::sycl::Job& J = Jobs[i];
+        if (!m_ServerSocket.empty() && !ServerDown) {
+          int ExitCode;
+          std::string Output;
+          utils::sycl::JobStatus Status =
+              utils::sycl::RunRemoteJob(m_ServerSocket, J, ExitCode, Output);
+          if (!Output.empty()) {
+            std::lock_guard<std::mutex> Lock(OutputLock);
+            llvm::errs() << Output;
+          }
+          if (Status == utils::sycl::kJobRun) {
+            ++ServerJobs;
+            if (ExitCode != 0)
+              Success = false;
+            continue;
+          }
+          if (Status == utils::sycl::kServerFailure)
+            ServerDown = true;
+        }
+        ++LocalJobs;
+        if (runProgram(J.first, J.second) != 0)
+          Success = false;
+      }
+    };
+    size_t Threads = Jobs.size();
+    if (m_ServerSocket.empty())
+      Threads = std::min<size_t>(
+          Threads, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> Workers;
+    for (size_t i = 1; i < Threads; ++i)
+      Workers.emplace_back(Work);
+    Work();
+    for (auto& Worker : Workers)
+      Worker.join();
+
+    if (ServerDown) {
+      llvm::errs() << "SYCL: cannot reach the compile server at "
+                   << m_ServerSocket << ", compiling in this process\n";
+      m_ServerSocket.clear();
+    }
+    Stats.serverJobs += ServerJobs;
+    Stats.localJobs += LocalJobs;
+    return Success;
+  }
+
+  bool IncrementalSYCLDeviceCompiler::finishBackground() {
+    if (!m_Background.valid())
+      return true;
+    bool Success;
+    {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kWait);
+      Success = m_Background.get();
+    }
+    m_Stats.merge(m_BackgroundStats);
+    if (Success)
+      return true;
+
+    llvm::errs() << "SYCL: generating the device code failed\n";
+    if (m_BackgroundFrom != std::string::npos)
+      dropUnitsFrom(m_BackgroundFrom);
+    else
+      m_UnitsDirty = true;
+    return false;
+  }
+
+  void IncrementalSYCLDeviceCompiler::printStats(llvm::raw_ostream& OS,
+                                                 bool JSON) {
+    double deviceSeconds = m_Stats.seconds[SYCLCompileStats::kFrontend] +
+                           m_Stats.seconds[SYCLCompileStats::kLink];
+    if (JSON) {
+      OS << "{\"inputs\": " << m_Stats.inputs
+         << ", \"skipped_inputs\": " << m_Stats.skippedInputs
+         << ", \"entries\": " << EntryList.size()
+         << ", \"units\": " << m_Units.size()
+         << ", \"kernels\": " << m_DeclaredKernels.size()
+         << ", \"bytes_dumped\": " << m_Stats.bytesDumped
+         << ", \"cache_hits\": " << m_CacheHits
+         << ", \"cache_misses\": " << m_CacheMisses
+         << ", \"server_jobs\": " << m_Stats.serverJobs
+         << ", \"local_jobs\": " << m_Stats.localJobs
+         << ", \"device_compile_seconds\": " << deviceSeconds
+         << ", \"phases\": {";
+      for (int P = 0; P < SYCLCompileStats::kNumPhases; ++P)
+        OS << (P ? ", " : "") << "\"" << SYCLCompileStats::PhaseNames[P]
+           << "\": {\"count\": " << m_Stats.count[P]
+           << ", \"seconds\": " << m_Stats.seconds[P] << "}";
+      OS << "}}\n";
+      return;
+    }
+
+    OS << "SYCL device compiler\n"
+       << "  inputs:               " << m_Stats.inputs << " ("
+       << m_Stats.skippedInputs << " without device code)\n"
+       << "  entries:              " << EntryList.size() << "\n"
+       << "  device code units:    " << m_Units.size() << "\n"
+       << "  declared kernels:     " << m_DeclaredKernels.size() << "\n"
+       << "  bytes dumped:         " << m_Stats.bytesDumped << "\n"
+       << "  cache:                " << m_CacheHits << " hits, "
+       << m_CacheMisses << " misses\n"
+       << "  device jobs:          " << m_Stats.serverJobs
+       << " on the compile server, " << m_Stats.localJobs
+       << " in this process\n"
+       << "  device compile time:  " << llvm::format("%.3f", deviceSeconds)
+       << " s\n"
+       << "  phase         count   seconds\n";
+    for (int P = 0; P < SYCLCompileStats::kNumPhases; ++P)
+      OS << llvm::format("  %-10s %8zu %9.3f\n",
+                         SYCLCompileStats::PhaseNames[P], m_Stats.count[P],
+                         m_Stats.seconds[P]);
+  }
+
+  bool IncrementalSYCLDeviceCompiler::waitForDeviceCode() {
+    // The kernel info header is declared while the device code is generated.
+    if (secureCode)
+      return true;
+    return finishBackground();
+  }
+
+  void IncrementalSYCLDeviceCompiler::updatePreamble() {
+    // Only the directives the session starts with: a later #include may
+    // depend on the macros and declarations of the code before it.
+    std::string Preamble;
+    for (auto& CodeEntry : EntryList) {
+      if (CodeEntry.isStatement || !isPreprocessorOnly(CodeEntry.code))
+        break;
+      Preamble += CodeEntry.code + "\n";
+    }
+
+    std::string Key = Preamble;
+    for (auto& arg : m_ICommandInclude)
+      Key += "\n" + arg;
+    if (Key == m_PreambleKey)
+      return;
+
+    // The background compilation may still use the preamble PCHs.
+    finishBackground();
+    PhaseTimer Timer(m_Stats, SYCLCompileStats::kPreamble);
+    m_PreambleKey = std::move(Key);
+    // The prefix PCHs are chained on the preamble PCH.
+    dropPrefixPCHsFrom(0);
+    m_HasPreamblePCH = false;
+    m_HasDevicePreamblePCH = false;
+    m_DevicePreamblePCHStale = !Preamble.empty();
+    remove(m_PreamblePCHPath.c_str());
+    remove(m_DevicePreamblePCHPath.c_str());
+    if (Preamble.empty())
+      return;
+
+    writeMemoryFile(m_PreamblePath, Preamble);
+
+    // Build the PCH with the arguments of refactorCode(), on the preamble
+    // instead of the dumped code.
+    std::vector<const char*> Args;
+    for (auto arg : m_Args)
+      Args.push_back(m_DumpPath == arg ? m_PreamblePath.c_str() : arg);
+    Args.push_back("-emit-pch");
+    Args.push_back("-o");
+    Args.push_back(m_PreamblePCHPath.c_str());
+
+    CompilerInstance CI;
+    createCompilerInstance(CI, Args);
+    CI.setVirtualFileSystem(getFileSystem());
+    GeneratePCHAction action;
+    m_HasPreamblePCH = CI.ExecuteAction(action);
+    if (!m_HasPreamblePCH) {
+      llvm::errs() << "SYCL: could not precompile the preamble, parsing it "
+                      "with every input\n";
+      remove(m_PreamblePCHPath.c_str());
+    }
+  }
+
+  void IncrementalSYCLDeviceCompiler::buildDevicePreamblePCH() {
+    m_DevicePreamblePCHStale = false;
+
+    // Reuse the resolved frontend job, emitting a PCH of the preamble instead
+    // of the bitcode of a unit.
+    const std::string pchHeader = getSessionPath("KernelInfo_pch.h");
+    const std::string pchDeps = getSessionPath("SYCLPreambleDevice.d");
+    const std::string PCHFiles[] = {m_PreamblePath, m_DevicePreamblePCHPath,
+                                    pchHeader, pchDeps};
+    std::vector<std::string> Args;
+    bool hasAction = false;
+    for (auto it = m_DeviceCC1Args.begin() + 1; it != m_DeviceCC1Args.end();
+         ++it) {
+      std::string Arg = *it;
+      if (Arg == "-emit-llvm-bc") {
+        Arg = "-emit-pch";
+        hasAction = true;
+      } else if (Arg == "c++" && !Args.empty() && Args.back() == "-x") {
+        Arg = "c++-header";
+      } else if (Arg == "-main-file-name") {
+        // Drop the name of the unit's file.
+        if (++it == m_DeviceCC1Args.end())
+          break;
+        continue;
+      }
+      for (size_t i = 0; i < m_DeviceCC1Files.size(); ++i)
+        replaceAll(Arg, m_DeviceCC1Files[i], PCHFiles[i]);
+      Args.push_back(std::move(Arg));
+    }
+    if (!hasAction)
+      return;
+
+    spillMemoryFile(m_PreamblePath);
+    m_HasDevicePreamblePCH = runProgram(m_DeviceCC1Args.front(), Args) == 0;
+    if (!m_HasDevicePreamblePCH) {
+      llvm::errs() << "SYCL: could not precompile the preamble for the device "
+                      "frontend, parsing it with every unit\n";
+      remove(m_DevicePreamblePCHPath.c_str());
+    }
+    remove(pchHeader.c_str());
+    remove(pchDeps.c_str());
+  }
+
+  std::string
+  IncrementalSYCLDeviceCompiler::getCacheKey(const std::string& Source,
+                                             const DeviceCodeUnit& Unit) {
+    if (m_CacheDir.empty())
+      return std::string();
+
+    if (m_CompilerVersion.empty()) {
+      llvm::SmallVector<char, 1024> Buf;
+      std::string command = "'" + SYCL_BIN_PATH + "/clang++' --version";
+      if (utils::platform::Popen(command, Buf, true))
+        m_CompilerVersion.assign(Buf.data(), Buf.size());
+      else
+        m_CompilerVersion = SYCL_BIN_PATH;
+    }
+
+    llvm::MD5 Hash;
+    auto update = [&Hash](llvm::StringRef Str) {
+      Hash.update(Str);
+      Hash.update(llvm::StringRef("", 1));
+    };
+    update(m_CompilerVersion);
+    // The dumped file is named in the session directory, which does not
+    // affect the artifacts.
+    for (auto arg : m_Args)
+      update(m_DumpPath == arg ? dumpFile.c_str() : arg);
+    // The names of the unit's files do not affect its artifacts.
+    const std::string UnitFiles[] = {Unit.sourceFile, Unit.bitcodeFile,
+                                     Unit.headerFile, Unit.depsFile};
+    for (auto Arg : getDriverArgs(Unit)) {
+      for (size_t i = 0; i < 4; ++i)
+        replaceAll(Arg, UnitFiles[i], "<" + std::to_string(i) + ">");
+      update(Arg);
+    }
+    update(Source);
+
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Key;
+    llvm::MD5::stringifyResult(Result, Key);
+    return Key.str();
+  }
+
+  std::string IncrementalSYCLDeviceCompiler::getArtifactsKey(
+      const std::string& SourceKey,
+      const std::vector<std::string>& Deps) const {
+    llvm::MD5 Hash;
+    Hash.update(SourceKey);
+    for (auto& Dep : Deps) {
+      Hash.update(llvm::StringRef("", 1));
+      Hash.update(Dep);
+      Hash.update(llvm::StringRef("", 1));
+      auto Buffer = llvm::MemoryBuffer::getFile(Dep);
+      // A missing header cannot match any stored contents.
+      Hash.update(Buffer ? (*Buffer)->getBuffer() : llvm::StringRef("\1", 1));
+    }
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Key;
+    llvm::MD5::stringifyResult(Result, Key);
+    return Key.str();
+  }
+
+  std::vector<std::string> IncrementalSYCLDeviceCompiler::getCachedDeps(
+      const std::string& SourceKey) const {
+    // A unit stored without a list included no header.
+    llvm::SmallString<256> Path(m_CacheDir);
+    llvm::sys::path::append(Path, SourceKey + ".deps");
+    llvm::SmallVector<llvm::StringRef, 16> Lines;
+    std::string Content = readFile(Path.str());
+    llvm::StringRef(Content).split(Lines, '\n', -1, false);
+    return std::vector<std::string>(Lines.begin(), Lines.end());
+  }
+
+  void IncrementalSYCLDeviceCompiler::recordDeps(DeviceCodeUnit& Unit) {
+    if (Unit.sourceKey.empty())
+      return;
+    // The dependency file does not list system headers, which the version
+    // of the compiler and the arguments stand for; the files of the session
+    // are generated from the source.
+    std::vector<std::string> Deps;
+    for (auto& Dep : parseDependencyFile(readFile(Unit.depsFile))) {
+      llvm::SmallString<256> Path(Dep);
+      llvm::sys::fs::make_absolute(Path);
+      if (!m_SessionDir.empty() &&
+          llvm::StringRef(Path).startswith(m_SessionDir))
+        continue;
+      Deps.push_back(Path.str());
+    }
+    {
+      std::error_code EC;
+      llvm::raw_fd_ostream File(Unit.depsFile, EC, llvm::sys::fs::F_Text);
+      for (auto& Dep : Deps)
+        File << Dep << "\n";
+    }
+    storeInCache(Unit.sourceKey, {{".deps", Unit.depsFile}});
+    Unit.cacheKey = getArtifactsKey(Unit.sourceKey, Deps);
+  }
+
+  bool IncrementalSYCLDeviceCompiler::fetchFromCache(
+      const std::string& Key,
+      const std::vector<std::pair<std::string, std::string>>& Files) {
+    if (m_CacheDir.empty() || Key.empty())
       return false;
+    for (auto& File : Files) {
+      llvm::SmallString<256> Path(m_CacheDir);
+      llvm::sys::path::append(Path, Key + File.first);
+      if (llvm::sys::fs::copy_file(Path, File.second)) {
+        ++m_CacheMisses;
+        return false;
+      }
     }
+    ++m_CacheHits;
+    return true;
+  }
 
-    secureCode = false;
+  void IncrementalSYCLDeviceCompiler::storeInCache(
+      const std::string& Key,
+      const std::vector<std::pair<std::string, std::string>>& Files) {
+    if (m_CacheDir.empty() || Key.empty())
+      return;
+    if (llvm::sys::fs::create_directories(m_CacheDir))
+      return;
+    for (auto& File : Files) {
+      // Copy to a temporary first so that concurrent sessions never see a
+      // partially written artifact.
+      llvm::SmallString<256> Path(m_CacheDir);
+      llvm::sys::path::append(Path, Key + File.first);
+      llvm::SmallString<256> TmpPath;
+      if (llvm::sys::fs::createUniqueFile(llvm::Twine(Path) + "-%%%%%%.tmp",
+                                           TmpPath))
+        return;
+      if (llvm::sys::fs::copy_file(File.second, TmpPath) ||
+          llvm::sys::fs::rename(TmpPath, Path)) {
+        llvm::sys::fs::remove(TmpPath);
+        return;
+      }
+    }
+  }
+
+  bool IncrementalSYCLDeviceCompiler::linkUnits() {
+    if (m_Units.empty())
+      return true;
+
+    // The linked spv only depends on the units, in order.
+    std::string LinkKey;
+    if (!m_CacheDir.empty()) {
+      llvm::MD5 Hash;
+      for (auto& Unit : m_Units) {
+        Hash.update(Unit.cacheKey);
+        Hash.update(llvm::StringRef("", 1));
+      }
+      llvm::MD5::MD5Result Result;
+      Hash.final(Result);
+      llvm::SmallString<32> Key;
+      llvm::MD5::stringifyResult(Result, Key);
+      LinkKey.assign(Key.begin(), Key.end());
+    }
+    {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kCache);
+      if (fetchFromCache(LinkKey, {{".spv", m_SPVPath}}))
+        return true;
+    }
+
+    // Programs to run and artifacts to cache once they succeeded. Nothing
+    // else is touched, so that they can run in the background. The pending
+    // frontends are independent of each other; the link jobs run in order.
+    typedef std::vector<std::pair<std::string, std::string>> Artifacts;
+    std::vector<utils::sycl::Job> Frontends, Links;
+    std::vector<std::pair<std::string, Artifacts>> Stores;
+    m_BackgroundFrom = std::string::npos;
+    for (auto& Unit : m_Units) {
+      if (!Unit.pendingBitcode)
+        continue;
+      if (m_BackgroundFrom == std::string::npos)
+        m_BackgroundFrom = Unit.lastUnique;
+      Frontends.emplace_back(m_DeviceCC1Args.front(),
+                             getDeviceFrontendArgs(Unit, false));
+      Stores.emplace_back(Unit.cacheKey,
+                          Artifacts{{".bc", Unit.bitcodeFile},
+                                    {".h", Unit.headerFile}});
+      Unit.pendingBitcode = false;
+    }
+
+    // Later units may contain newer definitions of functions emitted by
+    // earlier units; let them override the previous ones.
+    std::vector<std::string> Args;
+    for (auto& Unit : m_Units) {
+      if (&Unit == &m_Units.front())
+        Args.push_back(Unit.bitcodeFile);
+      else
+        Args.push_back("-override=" + Unit.bitcodeFile);
+    }
+    Args.push_back("-o");
+    Args.push_back(m_LinkedPath);
+    Links.emplace_back(SYCL_BIN_PATH + "/llvm-link", std::move(Args));
+    Links.emplace_back(SYCL_BIN_PATH + "/llvm-spirv",
+                       std::vector<std::string>{m_LinkedPath, "-o", m_SPVPath});
+    Stores.emplace_back(LinkKey, Artifacts{{".spv", m_SPVPath}});
+
+    auto Run = [this, Frontends, Links, Stores]() {
+      auto Start = std::chrono::steady_clock::now();
+      SYCLCompileStats Stats;
+      bool Success = runDeviceJobs(Frontends, Stats);
+      for (auto& J : Links) {
+        if (!Success)
+          break;
+        Success = runProgram(J.first, J.second) == 0;
+      }
+      if (Success)
+        for (auto& S : Stores)
+          storeInCache(S.first, S.second);
+      std::chrono::duration<double> Elapsed =
+          std::chrono::steady_clock::now() - Start;
+      Stats.add(SYCLCompileStats::kLink, Elapsed.count());
+      m_BackgroundStats = Stats;
+      return Success;
+    };
+    if (!m_Async) {
+      const bool Success = Run();
+      m_Stats.merge(m_BackgroundStats);
+      return Success;
+    }
+    m_Background = std::async(std::launch::async, Run);
+    return true;
+  }
+
+  bool IncrementalSYCLDeviceCompiler::declareKernelInfo() {
+    // Find the newest unit defining each kernel, and its specialization.
+    std::unordered_map<std::string, std::pair<size_t, std::string>> newestUnit;
+    for (size_t i = 0; i < m_Units.size(); ++i)
+      for (size_t k = 0; k < m_Units[i].header.kernels.size(); ++k)
+        newestUnit[m_Units[i].header.kernels[k].first] =
+            std::make_pair(i, m_Units[i].header.getKernelKey(k));
+    std::unordered_map<size_t, size_t> unitIndex;
+    for (size_t i = 0; i < m_Units.size(); ++i)
+      unitIndex[m_Units[i].id] = i;
+
+    NoRecordRAII NoRecord(m_Interpreter);
+    {
+      PhaseTimer Timer(m_Stats, SYCLCompileStats::kUnload);
+      // Unload the specializations of removed or redefined kernels, then the
+      // prologues of removed units which they may refer to. A kernel emitted
+      // again by a newer unit keeps the specialization of the older one if
+      // it is the same and the older unit is still there.
+      for (auto it = m_DeclaredKernels.begin();
+           it != m_DeclaredKernels.end();) {
+        auto newest = newestUnit.find(it->first);
+        if (newest != newestUnit.end() &&
+            newest->second.second == it->second.key &&
+            unitIndex.count(it->second.unitId)) {
+          ++it;
+          continue;
+        }
+        if (it->second.T)
+          m_Interpreter->unload(*it->second.T);
+        it = m_DeclaredKernels.erase(it);
+      }
+      for (auto it = m_DeclaredPrologues.begin();
+           it != m_DeclaredPrologues.end();) {
+        if (unitIndex.count(it->first)) {
+          ++it;
+          continue;
+        }
+        if (it->second)
+          m_Interpreter->unload(*it->second);
+        it = m_DeclaredPrologues.erase(it);
+      }
+    }
+
+    PhaseTimer Timer(m_Stats, SYCLCompileStats::kDeclare);
+    // Declare the prologues of new units and the new specializations.
+    for (size_t i = 0; i < m_Units.size(); ++i) {
+      const KernelInfoHeader& Header = m_Units[i].header;
+      if (!m_DeclaredPrologues.count(m_Units[i].id)) {
+        Transaction* T = NULL;
+        if (m_Interpreter->declare(Header.prologue + Header.epilogue, &T) !=
+            Interpreter::kSuccess)
+          return false;
+        m_DeclaredPrologues[m_Units[i].id] = T;
+      }
+      for (auto& Kernel : Header.kernels) {
+        const auto& Newest = newestUnit[Kernel.first];
+        if (Newest.first != i || m_DeclaredKernels.count(Kernel.first))
+          continue;
+        Transaction* T = NULL;
+        if (m_Interpreter->declare(Header.opening + Kernel.second +
+                                       Header.epilogue,
+                                   &T) != Interpreter::kSuccess)
+          return false;
+        m_DeclaredKernels[Kernel.first] = {m_Units[i].id, Newest.second, T};
+      }
+    }
     return true;
   }
 
+  void IncrementalSYCLDeviceCompiler::dropUnitsFrom(size_t unique) {
+    finishBackground();
+    auto it = m_Units.begin();
+    while (it != m_Units.end() && it->lastUnique < unique)
+      ++it;
+    if (it == m_Units.end())
+      return;
+    for (auto dropIt = it; dropIt != m_Units.end(); ++dropIt) {
+      remove(dropIt->sourceFile.c_str());
+      remove(dropIt->bitcodeFile.c_str());
+      remove(dropIt->headerFile.c_str());
+      remove(dropIt->depsFile.c_str());
+    }
+    m_Units.erase(it, m_Units.end());
+    m_UnitsDirty = true;
+
+    // The prefix only covers the remaining units.
+    m_Prefix.resize(m_Units.empty() ? 0 : m_Units.back().prefixSize);
+  }
+
   void IncrementalSYCLDeviceCompiler::setTransaction(Transaction* T) {
     for (auto u : m_Uniques) {
       UniqueToEntry[u]->CurT = T;
     }
+    // Later inputs may launch kernels through the functions of an included
+    // header without naming anything the lexer saw declared.
+    if (m_CollectTransactionNames && T &&
+        T->getState() == Transaction::kCommitted)
+      collectDeclNames(m_Interpreter->getCI()->getSourceManager(), *T,
+                       m_KernelDeclaredNames);
+    m_CollectTransactionNames = false;
   }
 
   void IncrementalSYCLDeviceCompiler::setDeclSuccess(Transaction* T) {
@@ -368,6 +2019,8 @@ namespace cling {
     if (!secureCode) {
       for (auto it = EntryList.begin(); it != EntryList.end();) {
         if (!it->declSuccess && (it->CurT == NULL || it->CurT == T)) {
+          dropUnitsFrom(it->m_unique);
+          dropPrefixPCHsFrom(it->m_unique);
           UniqueToEntry.erase(it->m_unique);
           it = EntryList.erase(it);
         } else {
@@ -383,6 +2036,7 @@ namespace cling {
     strcpy(tmpArg1, arg1.c_str());
     m_Args.push_back(tmpArg1);
     m_ICommandInclude.push_back(arg1);
+    m_DeviceCC1Resolved = false;
     if (arg2.length() > 0) {
       char* tmpArg2 = new char[arg2.length() + 1];
       strcpy(tmpArg2, arg2.c_str());
@@ -1,15 +1,32 @@
 #ifndef CLING_INCREMENTAL_SYCL_COMPILER_H
 #define CLING_INCREMENTAL_SYCL_COMPILER_H
 
+#include "cling/Utils/SYCLCompileServer.h"
+
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+
+#include <ctime>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <list>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+namespace llvm {
+  class raw_ostream;
+} // namespace llvm
+
+namespace clang {
+  namespace vfs {
+    class FileSystem;
+  } // namespace vfs
+} // namespace clang
+
 namespace cling {
   class Transaction;
   class InputValidator;
@@ -19,7 +36,7 @@ namespace cling {
 namespace cling {
 
   void getSYCLCompileOpt(Interpreter* interp, std::vector<const char*>& m_Args,
-                         const char* llvmdir);
+                         const char* llvmdir, const std::string& targetFile);
 
   ///\brief The struct is responsible for storing code that a user inputs at one
   /// time.
@@ -28,6 +45,10 @@ namespace cling {
     unsigned int isStatement;
     ///\brief Content of the code the user inputs at a time.
     std::string code;
+    ///\brief (if isStatement = 1) Declarations extracted out of the wrapper
+    /// function by refactorCode(). Used as the entry's contribution to the
+    /// prefix of later device code units.
+    std::string declCode;
     ///\brief Transaction corresponding to the code.
     Transaction* CurT;
     ///\brief a unique number assigned by IncrementalSYCLDeviceCompiler.
@@ -35,11 +56,152 @@ namespace cling {
     ///\brief (if isStatement = 1) True if the declaration is successful. Used
     /// because some declarations may have NULL transaction.
     bool declSuccess;
+    ///\brief True if the input of the entry may launch or define a kernel.
+    /// A device code unit is ended after such an entry when the new entries
+    /// are split to be compiled in parallel.
+    bool launchesKernel = false;
 
     DumpCodeEntry(unsigned int isStatement, const std::string& input,
                   Transaction* T, bool declSuccuss = false);
   };
 
+  ///\brief Names found in the code of an input by lexing it. Used to decide
+  /// whether the input needs the SYCL compiler at all.
+  struct CodeNames {
+    ///\brief True if the code may launch or define a kernel.
+    bool launchesKernel = false;
+    ///\brief Identifiers used anywhere in the code.
+    std::unordered_set<std::string> used;
+    ///\brief Identifiers the code (re)declares at the outermost level.
+    std::unordered_set<std::string> declared;
+    ///\brief True if the code has preprocessor directives, e.g. an #include
+    /// whose declarations the lexer cannot see.
+    bool hasDirectives = false;
+    ///\brief True if the code uses a macro defined by the user, whose
+    /// expansion the lexer cannot see.
+    bool usesMacros = false;
+  };
+
+  ///\brief A SYCL integration header split into the pieces needed to merge
+  /// the headers of several device code units into one declaration.
+  struct KernelInfoHeader {
+    ///\brief Includes, forward declarations, the kernel signature arrays and
+    /// the primary KernelInfo template, up to the first specialization.
+    std::string prologue;
+    ///\brief Kernel name (as returned by getName()) and its KernelInfo
+    /// specialization, in the order the SYCL compiler emitted them.
+    std::vector<std::pair<std::string, std::string>> kernels;
+    ///\brief Closing namespaces.
+    std::string epilogue;
+    ///\brief Namespace openings of the prologue which the epilogue closes.
+    /// Used to declare a single specialization.
+    std::string opening;
+
+    ///\brief Split the content of an integration header. The kernel signature
+    /// arrays are renamed with the given suffix so that the headers of several
+    /// units can be declared side by side.
+    ///
+    ///\param [in] content - The integration header generated by the SYCL
+    /// compiler.
+    ///\param [in] suffix - Suffix appended to the names of the arrays.
+    ///
+    ///\returns True if the content has the expected layout.
+    bool parse(const std::string& content, const std::string& suffix);
+
+    ///\brief The i-th specialization with the rows of the signature array
+    /// it refers to in place of the reference. Equal for the same kernel
+    /// emitted by several units, whose arrays have different names.
+    std::string getKernelKey(size_t i) const;
+  };
+
+  ///\brief A group of DumpCodeEntrys that were compiled by the SYCL compiler
+  /// in one invocation. Every unit is compiled against the declarations of the
+  /// entries of the previous units, so that its cost only depends on the new
+  /// code.
+  struct DeviceCodeUnit {
+    ///\brief Unique number of the last DumpCodeEntry in the unit. The unit
+    /// contains the entries after the last entry of the previous unit.
+    size_t lastUnique;
+    ///\brief Number assigned by IncrementalSYCLDeviceCompiler, used for naming
+    /// the files of the unit in the session directory.
+    size_t id;
+    ///\brief Cpp file compiled for the unit.
+    std::string sourceFile;
+    ///\brief Device bitcode generated for the unit.
+    std::string bitcodeFile;
+    ///\brief Kernel info header generated for the unit.
+    std::string headerFile;
+    ///\brief Headers the unit included, as written by the SYCL compiler.
+    std::string depsFile;
+    ///\brief Parsed kernel info header of the unit.
+    KernelInfoHeader header;
+    ///\brief Key of the unit's source, compiler and arguments, under which
+    /// the cache lists the headers the unit included.
+    std::string sourceKey;
+    ///\brief Key of the unit's artifacts in the device code cache: the source
+    /// key and the contents of those headers.
+    std::string cacheKey;
+    ///\brief True if only the header of the unit was generated so far; its
+    /// bitcode is left to the background compilation.
+    bool pendingBitcode = false;
+    ///\brief Length of the prefix of the next unit: the declarations of the
+    /// entries up to the end of this unit.
+    size_t prefixSize = 0;
+
+    DeviceCodeUnit(size_t lastUnique, size_t id, const std::string& dir);
+  };
+
+  ///\brief Timers and counters of IncrementalSYCLDeviceCompiler, shown by
+  /// .stats sycl.
+  struct SYCLCompileStats {
+    enum Phase {
+      kSplit,    ///< Splitting inputs into entries and classifying them.
+      kRefactor, ///< Parsing to extract declarations out of wrappers.
+      kPreamble, ///< Building the preamble PCH of the in-process compiler.
+      kDump,     ///< Dumping code for the compilers.
+      kCache,    ///< Looking up and storing device artifacts in the cache.
+      kFrontend, ///< Running the SYCL device frontend.
+      kLink,     ///< Generating pending bitcode, linking and translating.
+      kWait,     ///< Waiting for the background compilation.
+      kUnload,   ///< Unloading kernel info.
+      kDeclare,  ///< Declaring kernel info.
+      kNumPhases
+    };
+    ///\brief Name of each phase, as printed.
+    static const char* const PhaseNames[kNumPhases];
+    ///\brief Wall time spent in each phase, in seconds.
+    double seconds[kNumPhases] = {};
+    ///\brief Number of times each phase ran.
+    size_t count[kNumPhases] = {};
+    ///\brief Number of inputs passed to compile().
+    size_t inputs = 0;
+    ///\brief Number of inputs which did not need the SYCL compiler.
+    size_t skippedInputs = 0;
+    ///\brief Number of bytes of code dumped for the compilers.
+    size_t bytesDumped = 0;
+    ///\brief Number of device jobs run by the SYCL compile server.
+    size_t serverJobs = 0;
+    ///\brief Number of device jobs run by this process.
+    size_t localJobs = 0;
+
+    void add(Phase P, double Seconds) {
+      seconds[P] += Seconds;
+      ++count[P];
+    }
+
+    void merge(const SYCLCompileStats& Other) {
+      for (int P = 0; P < kNumPhases; ++P) {
+        seconds[P] += Other.seconds[P];
+        count[P] += Other.count[P];
+      }
+      inputs += Other.inputs;
+      skippedInputs += Other.skippedInputs;
+      bytesDumped += Other.bytesDumped;
+      serverJobs += Other.serverJobs;
+      localJobs += Other.localJobs;
+    }
+  };
+
   ///\brief Base class for IncrementalSYCLDeviceCompiler. Used only when
   ///lauching
   /// cling without -fsycl.
@@ -57,6 +219,8 @@ namespace cling {
     virtual void removeCodeByTransaction(Transaction* T) {}
     virtual void addCompileArg(const std::string& arg1,
                                const std::string& arg2 = "") {}
+    virtual bool waitForDeviceCode() { return true; }
+    virtual void printStats(llvm::raw_ostream& OS, bool JSON);
   };
 
   ///\brief The class is responsible for dumping cpp code into a cpp file and
@@ -71,15 +235,41 @@ namespace cling {
         MapUnique;
     ///\brief Used for assigning each DumpCodeEntry a unique number.
     static size_t m_UniqueCounter;
+    // The files below are named in the session directory. Those which are
+    // only read by the in-process compiler are kept in memory.
     ///\brief Filename of the target cpp file.
     static const std::string dumpFile;
-    ///\brief Filename of the generated kernel info header file.
-    static const std::string kernelInfoFile;
     ///\brief Filename of the generated spv file.
     static const std::string spvFile;
+    ///\brief Filename of the bitcode linked from every DeviceCodeUnit.
+    static const std::string linkedFile;
+    ///\brief Filename of the preamble: the preprocessor directives (mostly
+    /// #includes) the session starts with.
+    static const std::string preambleFile;
+    ///\brief Filename of the preamble PCH used by refactorCode().
+    static const std::string preamblePCHFile;
+    ///\brief Filename of the preamble PCH used by the SYCL device frontend.
+    static const std::string devicePreamblePCHFile;
 
   private:
     Interpreter* m_Interpreter;
+    ///\brief Private directory of the session, removed with the compiler.
+    /// Holds the files that external tools read or write. Empty if it could
+    /// not be created, in which case the current directory is used.
+    std::string m_SessionDir;
+    ///\brief Paths of the files named by the static members.
+    std::string m_DumpPath, m_SPVPath, m_LinkedPath, m_PreamblePath,
+        m_PreamblePCHPath, m_DevicePreamblePCHPath;
+    ///\brief Files only read by the in-process compiler, by path: their
+    /// content and modification time. They are written to disk only by
+    /// spillMemoryFile().
+    std::unordered_map<std::string, std::pair<std::string, time_t>>
+        m_MemoryFiles;
+    ///\brief Modification time given to the next changed memory file.
+    time_t m_MemoryFileTime = 0;
+    ///\brief m_MemoryFiles overlaid on the real file system. Created once;
+    /// it reads the current content of m_MemoryFiles.
+    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> m_FileSystem;
     ///\brief a list to store every DumpCodeEntry.
     std::list<DumpCodeEntry> EntryList;
     ///\brief a hash table that maps the unique number of a DumpCodeEntry to its
@@ -91,6 +281,26 @@ namespace cling {
     std::vector<size_t> m_Uniques;
     ///\brief Unique number for the last DumpCodeEntry.
     int lastUnique = -1;
+    ///\brief Device code units compiled so far, in the order of EntryList.
+    std::vector<DeviceCodeUnit> m_Units;
+    ///\brief Used for naming the files of each DeviceCodeUnit.
+    size_t m_UnitCounter = 0;
+    ///\brief Declarations of every entry covered by m_Units. Cached so that
+    /// only the new entries have to be dumped for the next unit.
+    std::string m_Prefix;
+    ///\brief True if m_Units changed without being linked and declared.
+    bool m_UnitsDirty = false;
+    ///\brief Names declared by the inputs which needed the SYCL compiler,
+    /// including the headers they include. Using one of them may instantiate
+    /// new device code.
+    std::unordered_set<std::string> m_KernelDeclaredNames;
+    ///\brief True if the last input had preprocessor directives: the names
+    /// its transaction declares are added to m_KernelDeclaredNames by
+    /// setTransaction().
+    bool m_CollectTransactionNames = false;
+    ///\brief Names used by the inputs which needed the SYCL compiler.
+    /// Redeclaring one of them may change the device code.
+    std::unordered_set<std::string> m_KernelUsedNames;
     ///\brief True if the code is entered by the user. Used to avoid non-user
     ///code
     /// to enter the code EntryList.
@@ -100,8 +310,20 @@ namespace cling {
     /// IncrementalSYCLDeviceCompiler to break the whole cppfile sent by
     /// jupyter-notebook into several DumpcodeEntrys.
     std::unique_ptr<InputValidator> m_InputValidator;
-    ///\brief Transaction correspondending to the kernel info header.
-    Transaction** HeadTransaction = NULL;
+    ///\brief Transaction declaring the prologue and epilogue of the kernel
+    /// info header of each unit, by unit id.
+    std::unordered_map<size_t, Transaction*> m_DeclaredPrologues;
+    ///\brief A KernelInfo specialization declared to the interpreter.
+    struct DeclaredKernel {
+      ///\brief Id of the unit whose header it comes from.
+      size_t unitId;
+      ///\brief KernelInfoHeader::getKernelKey() of the specialization.
+      std::string key;
+      ///\brief Transaction declaring it.
+      Transaction* T;
+    };
+    ///\brief Declared KernelInfo specializations by kernel name.
+    std::unordered_map<std::string, DeclaredKernel> m_DeclaredKernels;
     ///\brief If true, removeCodeByTransaction() and setDeclSuccess() are not
     /// allowed to enter and return immediately. Used for declaring kernel info
     /// header inside compileImpl().
@@ -112,6 +334,68 @@ namespace cling {
     std::vector<std::string> m_ICommandInclude;
     ///\brief Path of the SYCL compiler executable
     const std::string SYCL_BIN_PATH;
+    ///\brief Command line of the SYCL device frontend (clang -cc1) as built
+    /// by the SYCL compiler driver for the files in m_DeviceCC1Files. Empty if
+    /// it could not be resolved and the driver has to be run for every unit.
+    std::vector<std::string> m_DeviceCC1Args;
+    ///\brief Source, bitcode and header file of the unit m_DeviceCC1Args was
+    /// resolved for. Replaced by the files of the unit being compiled.
+    std::vector<std::string> m_DeviceCC1Files;
+    ///\brief True if m_DeviceCC1Args is up to date with m_ICommandInclude.
+    bool m_DeviceCC1Resolved = false;
+    ///\brief Content of preambleFile followed by m_ICommandInclude. The
+    /// preamble PCHs are rebuilt when it changes.
+    std::string m_PreambleKey;
+    ///\brief True if preamblePCHFile is valid for m_PreambleKey.
+    bool m_HasPreamblePCH = false;
+    ///\brief True if devicePreamblePCHFile has to be rebuilt before the next
+    /// unit is compiled.
+    bool m_DevicePreamblePCHStale = false;
+    ///\brief True if devicePreamblePCHFile is valid for m_PreambleKey.
+    bool m_HasDevicePreamblePCH = false;
+    ///\brief A PCH of the entries refactored by one parse, chained on the
+    /// previous one or on the preamble PCH.
+    struct PrefixPCH {
+      ///\brief Unique number of the last DumpCodeEntry it covers.
+      size_t lastUnique;
+      ///\brief Memory file the PCH was built from.
+      std::string source;
+      ///\brief The PCH file.
+      std::string pch;
+    };
+    ///\brief Chain of the PCHs built by refactorCode(), so that a parse only
+    /// reads the entries which were not refactored yet.
+    std::vector<PrefixPCH> m_PrefixPCHs;
+    ///\brief Used for naming the files of each PrefixPCH.
+    size_t m_PrefixPCHCounter = 0;
+    ///\brief Directory of the device code cache, shared between sessions.
+    /// Set by $CLING_SYCL_CACHE_DIR; the cache is disabled if it is empty.
+    std::string m_CacheDir;
+    ///\brief Output of the SYCL compiler's --version, part of every cache
+    /// key.
+    std::string m_CompilerVersion;
+    ///\brief Number of device code cache lookups that found the artifacts.
+    size_t m_CacheHits = 0;
+    ///\brief Number of device code cache lookups that missed.
+    size_t m_CacheMisses = 0;
+    ///\brief True if the device code is generated in the background (cling
+    /// -fsycl-async). Only the kernel info header is generated before the
+    /// host code is compiled.
+    bool m_Async = false;
+    ///\brief Background generation of the bitcode of units and of spvFile.
+    std::future<bool> m_Background;
+    ///\brief Last unique number of the first unit whose bitcode is generated
+    /// by m_Background, or npos if it only links.
+    size_t m_BackgroundFrom = std::string::npos;
+    ///\brief Timers and counters of the last job run by linkUnits(). Only
+    /// read once the job is finished.
+    SYCLCompileStats m_BackgroundStats;
+    ///\brief Timers and counters shown by .stats sycl.
+    SYCLCompileStats m_Stats;
+    ///\brief Socket of the SYCL compile server running the device jobs, set
+    /// by $CLING_SYCL_SERVER. Cleared if the server cannot be reached, after
+    /// which the jobs run in this process.
+    std::string m_ServerSocket;
 
   public:
     IncrementalSYCLDeviceCompiler(Interpreter* interp,
@@ -137,6 +421,8 @@ namespace cling {
                  unsigned int isStatement, bool declSuccess = false);
 
     ///\brief set Transaction for all DumpCodeEntry recoreded in m_Uniques.
+    /// If the input had preprocessor directives, record the names declared by
+    /// the headers it included.
     ///
     ///\param [in] T - Transaction correspondending to the code.
     void setTransaction(Transaction* T);
@@ -159,6 +445,19 @@ namespace cling {
     ///\param [in] arg2 - Argument 2.
     void addCompileArg(const std::string& arg1, const std::string& arg2 = "");
 
+    ///\brief Wait for the device code generated in the background. Called by
+    /// Interpreter before running code, which may submit kernels.
+    ///
+    ///\returns True if the device code is ready.
+    bool waitForDeviceCode();
+
+    ///\brief Print the timers and counters. Called by Interpreter::dump() for
+    /// .stats sycl [json].
+    ///
+    ///\param [in] OS - The stream to print to.
+    ///\param [in] JSON - Print a JSON object instead of a table.
+    void printStats(llvm::raw_ostream& OS, bool JSON);
+
     ///\brief Wrap the input code by a unique function. For instance, void
     ///__cling_custom_sycl_13.
     ///
@@ -169,12 +468,51 @@ namespace cling {
     static std::string SyclWrapInput(const std::string& Input,
                                      unsigned int is_statement);
 
+    ///\brief Path of the spv file read by the SYCL runtime.
+    const std::string& getSPVPath() const { return m_SPVPath; }
+
+    ///\brief Number of device code cache lookups that found the artifacts.
+    size_t getCacheHits() const { return m_CacheHits; }
+
+    ///\brief Number of device code cache lookups that missed.
+    size_t getCacheMisses() const { return m_CacheMisses; }
+
   private:
-    ///\brief Dump the code of every DumpCodeEntry in EntryList to a target
-    ///file.
+    ///\brief Path of a file in the session directory.
     ///
-    ///\param [in] target - Filename of the target file.
-    void dump(const std::string& target);
+    ///\param [in] name - Filename.
+    std::string getSessionPath(const std::string& name) const;
+
+    ///\brief Keep a file read by the in-process compiler in memory.
+    ///
+    ///\param [in] path - Path of the file.
+    ///\param [in] content - Content of the file.
+    void writeMemoryFile(const std::string& path, const std::string& content);
+
+    ///\brief Write a memory file to disk, for an external tool.
+    ///
+    ///\param [in] path - Path of the file.
+    void spillMemoryFile(const std::string& path);
+
+    ///\brief The file system of the in-process compiler: the memory files
+    /// overlaid on the real file system.
+    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> getFileSystem();
+
+    ///\brief Decide whether an input needs the SYCL compiler: it launches a
+    /// kernel, has preprocessor directives, uses a macro of the user, uses a
+    /// name declared by an input which needed it, or redeclares a name used
+    /// by such an input. Records the names of the input if so.
+    ///
+    ///\param [in] Names - Names found in the input.
+    ///
+    ///\returns True if the input needs the SYCL compiler.
+    bool isDeviceRelevant(const CodeNames& Names);
+
+    ///\brief Extract the declarations of every DumpCodeEntry which has not
+    /// been refactored yet, in the order they were entered, by a single parse.
+    ///
+    ///\returns True if compiling is successful.
+    bool refactorPending();
 
     ///\brief Call SYCL compiler to generate .spv and kernel info header. Load
     ///the
@@ -183,6 +521,161 @@ namespace cling {
     ///\returns True if compiling is successful.
     bool compileImpl();
 
+    ///\brief Split the entries which are not covered by m_Units yet into
+    /// units that can be compiled in parallel. Each unit but the last ends
+    /// after an entry launching a kernel; at most one unit per core is made.
+    ///
+    ///\returns The new units, whose files are not created yet.
+    std::vector<DeviceCodeUnit> splitNewEntries();
+
+    ///\brief Compile new DeviceCodeUnits. Every unit is compiled against the
+    /// declarations of the entries before it, so their device frontends run
+    /// in parallel.
+    ///
+    ///\param [in] Units - The units to compile, in the order of EntryList.
+    /// Their files are created.
+    ///
+    ///\returns True if compiling is successful.
+    bool compileUnits(std::vector<DeviceCodeUnit>& Units);
+
+    ///\brief Rewrite the declarations a unit adds to the prefix of the next
+    /// units so that these do not instantiate and emit its kernels again:
+    /// functions launching kernels are only declared, and variables
+    /// initialized by a kernel launch are declared extern. Left as written
+    /// if they cannot be parsed.
+    ///
+    ///\param [in] Prefix - Declarations of the previous units.
+    ///\param [in,out] Decls - Declarations of the entries of the unit.
+    void stripKernels(const std::string& Prefix, std::string& Decls);
+
+    ///\brief Arguments of the SYCL compiler driver compiling a unit.
+    ///
+    ///\param [in] Unit - The unit to compile.
+    ///
+    ///\returns The arguments, without the driver itself.
+    std::vector<std::string> getDriverArgs(const DeviceCodeUnit& Unit) const;
+
+    ///\brief Ask the SYCL compiler driver (-###) for the device frontend job
+    /// it would run for the unit, so that later units can skip the shell and
+    /// the driver and run the frontend directly.
+    ///
+    ///\param [in] Unit - The unit to resolve the frontend job for.
+    void resolveDeviceCC1(const DeviceCodeUnit& Unit);
+
+    ///\brief Arguments of the resolved SYCL device frontend job compiling a
+    /// unit.
+    ///
+    ///\param [in] Unit - The unit to compile.
+    ///\param [in] HeaderOnly - Only generate the kernel info header.
+    ///
+    ///\returns The arguments, without the frontend itself.
+    std::vector<std::string> getDeviceFrontendArgs(const DeviceCodeUnit& Unit,
+                                                   bool HeaderOnly) const;
+
+    ///\brief The job running the SYCL device frontend on a unit, or the SYCL
+    /// compiler driver if the frontend job could not be resolved. In async
+    /// mode, the job only generates the kernel info header and the unit is
+    /// marked pendingBitcode.
+    ///
+    ///\param [in] Unit - The unit to compile.
+    utils::sycl::Job getFrontendJob(DeviceCodeUnit& Unit);
+
+    ///\brief Run independent device jobs in parallel, on the SYCL compile
+    /// server if there is one, or on one thread per core otherwise. Also run
+    /// by the background compilation, which never overlaps a foreground call.
+    ///
+    ///\param [in] Jobs - The jobs to run.
+    ///\param [out] Stats - Counts the jobs run.
+    ///
+    ///\returns True if every job succeeded.
+    bool runDeviceJobs(const std::vector<utils::sycl::Job>& Jobs,
+                       SYCLCompileStats& Stats);
+
+    ///\brief Wait for the background compilation, if any. If it failed, the
+    /// units it compiled are dropped so that the next input recompiles them.
+    ///
+    ///\returns True if the background compilation was successful.
+    bool finishBackground();
+
+    ///\brief Collect the preprocessor-only entries the session starts with
+    /// into the preamble, and rebuild the preamble PCH of refactorCode() if the
+    /// preamble or the .I arguments changed. The PCH of the device frontend
+    /// is rebuilt lazily by buildDevicePreamblePCH().
+    void updatePreamble();
+
+    ///\brief Build the preamble PCH used by the SYCL device frontend.
+    void buildDevicePreamblePCH();
+
+    ///\brief Compute the cache key of a unit from its source, the compiler
+    /// arguments and the SYCL compiler version.
+    ///
+    ///\param [in] Source - The content of the unit's source file.
+    ///\param [in] Unit - The unit to compile.
+    ///
+    ///\returns The key, as a hex string.
+    std::string getCacheKey(const std::string& Source,
+                            const DeviceCodeUnit& Unit);
+
+    ///\brief Compute the key of a unit's artifacts from its source key and
+    /// the current contents of the headers it included, so that editing a
+    /// header invalidates the artifacts of the units including it.
+    ///
+    ///\param [in] SourceKey - The key returned by getCacheKey().
+    ///\param [in] Deps - Absolute paths of the headers.
+    ///
+    ///\returns The key, as a hex string.
+    std::string getArtifactsKey(const std::string& SourceKey,
+                                const std::vector<std::string>& Deps) const;
+
+    ///\brief The headers the cache lists for a source key, which are those
+    /// the unit included when it was stored.
+    std::vector<std::string> getCachedDeps(const std::string& SourceKey) const;
+
+    ///\brief Read the headers a compiled unit included, list them in the
+    /// cache under its source key and update its artifacts key.
+    void recordDeps(DeviceCodeUnit& Unit);
+
+    ///\brief Copy the cached artifacts stored under a key to their files.
+    ///
+    ///\param [in] Key - The cache key.
+    ///\param [in] Files - Extension of each cached artifact and the file it
+    /// is copied to.
+    ///
+    ///\returns True if every artifact was found.
+    bool fetchFromCache(
+        const std::string& Key,
+        const std::vector<std::pair<std::string, std::string>>& Files);
+
+    ///\brief Store artifacts in the cache under a key.
+    ///
+    ///\param [in] Key - The cache key.
+    ///\param [in] Files - Extension of each artifact and the file it is
+    /// copied from.
+    void storeInCache(
+        const std::string& Key,
+        const std::vector<std::pair<std::string, std::string>>& Files);
+
+    ///\brief Link the bitcode of every unit into a single spv file. In async
+    /// mode, the pending bitcode is generated and linked in the background.
+    ///
+    ///\returns True if linking is successful (or was started).
+    bool linkUnits();
+
+    ///\brief Bring the declared kernel info up to date with m_Units: only
+    /// the specializations of new or redefined kernels are declared, and only
+    /// those of removed or redefined kernels are unloaded. A kernel defined by
+    /// several units is declared from the newest one only, unless its
+    /// specialization is unchanged.
+    ///
+    ///\returns True if the declaration is successful.
+    bool declareKernelInfo();
+
+    ///\brief Drop the unit containing the DumpCodeEntry with the given unique
+    /// number and every later unit, since their prefix is no longer valid.
+    ///
+    ///\param [in] unique - Unique number of a removed DumpCodeEntry.
+    void dropUnitsFrom(size_t unique);
+
     ///\brief Insert a DumpCodeEntry to EntryList.
     ///
     ///\param [in] isStatement - 1 if the code is not declaration, and 1
@@ -195,8 +688,18 @@ namespace cling {
     /// extract declaration out of wrapper function into the global scope. Then
     /// modify the code of DumpCodeEntry in EntryList.
     ///
+    /// The entries refactored before are read from m_PrefixPCHs; the parse
+    /// adds a PCH of the entries it refactored to the chain.
+    ///
+    ///\param [in] uniques - Unique numbers of the statement entries to
+    /// refactor, which are all the statement entries after lastUnique.
+    ///
     ///\returns True if compiling is successful.
-    bool refactorCode();
+    bool refactorCode(const std::vector<size_t>& uniques);
+
+    ///\brief Drop the PCHs of m_PrefixPCHs covering a DumpCodeEntry from
+    /// unique on, which is being removed.
+    void dropPrefixPCHsFrom(size_t unique);
   };
 
 } // namespace cling
@@ -342,7 +342,7 @@ namespace cling {
     return &Cmd->getArguments();
   }
   void getSYCLCompileOpt(Interpreter* interp, std::vector<const char*>& m_Args,
-                         const char* llvmdir) {
+                         const char* llvmdir, const std::string& targetFile) {
     std::string cppStdVersion;
     clang::LangOptions langOpts = interp->getCI()->getLangOpts();
     cling::CompilerOptions COpts = interp->getOptions().CompilerOpts;
@@ -464,11 +464,10 @@ namespace cling {
       it++;
     }
     char* noWarnings = new char[3];
-    char* targetFile =
-        new char[IncrementalSYCLDeviceCompiler::dumpFile.length() + 1];
+    char* targetFileCString = new char[targetFile.length() + 1];
     strcpy(noWarnings, "-w");
-    strcpy(targetFile, IncrementalSYCLDeviceCompiler::dumpFile.c_str());
+    strcpy(targetFileCString, targetFile.c_str());
     m_Args.push_back(noWarnings);
-    m_Args.push_back(targetFile);
+    m_Args.push_back(targetFileCString);
   }
 } // namespace cling
\ No newline at end of file
@@ -48,10 +48,12 @@
 #include "clang/CodeGen/ModuleBuilder.h"
 #include "clang/Frontend/ASTConsumers.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/Utils.h"
 #include "clang/Lex/ExternalPreprocessorSource.h"
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Lex/HeaderSearchOptions.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Parse/Parser.h"
 #include "clang/Sema/Sema.h"
@@ -59,8 +61,12 @@
 
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -93,6 +99,63 @@ namespace {
   static bool isPracticallyEmptyModule(const llvm::Module* M) {
     return M->empty() && M->global_empty() && M->alias_empty();
   }
+
+  // Leads the lines of a snapshot header naming the libraries to reload.
+  static const char kSnapshotLibrary[] = "// library: ";
+
+  // Append the source of the declarations that were extracted from the wrapper
+  // of the transaction to Out, one statement per line.
+  static void appendExtracted(const cling::Transaction& T,
+                              const SourceManager& SM, const LangOptions& LO,
+                              std::string& Out) {
+    const FunctionDecl* Wrapper = T.getWrapperFD();
+    if (!Wrapper)
+      return;
+    // The declarators of a statement share its start: `int a = 1, b = 2;`.
+    SourceRange Range;
+    auto append = [&]() {
+      if (Range.isInvalid())
+        return;
+      StringRef Text = Lexer::getSourceText(
+          CharSourceRange::getTokenRange(Range), SM, LO);
+      if (!Text.empty())
+        Out += Text.str() + ";\n";
+    };
+    for (auto I = T.decls_begin(), E = T.decls_end(); I != E; ++I) {
+      if (I->m_Call != cling::Transaction::kCCIHandleTopLevelDecl)
+        continue;
+      for (const Decl* D : I->m_DGR) {
+        // What ensures the order of the initializations has no location.
+        if (!D || D == Wrapper || D->isImplicit() ||
+            D->getLocStart().isInvalid() ||
+            !SM.isBeforeInTranslationUnit(Wrapper->getLocStart(),
+                                          D->getLocStart()))
+          continue;
+        if (Range.isValid() && D->getLocStart() == Range.getBegin()) {
+          if (SM.isBeforeInTranslationUnit(Range.getEnd(), D->getLocEnd()))
+            Range.setEnd(D->getLocEnd());
+          continue;
+        }
+        append();
+        Range = D->getSourceRange();
+      }
+    }
+    append();
+  }
+
+  // Whether the code completion interpreter imported something that unloading
+  // the transaction destroys.
+  static bool hasImported(const cling::ExternalInterpreterSource& Source,
+                          const cling::Transaction& T) {
+    for (auto I = T.decls_begin(), E = T.decls_end(); I != E; ++I)
+      for (const Decl* D : I->m_DGR)
+        if (D && Source.hasImported(D))
+          return true;
+    for (auto I = T.nested_begin(), E = T.nested_end(); I != E; ++I)
+      if (hasImported(Source, **I))
+        return true;
+    return false;
+  }
 } // unnamed namespace
 
 namespace cling {
@@ -262,7 +325,8 @@ namespace cling {
       return;
 
     if (!isInSyntaxOnlyMode()) {
-      m_Executor.reset(new IncrementalExecutor(SemaRef.Diags, *getCI()));
+      m_Executor.reset(new IncrementalExecutor(SemaRef.Diags, *getCI(),
+                                               m_Opts));
       if (!m_Executor)
         return;
     }
@@ -293,6 +357,10 @@ namespace cling {
        }
     }
 
+    // The libraries must be there before the snapshot's initializers run.
+    if (!m_Opts.RestorePath.empty())
+      restoreSnapshot();
+
     llvm::SmallVector<IncrementalParser::ParseResultTransaction, 2>
       IncrParserTransactions;
     if (!m_IncrParser->Initialize(IncrParserTransactions, parentInterp)) {
@@ -363,11 +431,15 @@ namespace cling {
         }
         else {
           std::string SYCL_BIN_PATH(SYCL_BIN_PATH_CString);
-          setenv("SYCL_USE_KERNEL_SPV", IncrementalSYCLDeviceCompiler::spvFile.c_str(), 1);
-          m_SYCLCompiler.reset(new IncrementalSYCLDeviceCompiler(this, SYCL_BIN_PATH, llvmdir));
+          IncrementalSYCLDeviceCompiler* SYCLCompiler =
+            new IncrementalSYCLDeviceCompiler(this, SYCL_BIN_PATH, llvmdir);
+          setenv("SYCL_USE_KERNEL_SPV", SYCLCompiler->getSPVPath().c_str(), 1);
+          m_SYCLCompiler.reset(SYCLCompiler);
         }
       }
     }
+
+    m_RecordDeclarations = true;
   }
 
   ///\brief Constructor for the child Interpreter.
@@ -403,6 +475,9 @@ namespace cling {
   }
 
   Interpreter::~Interpreter() {
+    // The completion interpreter refers to our AST and executor.
+    m_CompletionInterp.reset();
+
     // Do this first so m_StoredStates will be ignored if Interpreter::unload
     // is called later on.
     for (size_t i = 0, e = m_StoredStates.size(); i != e; ++i)
@@ -650,6 +725,157 @@ namespace cling {
       ClangInternalState::printLookupTables(where, getSema().getASTContext());
     else if (what.equals("undo"))
       m_IncrParser->printTransactionStructure();
+    else if (what.equals("sycl"))
+      m_SYCLCompiler->printStats(where, filter.equals("json"));
+    else if (what.equals("jitmem") && m_Executor)
+      m_Executor->printMemoryStats(where, filter.equals("json"));
+    else if (what.equals("jitcache") && m_Executor)
+      m_Executor->printObjectCacheStats(where, filter.equals("json"));
+  }
+
+  void Interpreter::optimizeWithProfile(llvm::raw_ostream& Out) {
+    if (m_Executor)
+      m_Executor->optimizeWithProfile(Out);
+  }
+
+  bool Interpreter::saveSnapshot(llvm::StringRef path) const {
+    const CompilerInstance* CI = getCI();
+    if (CI->getLangOpts().Modules) {
+      cling::errs() << "cling: snapshots are PCHs, not C++ modules.\n";
+      return false;
+    }
+    if (m_Opts.CompilerOpts.SYCL) {
+      cling::errs() << "cling: sessions with -fsycl cannot be saved: the "
+                       "snapshot would not hold their SYCL device code.\n";
+      return false;
+    }
+
+    llvm::SmallString<256> PCH(path);
+    llvm::sys::fs::make_absolute(PCH);
+    // The PCH is compiled from this header, and clang checks it is unchanged
+    // when loading the PCH: it stays next to it.
+    const std::string Header = (PCH.str() + ".h").str();
+    {
+      std::error_code EC;
+      llvm::raw_fd_ostream Out(Header, EC, llvm::sys::fs::F_Text);
+      if (EC) {
+        cling::errs() << "cling: cannot write '" << Header << "': "
+                      << EC.message() << '\n';
+        return false;
+      }
+      Out << "// Declarations of a cling session, compiled into " << PCH.str()
+          << "\n";
+      for (const std::string& Lib : m_DyLibManager->getLoadedLibraries())
+        Out << kSnapshotLibrary << Lib << '\n';
+      // Interpreters restoring the snapshot then find the runtime parsed.
+      if (!m_Opts.NoRuntime && CI->getLangOpts().CPlusPlus)
+        Out << "#include \"cling/Interpreter/RuntimeUniverse.h\"\n";
+      for (const auto& Decls : m_Declarations)
+        Out << Decls.second << '\n';
+    }
+
+    // Compile it as `cling -x c++-header <path>.h -o <path>` would, with the
+    // flags and include paths of this interpreter, which the PCH must match.
+    const CompilerOptions& COpts = m_Opts.CompilerOpts;
+    std::vector<std::string> Args;
+    for (size_t I = 0, E = COpts.Remaining.size(); I < E; ++I) {
+      llvm::StringRef Arg = COpts.Remaining[I];
+      // The snapshot this one started from is included through its header.
+      if (Arg == "-include-pch" && I + 1 < E &&
+          m_Opts.RestorePath == COpts.Remaining[I + 1]) {
+        ++I;
+        continue;
+      }
+      if (I && std::find(m_Opts.Inputs.begin(), m_Opts.Inputs.end(), Arg)
+                 != m_Opts.Inputs.end())
+        continue;
+      Args.push_back(Arg.str());
+    }
+    for (const HeaderSearchOptions::Entry& Entry
+           : CI->getHeaderSearchOpts().UserEntries) {
+      if (Entry.IsFramework)
+        continue;
+      switch (Entry.Group) {
+        case frontend::Quoted: Args.push_back("-iquote"); break;
+        case frontend::Angled: Args.push_back("-I"); break;
+        case frontend::After: Args.push_back("-idirafter"); break;
+        default: continue; // The system directories are set up again.
+      }
+      Args.push_back(Entry.Path);
+    }
+    Args.insert(Args.end(),
+                {"-x", "c++-header", Header, "-o", PCH.str().str()});
+
+    std::vector<const char*> Argv;
+    Argv.reserve(Args.size());
+    for (const std::string& Arg : Args)
+      Argv.push_back(Arg.c_str());
+
+    // As for the code completion interpreter: remove "/lib/clang/<version>".
+    const std::string& ResourceDir = CI->getHeaderSearchOpts().ResourceDir;
+    const std::string LLVMDir = llvm::sys::path::parent_path(
+                                  llvm::sys::path::parent_path(
+                                  llvm::sys::path::parent_path(ResourceDir)))
+                                  .str();
+
+    InvocationOptions Opts(Argv.size(), Argv.data());
+    std::unique_ptr<CompilerInstance> PCHCI(
+        CIFactory::createCI("", Opts, LLVMDir.c_str(), nullptr, {}));
+    if (!PCHCI) {
+      cling::errs() << "cling: cannot set up the compilation of '" << Header
+                    << "'.\n";
+      return false;
+    }
+    GeneratePCHAction Action;
+    if (!PCHCI->ExecuteAction(Action)) {
+      cling::errs() << "cling: the snapshot could not be compiled from '"
+                    << Header << "'.\n";
+      llvm::sys::fs::remove(PCH);
+      return false;
+    }
+    return true;
+  }
+
+  void Interpreter::restoreSnapshot() {
+    llvm::SmallString<256> Header(m_Opts.RestorePath);
+    llvm::sys::fs::make_absolute(Header);
+    Header += ".h";
+    auto Buffer = llvm::MemoryBuffer::getFile(Header);
+    if (!Buffer) {
+      cling::errs() << "cling: cannot read '" << Header << "': "
+                    << Buffer.getError().message() << '\n';
+      return;
+    }
+
+    // The libraries are listed in the leading comment.
+    llvm::StringRef Lines = (*Buffer)->getBuffer();
+    while (Lines.startswith("//")) {
+      std::pair<llvm::StringRef, llvm::StringRef> Split = Lines.split('\n');
+      Lines = Split.second;
+      if (!Split.first.startswith(kSnapshotLibrary))
+        continue;
+      const std::string Lib =
+        Split.first.substr(sizeof(kSnapshotLibrary) - 1).rtrim().str();
+      switch (m_DyLibManager->loadLibrary(Lib, /*permanent*/false,
+                                          /*resolved*/true)) {
+        case DynamicLibraryManager::kLoadLibSuccess:
+        case DynamicLibraryManager::kLoadLibAlreadyLoaded:
+          break;
+        default:
+          cling::errs() << "cling: cannot reload '" << Lib
+                        << "' of the snapshot.\n";
+      }
+    }
+
+    // Snapshots of this session are compiled on top of the restored one.
+    m_Declarations.emplace_back(nullptr,
+                                "#include \"" + Header.str().str() + "\"");
+  }
+
+  void Interpreter::recordDeclarations(llvm::StringRef input,
+                                       const Transaction* T) {
+    if (m_RecordDeclarations && !input.trim().empty())
+      m_Declarations.emplace_back(T, input.str());
   }
 
   void Interpreter::storeInterpreterState(const std::string& name) const {
@@ -786,11 +1012,17 @@ namespace cling {
 
     CompilationOptions CO = makeDefaultCompilationOpts();
     CO.EnableShadowing = m_RedefinitionAllowed && !isRawInputEnabled();
+    Transaction* LastT = nullptr;
+    if (!T)
+      T = &LastT;
     if (isRawInputEnabled() || wrapPoint == std::string::npos) {
       CO.DeclarationExtraction = 0;
       CO.ValuePrinting = 0;
       CO.ResultEvaluation = 0;
-      return DeclareInternal(input, CO, T);
+      if (DeclareInternal(input, CO, T) == Interpreter::kFailure)
+        return Interpreter::kFailure;
+      recordDeclarations(input, *T);
+      return Interpreter::kSuccess;
     }
 
     CO.DeclarationExtraction = 1;
@@ -804,6 +1036,13 @@ namespace cling {
       return Interpreter::kFailure;
     }
 
+    // What precedes the wrapper is declared as is; what the wrapper declared
+    // was extracted to the global scope as it was written.
+    std::string Declared = wrapReadySource.substr(0, wrapPoint) + "\n";
+    if (*T)
+      appendExtracted(**T, getSema().getSourceManager(),
+                      getCI()->getLangOpts(), Declared);
+    recordDeclarations(Declared, *T);
     return Interpreter::kSuccess;
   }
 
@@ -919,7 +1158,13 @@ namespace cling {
     CO.ResultEvaluation = 0;
     CO.CheckPointerValidity = 0;
 
-    return DeclareInternal(input, CO, T);
+    Transaction* LastT = nullptr;
+    if (!T)
+      T = &LastT;
+    if (DeclareInternal(input, CO, T) == kFailure)
+      return kFailure;
+    recordDeclarations(input, *T);
+    return kSuccess;
   }
 
   Interpreter::CompilationResult
@@ -940,36 +1185,64 @@ namespace cling {
   Interpreter::CompilationResult
   Interpreter::codeComplete(const std::string& line, size_t& cursor,
                             std::vector<std::string>& completions) const {
+    return codeCompleteWith(line, cursor, new ClingCodeCompleteConsumer(
+                getCI()->getFrontendOpts().CodeCompleteOpts, completions));
+  }
 
-    const char * const argV = "cling";
-    std::string resourceDir = this->getCI()->getHeaderSearchOpts().ResourceDir;
-    // Remove the extra 3 directory names "/lib/clang/3.9.0"
-    StringRef parentResourceDir = llvm::sys::path::parent_path(
-                                  llvm::sys::path::parent_path(
-                                  llvm::sys::path::parent_path(resourceDir)));
-    std::string llvmDir = parentResourceDir.str();
+  Interpreter::CompilationResult
+  Interpreter::codeComplete(const std::string& line, size_t& cursor,
+                   const std::function<bool(std::vector<std::string>&)>& sink,
+                   size_t batchSize) const {
+    return codeCompleteWith(line, cursor, new ClingCodeCompleteConsumer(
+                getCI()->getFrontendOpts().CodeCompleteOpts, sink, batchSize));
+  }
 
-    Interpreter childInterpreter(*this, 1, &argV, llvmDir.c_str());
-    if (!childInterpreter.isValid())
-      return kFailure;
+  Interpreter::CompilationResult
+  Interpreter::codeCompleteWith(const std::string& line, size_t& cursor,
+                                ClingCodeCompleteConsumer* consumer) const {
+    std::unique_ptr<ClingCodeCompleteConsumer> ownedConsumer(consumer);
+
+    if (!m_CompletionInterp || m_CompletionStale) {
+      m_CompletionInterp.reset();
+      const char * const argV = "cling";
+      std::string resourceDir =
+        this->getCI()->getHeaderSearchOpts().ResourceDir;
+      // Remove the extra 3 directory names "/lib/clang/3.9.0"
+      StringRef parentResourceDir = llvm::sys::path::parent_path(
+                                    llvm::sys::path::parent_path(
+                                    llvm::sys::path::parent_path(resourceDir)));
+      std::string llvmDir = parentResourceDir.str();
+
+      std::unique_ptr<Interpreter> childInterpreter(
+                      new Interpreter(*this, 1, &argV, llvmDir.c_str()));
+      if (!childInterpreter->isValid())
+        return kFailure;
 
+      // Ignore diagnostics when we tab complete.
+      // This is because we get redefinition errors due to the import of the
+      // decls.
+      childInterpreter->getCI()->getDiagnostics().setClient(
+                                    new clang::IgnoringDiagConsumer(), true);
+      m_CompletionInterp = std::move(childInterpreter);
+      m_CompletionStale = false;
+    } else {
+      // Let the lookups see what was declared since the last completion.
+      static_cast<ExternalInterpreterSource*>(
+        m_CompletionInterp->getCI()->getASTContext().getExternalSource())
+          ->reconcile();
+    }
+
+    Interpreter& childInterpreter = *m_CompletionInterp;
     auto childCI = childInterpreter.getCI();
     clang::Sema &childSemaRef = childCI->getSema();
 
-    // Create the CodeCompleteConsumer with InterpreterCallbacks
-    // from the parent interpreter and set the consumer for the child
-    // interpreter.
-    ClingCodeCompleteConsumer* consumer = new ClingCodeCompleteConsumer(
-                getCI()->getFrontendOpts().CodeCompleteOpts, completions);
-    // Child interpreter CI will own consumer!
-    childCI->setCodeCompletionConsumer(consumer);
+    // Set the consumer for the child interpreter.
+    // Child interpreter CI will own consumer, and delete the previous one!
+    childCI->setCodeCompletionConsumer(ownedConsumer.release());
     childSemaRef.CodeCompleter = consumer;
 
-    // Ignore diagnostics when we tab complete.
-    // This is because we get redefinition errors due to the import of the decls.
-    clang::IgnoringDiagConsumer* ignoringDiagConsumer =
-                                            new clang::IgnoringDiagConsumer();
-    childSemaRef.getDiagnostics().setClient(ignoringDiagConsumer, true);
+    DiagnosticConsumer* ignoringDiagConsumer =
+                                    childSemaRef.getDiagnostics().getClient();
     DiagnosticsEngine& parentDiagnostics = this->getCI()->getSema().getDiagnostics();
 
     std::unique_ptr<DiagnosticConsumer> ownerDiagConsumer =
@@ -987,6 +1260,8 @@ namespace cling {
     parentDiagnostics.setClient(clientDiagConsumer,
                                 ownerDiagConsumer.release() != nullptr);
     parentDiagnostics.Reset(/*soft=*/true);
+    // The errors of this completion must not affect the next one.
+    childSemaRef.getDiagnostics().Reset(/*soft=*/true);
 
     return kSuccess;
   }
@@ -1093,6 +1368,10 @@ namespace cling {
     if (!FD)
       return kExeUnkownFunction;
 
+    // The function may submit SYCL kernels.
+    if (!m_SYCLCompiler->waitForDeviceCode())
+      return kExeCompilationError;
+
     std::string mangledNameIfNeeded;
     utils::Analyze::maybeMangleDeclName(FD, mangledNameIfNeeded);
     IncrementalExecutor::ExecutionResult ExeRes =
@@ -1329,6 +1608,8 @@ namespace cling {
       = m_IncrParser->Compile(Wrapper, CO);
     Transaction* lastT = PRT.getPointer();
     m_SYCLCompiler->setTransaction(lastT);
+    if (T)
+      *T = lastT;
     
     if (lastT && lastT->getState() != Transaction::kCommitted) {
       assert((lastT->getState() == Transaction::kCommitted
@@ -1438,11 +1719,28 @@ namespace cling {
     CO.ValuePrinting = 0;
     CO.ResultEvaluation = 0;
     CO.CheckPointerValidity = 1;
+    Transaction* LastT = nullptr;
+    if (!T)
+      T = &LastT;
     CompilationResult res = DeclareInternal(code, CO, T);
+    if (res == kSuccess)
+      recordDeclarations(code, *T);
     return res;
   }
 
   void Interpreter::unload(Transaction& T) {
+    // Most unloads, such as the SYCL kernel information being declared again,
+    // remove nothing the completions looked at.
+    if (m_CompletionInterp && !m_CompletionStale)
+      m_CompletionStale = hasImported(
+          *static_cast<ExternalInterpreterSource*>(
+              m_CompletionInterp->getCI()->getASTContext().getExternalSource()),
+          T);
+    m_Declarations.erase(std::remove_if(m_Declarations.begin(),
+                                        m_Declarations.end(),
+        [&T](const std::pair<const Transaction*, std::string>& D) {
+          return D.first == &T;
+        }), m_Declarations.end());
     // Clear any stored states that reference the llvm::Module.
     // Do it first in case
     m_SYCLCompiler->removeCodeByTransaction(&T);
@@ -1650,6 +1948,10 @@ namespace cling {
     if (!isPracticallyEmptyModule(M.get())) {
       m_Executor->emitModule(M, T.getCompilationOpts().OptLevel);
 
+      // Static initializers may submit SYCL kernels.
+      if (!m_SYCLCompiler->waitForDeviceCode())
+        return kExeCompilationError;
+
       // Forward to IncrementalExecutor; should not be called by
       // anyone except for IncrementalParser.
       ExeRes = m_Executor->runStaticInitializersOnce(T);
@@ -20,6 +20,7 @@
 #include "llvm/Option/OptTable.h"
 
 #include <memory>
+#include <thread>
 
 using namespace clang;
 using namespace clang::driver;
@@ -75,6 +76,40 @@ static const char kNoStdInc[] = "-nostdinc";
     Opts.ShowVersion = Args.hasArg(OPT_version);
     Opts.Help = Args.hasArg(OPT_help);
     Opts.NoRuntime = Args.hasArg(OPT_noruntime);
+    Opts.JITProfile = Args.hasArg(OPT_fjit_pgo);
+    Opts.TieredJIT = Args.hasArg(OPT_ftiered_jit) || Opts.JITProfile;
+    Opts.LazyJIT = Args.hasArg(OPT_flazy_jit);
+    if (Arg* ParallelArg = Args.getLastArg(OPT_fparallel_jit,
+                                           OPT_fparallel_jit_EQ)) {
+      if (ParallelArg->getOption().matches(OPT_fparallel_jit))
+        Opts.ParallelJIT = std::thread::hardware_concurrency();
+      else if (StringRef(ParallelArg->getValue())
+                   .getAsInteger(10, Opts.ParallelJIT))
+        cling::errs() << "ERROR: invalid number of JIT threads '"
+                      << ParallelArg->getValue() << "', ignoring.\n";
+    }
+    if (Arg* JITCacheArg = Args.getLastArg(OPT__jit_cache_EQ))
+      Opts.JITCachePath = JITCacheArg->getValue();
+    if (Arg* RestoreArg = Args.getLastArg(OPT__restore_EQ)) {
+      // The snapshot is a PCH: clang loads it, cling reloads its libraries.
+      // SYCL sessions are not saved, as their device code would be missing.
+      if (Opts.CompilerOpts.SYCL) {
+        cling::errs() << "ERROR: --restore cannot be used with -fsycl, "
+                         "ignoring.\n";
+      } else {
+        Opts.RestorePath = RestoreArg->getValue();
+        Opts.CompilerOpts.Remaining.push_back("-include-pch");
+        Opts.CompilerOpts.Remaining.push_back(RestoreArg->getValue());
+      }
+    }
+    if (Arg* JITCacheSizeArg = Args.getLastArg(OPT__jit_cache_size_EQ)) {
+      unsigned MiB;
+      if (StringRef(JITCacheSizeArg->getValue()).getAsInteger(10, MiB))
+        cling::errs() << "ERROR: invalid JIT cache size '"
+                      << JITCacheSizeArg->getValue() << "', ignoring.\n";
+      else
+        Opts.JITCacheLimit = uint64_t(MiB) << 20;
+    }
     if (Arg* MetaStringArg = Args.getLastArg(OPT__metastr, OPT__metastr_EQ)) {
       Opts.MetaString = MetaStringArg->getValue();
       if (Opts.MetaString.empty()) {
@@ -100,7 +135,8 @@ static const char kNoStdInc[] = "-nostdinc";
 CompilerOptions::CompilerOptions(int argc, const char* const* argv)
     : Language(false), ResourceDir(false), SysRoot(false), NoBuiltinInc(false),
       NoCXXInc(false), StdVersion(false), StdLib(false), HasOutput(false),
-      Verbose(false), CxxModules(false), CUDAHost(false), CUDADevice(false), SYCL(false) {
+      Verbose(false), CxxModules(false), CUDAHost(false), CUDADevice(false),
+      SYCL(false), SYCLAsync(false) {
   if (argc && argv) {
     // Preserve what's already in Remaining, the user might want to push args
     // to clang while still using main's argc, argv
@@ -179,8 +215,9 @@ bool CompilerOptions::DefaultLanguage(const LangOptions* LangOpts) const {
 }
 
 InvocationOptions::InvocationOptions(int argc, const char* const* argv) :
-  MetaString("."), ErrorOut(false), NoLogo(false), ShowVersion(false),
-  Help(false), NoRuntime(false) {
+  MetaString("."), JITCacheLimit(uint64_t(256) << 20), ParallelJIT(0),
+  ErrorOut(false), NoLogo(false), ShowVersion(false), Help(false),
+  NoRuntime(false), TieredJIT(false), JITProfile(false), LazyJIT(false) {
 
   ArrayRef<const char *> ArgStrings(argv, argv + argc);
   unsigned MissingArgIndex, MissingArgCount;
@@ -198,6 +235,11 @@ InvocationOptions::InvocationOptions(int argc, const char* const* argv) :
           CompilerOpts.SYCL = 1;
           break;
         }
+        if (arg->getOption().getID() == OPT_fsycl_async) {
+          CompilerOpts.SYCL = 1;
+          CompilerOpts.SYCLAsync = 1;
+          break;
+        }
         // pass -v to clang as well
         if (arg->getOption().getID() != OPT_v)
           break;
@@ -0,0 +1,265 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "JITMemoryManager.h"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace llvm;
+
+namespace {
+  ///\brief Pages are mapped by at least SlabSize bytes, and handed out by at
+  /// least MinRunSize bytes.
+  const size_t SlabSize = 1 << 20;
+  const size_t MinRunSize = 64 << 10;
+
+  size_t pageSize() {
+    static const size_t Size = sys::Process::getPageSize();
+    return Size;
+  }
+
+  uintptr_t alignUp(uintptr_t Value, uintptr_t Alignment) {
+    return (Value + Alignment - 1) & ~(Alignment - 1);
+  }
+} // unnamed namespace
+
+namespace cling {
+
+double JITMemoryStats::fragmentation() const {
+  size_t InUse = bytesMapped - bytesFree;
+  if (!InUse)
+    return 0.;
+  return double(InUse - std::min(bytesLive, InUse)) / InUse;
+}
+
+void JITMemoryStats::print(raw_ostream& OS, bool JSON) const {
+  if (JSON) {
+    OS << "{\"bytes_mapped\": " << bytesMapped
+       << ", \"mappings\": " << mappings
+       << ", \"bytes_free\": " << bytesFree
+       << ", \"bytes_live\": " << bytesLive
+       << ", \"sections_live\": " << sectionsLive
+       << ", \"bytes_released\": " << bytesReleased
+       << ", \"allocations\": " << allocations
+       << ", \"protections\": " << protections
+       << ", \"fragmentation\": " << format("%.4f", fragmentation())
+       << "}\n";
+    return;
+  }
+  OS << "JIT memory:\n"
+     << "  mapped:         " << bytesMapped << " bytes in " << mappings
+     << " slabs\n"
+     << "  free:           " << bytesFree << " bytes\n"
+     << "  live:           " << bytesLive << " bytes in " << sectionsLive
+     << " sections\n"
+     << "  released:       " << bytesReleased << " bytes\n"
+     << "  allocations:    " << allocations << "\n"
+     << "  protections:    " << protections << "\n"
+     << "  fragmentation:  " << format("%.1f%%", 100 * fragmentation())
+     << "\n";
+}
+
+JITMemoryPool::~JITMemoryPool() {
+  for (auto& Slab : m_Slabs)
+    sys::Memory::releaseMappedMemory(Slab);
+}
+
+void JITMemoryPool::addFree(uint8_t* Start, size_t Size) {
+  if (!Size)
+    return;
+  m_Stats.bytesFree += Size;
+  auto Next = m_Free.lower_bound(Start);
+  if (Next != m_Free.end() && Start + Size == Next->first) {
+    Size += Next->second;
+    Next = m_Free.erase(Next);
+  }
+  if (Next != m_Free.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->first + Prev->second == Start) {
+      Prev->second += Size;
+      return;
+    }
+  }
+  m_Free.emplace_hint(Next, Start, Size);
+}
+
+bool JITMemoryPool::protect(uint8_t* Start, size_t Size, unsigned Flags) {
+  ++m_Stats.protections;
+  if (std::error_code EC = sys::Memory::protectMappedMemory(
+          sys::MemoryBlock(Start, Size), Flags)) {
+    errs() << "JITMemoryPool: cannot protect JIT memory: " << EC.message()
+           << "\n";
+    return false;
+  }
+  return true;
+}
+
+JITMemoryPool::Run* JITMemoryPool::takeRun(Kind K, size_t Size) {
+  Size = alignUp(std::max(Size, MinRunSize), pageSize());
+
+  uint8_t* Start = nullptr;
+  for (auto I = m_Free.begin(), E = m_Free.end(); I != E; ++I) {
+    if (I->second < Size)
+      continue;
+    Start = I->first;
+    size_t Rest = I->second - Size;
+    auto Hint = m_Free.erase(I);
+    if (Rest)
+      m_Free.emplace_hint(Hint, Start + Size, Rest);
+    m_Stats.bytesFree -= Size;
+    break;
+  }
+
+  if (!Start) {
+    // Map the slabs next to each other, so that the code stays within reach
+    // of 32-bit relocations.
+    const sys::MemoryBlock* Near = m_Slabs.empty() ? nullptr : &m_Slabs.back();
+    std::error_code EC;
+    sys::MemoryBlock Slab = sys::Memory::allocateMappedMemory(
+        std::max(Size, SlabSize), Near,
+        sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+    if (EC) {
+      errs() << "JITMemoryPool: cannot map JIT memory: " << EC.message()
+             << "\n";
+      return nullptr;
+    }
+    m_Slabs.push_back(Slab);
+    m_Stats.bytesMapped += Slab.size();
+    ++m_Stats.mappings;
+    Start = static_cast<uint8_t*>(Slab.base());
+    addFree(Start + Size, Slab.size() - Size);
+  }
+
+  std::unique_ptr<Run>& R = m_Runs[Start];
+  R.reset(new Run{Start, Size, Start, K, 0, true});
+  return R.get();
+}
+
+void JITMemoryPool::closeRun(Run* R) {
+  R->Open = false;
+  uint8_t* Used = reinterpret_cast<uint8_t*>(
+      alignUp(reinterpret_cast<uintptr_t>(R->Next), pageSize()));
+  addFree(Used, R->Start + R->Size - Used);
+  R->Size = Used - R->Start;
+
+  if (!R->Sections) {
+    // Everything in it was removed before it was finalized.
+    addFree(R->Start, R->Size);
+    m_Runs.erase(R->Start);
+    return;
+  }
+
+  switch (R->K) {
+  case kCode:
+    protect(R->Start, R->Size, sys::Memory::MF_READ | sys::Memory::MF_EXEC);
+    sys::Memory::InvalidateInstructionCache(R->Start, R->Size);
+    break;
+  case kROData:
+    protect(R->Start, R->Size, sys::Memory::MF_READ);
+    break;
+  default:
+    break;
+  }
+}
+
+void JITMemoryPool::releaseRun(Run* R) {
+  // Pages that cannot be made writable again are not reused.
+  if (R->K == kRWData ||
+      protect(R->Start, R->Size,
+              sys::Memory::MF_READ | sys::Memory::MF_WRITE)) {
+    m_Stats.bytesReleased += R->Size;
+    addFree(R->Start, R->Size);
+  }
+  m_Runs.erase(R->Start);
+}
+
+void JITMemoryPool::releaseSection(Run* R, size_t Size) {
+  m_Stats.bytesLive -= Size;
+  --m_Stats.sectionsLive;
+  if (!--R->Sections && !R->Open)
+    releaseRun(R);
+}
+
+JITMemoryManager::Sections::~Sections() {
+  for (auto& S : m_Sections)
+    m_Pool->releaseSection(S.first, S.second);
+}
+
+JITMemoryManager::JITMemoryManager(std::shared_ptr<JITMemoryPool> Pool):
+  m_Pool(std::move(Pool)) {}
+
+JITMemoryManager::~JITMemoryManager() {
+  for (JITMemoryPool::Run* R : m_Pending)
+    m_Pool->closeRun(R);
+}
+
+uint8_t* JITMemoryManager::allocate(JITMemoryPool::Kind K, uintptr_t Size,
+                                    unsigned Alignment, Sections& Owner) {
+  if (!Alignment)
+    Alignment = 16;
+  assert(!(Alignment & (Alignment - 1)) && "Alignment must be a power of two.");
+
+  JITMemoryPool::Run*& R = m_Open[K];
+  if (!R || alignUp(uintptr_t(R->Next), Alignment) + Size
+                > uintptr_t(R->Start + R->Size)) {
+    // A full run stays pending: code and read-only data can only be
+    // protected once the objects using them are finalized.
+    R = m_Pool->takeRun(K, Size + Alignment);
+    if (!R)
+      return nullptr;
+    m_Pending.push_back(R);
+  }
+
+  uint8_t* Addr = reinterpret_cast<uint8_t*>(
+      alignUp(reinterpret_cast<uintptr_t>(R->Next), Alignment));
+  R->Next = Addr + Size;
+  m_Pool->addSection(R, Size);
+  Owner.m_Pool = m_Pool;
+  Owner.m_Sections.emplace_back(R, Size);
+  return Addr;
+}
+
+uint8_t* JITMemoryManager::allocateCodeSection(uintptr_t Size,
+                                               unsigned Alignment,
+                                               unsigned SectionID,
+                                               StringRef SectionName) {
+  return allocate(JITMemoryPool::kCode, Size, Alignment, m_Unowned);
+}
+
+uint8_t* JITMemoryManager::allocateDataSection(uintptr_t Size,
+                                               unsigned Alignment,
+                                               unsigned SectionID,
+                                               StringRef SectionName,
+                                               bool IsReadOnly) {
+  return allocate(IsReadOnly ? JITMemoryPool::kROData
+                             : JITMemoryPool::kRWData,
+                  Size, Alignment, m_Unowned);
+}
+
+bool JITMemoryManager::finalizeMemory(std::string* ErrMsg) {
+  // Writable data needs no protection: its run stays open for the next
+  // objects.
+  std::vector<JITMemoryPool::Run*> Pending;
+  Pending.swap(m_Pending);
+  for (JITMemoryPool::Run* R : Pending) {
+    if (R == m_Open[JITMemoryPool::kRWData])
+      m_Pending.push_back(R);
+    else
+      m_Pool->closeRun(R);
+  }
+  m_Open[JITMemoryPool::kCode] = nullptr;
+  m_Open[JITMemoryPool::kROData] = nullptr;
+  return false;
+}
+
+} // end namespace cling
@@ -0,0 +1,157 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_JIT_MEMORY_MANAGER_H
+#define CLING_JIT_MEMORY_MANAGER_H
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/Memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class raw_ostream;
+}
+
+namespace cling {
+
+///\brief Memory usage of the JIT's sections, see `.stats jitmem`.
+struct JITMemoryStats {
+  ///\brief Bytes mapped from the system, and the number of mappings.
+  size_t bytesMapped = 0;
+  size_t mappings = 0;
+  ///\brief Bytes of the mapped pages that are free for new sections.
+  size_t bytesFree = 0;
+  ///\brief Bytes of the sections of the objects that are loaded, and their
+  /// number.
+  size_t bytesLive = 0;
+  size_t sectionsLive = 0;
+  ///\brief Bytes of pages given back once all their sections were removed.
+  size_t bytesReleased = 0;
+  ///\brief Number of sections allocated, and of protection changes.
+  size_t allocations = 0;
+  size_t protections = 0;
+
+  ///\brief Share of the pages in use that holds no live section.
+  double fragmentation() const;
+  void print(llvm::raw_ostream& OS, bool JSON) const;
+};
+
+///\brief The pages of an IncrementalJIT's sections. Pages are mapped in
+/// slabs and handed out in runs of whole pages; the sections of the objects
+/// loaded between two finalizations share their runs. A run returns to the
+/// pool once all its objects were removed; unused pages are reused before
+/// new slabs are mapped.
+class JITMemoryPool {
+public:
+  enum Kind { kCode, kROData, kRWData, kNumKinds };
+
+  ///\brief Consecutive pages holding the sections of one kind.
+  struct Run {
+    uint8_t* Start;
+    size_t Size;
+    ///\brief Where the next section goes.
+    uint8_t* Next;
+    Kind K;
+    ///\brief Number of live sections in the run.
+    unsigned Sections;
+    ///\brief Whether sections are still being added to the run.
+    bool Open;
+  };
+
+private:
+  std::vector<llvm::sys::MemoryBlock> m_Slabs;
+  ///\brief Free pages, by address, with their size.
+  std::map<uint8_t*, size_t> m_Free;
+  ///\brief The runs handed out, by address.
+  std::map<uint8_t*, std::unique_ptr<Run>> m_Runs;
+  JITMemoryStats m_Stats;
+
+  void addFree(uint8_t* Start, size_t Size);
+  bool protect(uint8_t* Start, size_t Size, unsigned Flags);
+  ///\brief Give the pages of a closed run back to the pool.
+  void releaseRun(Run* R);
+
+public:
+  ~JITMemoryPool();
+
+  ///\brief Get a run of at least Size bytes, in read/write pages.
+  Run* takeRun(Kind K, size_t Size);
+
+  ///\brief No more sections go into R: give its unused pages back and
+  /// apply the final protection of its kind to the others.
+  void closeRun(Run* R);
+
+  ///\brief A section of R was removed.
+  void releaseSection(Run* R, size_t Size);
+
+  ///\brief A section of Size bytes was added to R.
+  void addSection(Run* R, size_t Size) {
+    ++R->Sections;
+    m_Stats.bytesLive += Size;
+    ++m_Stats.sectionsLive;
+    ++m_Stats.allocations;
+  }
+
+  const JITMemoryStats& getStats() const { return m_Stats; }
+};
+
+///\brief Memory manager of an IncrementalJIT, allocating from a
+/// JITMemoryPool. Each nesting level of JITting has its own manager, which
+/// finalizes only the runs it opened.
+class JITMemoryManager : public llvm::RTDyldMemoryManager {
+public:
+  ///\brief The sections of one object, released when it is removed.
+  class Sections {
+    friend class JITMemoryManager;
+    std::shared_ptr<JITMemoryPool> m_Pool;
+    std::vector<std::pair<JITMemoryPool::Run*, size_t>> m_Sections;
+  public:
+    Sections() = default;
+    Sections(const Sections&) = delete;
+    Sections& operator=(const Sections&) = delete;
+    ~Sections();
+  };
+
+private:
+  std::shared_ptr<JITMemoryPool> m_Pool;
+  JITMemoryPool::Run* m_Open[JITMemoryPool::kNumKinds] = {};
+  ///\brief Runs opened since the last finalization.
+  std::vector<JITMemoryPool::Run*> m_Pending;
+  ///\brief Owner of the sections allocated through the RTDyldMemoryManager
+  /// interface, which are kept until the manager is destroyed.
+  Sections m_Unowned;
+
+public:
+  JITMemoryManager(std::shared_ptr<JITMemoryPool> Pool);
+  ~JITMemoryManager();
+
+  ///\brief Allocate a section on behalf of an object.
+  uint8_t* allocate(JITMemoryPool::Kind K, uintptr_t Size, unsigned Alignment,
+                    Sections& Owner);
+
+  uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               llvm::StringRef SectionName) override;
+  uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, llvm::StringRef SectionName,
+                               bool IsReadOnly) override;
+
+  ///\brief Make the code and read-only data allocated since the last call
+  /// executable and read-only.
+  bool finalizeMemory(std::string* ErrMsg = nullptr) override;
+};
+
+} // end namespace cling
+
+#endif // CLING_JIT_MEMORY_MANAGER_H
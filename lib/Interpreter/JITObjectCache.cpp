@@ -0,0 +1,238 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "JITObjectCache.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+  sys::TimePoint<> now() {
+    return std::chrono::time_point_cast<sys::TimePoint<>::duration>(
+        std::chrono::system_clock::now());
+  }
+} // unnamed namespace
+
+namespace cling {
+
+JITObjectCache::JITObjectCache(StringRef Dir, uint64_t Limit,
+                               const TargetMachine& TM):
+  m_Dir(Dir), m_Limit(Limit), m_Enabled(true), m_Size(0),
+  m_LastModule(nullptr) {
+  raw_string_ostream Key(m_TargetKey);
+  Key << LLVM_VERSION_STRING << '\0' << TM.getTargetTriple().str() << '\0'
+      << TM.getTargetCPU() << '\0' << TM.getTargetFeatureString() << '\0'
+      << unsigned(TM.getOptLevel()) << '\0'
+      << unsigned(TM.getRelocationModel()) << '\0'
+      << unsigned(TM.getCodeModel());
+  Key.flush();
+
+  if (std::error_code EC = sys::fs::create_directories(m_Dir)) {
+    errs() << "JITObjectCache: cannot create " << m_Dir << ": "
+           << EC.message() << "\n";
+    m_Enabled = false;
+    return;
+  }
+
+  std::error_code EC;
+  for (sys::fs::directory_iterator I(m_Dir, EC), E; I != E && !EC;
+       I.increment(EC)) {
+    StringRef Path = I->path();
+    sys::fs::file_status Status;
+    if (sys::path::extension(Path) != ".o" || sys::fs::status(Path, Status))
+      continue;
+    m_Entries[sys::path::stem(Path)] = Entry{Status.getSize(),
+                                             Status.getLastModificationTime()};
+    m_Size += Status.getSize();
+  }
+  if (m_Size > m_Limit)
+    evict();
+}
+
+std::string JITObjectCache::getKey(const Module& M) {
+  auto Start = std::chrono::steady_clock::now();
+  SmallString<0> Bitcode;
+  {
+    // The source file name is the session's name of the transaction, which
+    // does not make it into the object.
+    Module& Mutable = const_cast<Module&>(M);
+    std::string SourceFileName = M.getSourceFileName();
+    Mutable.setSourceFileName("");
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(&M, OS);
+    Mutable.setSourceFileName(SourceFileName);
+  }
+  SHA1 Hasher;
+  Hasher.update(m_TargetKey);
+  Hasher.update(ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t*>(Bitcode.data()), Bitcode.size()));
+  std::string Key = toHex(Hasher.result());
+  m_Stats.hashSeconds += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - Start).count();
+  return Key;
+}
+
+std::string JITObjectCache::getPath(StringRef Key) const {
+  SmallString<256> Path(m_Dir);
+  sys::path::append(Path, Key + ".o");
+  return Path.str();
+}
+
+std::unique_ptr<MemoryBuffer> JITObjectCache::getObject(const Module* M) {
+  if (!m_Enabled)
+    return nullptr;
+  m_LastModule = M;
+  m_LastKey = getKey(*M);
+
+  // The entry might have been stored by another session since this one
+  // started: always ask the file system.
+  std::string Path = getPath(m_LastKey);
+  auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+  auto I = m_Entries.find(m_LastKey);
+  if (!Buffer) {
+    if (I != m_Entries.end()) {
+      m_Size -= I->second.Size;
+      m_Entries.erase(I);
+    }
+    ++m_Stats.misses;
+    return nullptr;
+  }
+
+  uint64_t Size = (*Buffer)->getBufferSize();
+  if (I == m_Entries.end()) {
+    I = m_Entries.emplace(m_LastKey, Entry{Size, now()}).first;
+    m_Size += Size;
+  }
+  I->second.LastUse = now();
+  // The modification time is the last use for the sessions to come.
+  int FD;
+  if (!sys::fs::openFileForWrite(Path, FD, sys::fs::F_Append)) {
+    sys::fs::setLastModificationAndAccessTime(FD, I->second.LastUse);
+    sys::Process::SafelyCloseFileDescriptor(FD);
+  }
+  ++m_Stats.hits;
+  m_Stats.bytesLoaded += Size;
+  m_LastModule = nullptr;
+  return std::move(*Buffer);
+}
+
+void JITObjectCache::notifyObjectCompiled(const Module* M,
+                                          MemoryBufferRef Obj) {
+  // SimpleCompiler looks a module up before compiling it.
+  if (!m_Enabled || M != m_LastModule)
+    return;
+  m_LastModule = nullptr;
+
+  // Write to a file of our own, then rename it, so that no session reads a
+  // partial object.
+  std::string Path = getPath(m_LastKey);
+  SmallString<256> TmpPath;
+  int FD;
+  if (sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TmpPath)) {
+    ++m_Stats.failures;
+    return;
+  }
+  {
+    raw_fd_ostream OS(FD, true /*shouldClose*/);
+    OS << Obj.getBuffer();
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TmpPath);
+      ++m_Stats.failures;
+      return;
+    }
+  }
+  if (sys::fs::rename(TmpPath, Path)) {
+    sys::fs::remove(TmpPath);
+    ++m_Stats.failures;
+    return;
+  }
+
+  uint64_t Size = Obj.getBufferSize();
+  ++m_Stats.stores;
+  m_Stats.bytesStored += Size;
+  auto I = m_Entries.find(m_LastKey);
+  if (I != m_Entries.end())
+    m_Size -= I->second.Size;
+  m_Entries[m_LastKey] = Entry{Size, now()};
+  m_Size += Size;
+  if (m_Size > m_Limit)
+    evict();
+}
+
+void JITObjectCache::evict() {
+  // Go down to 90% of the limit, so that not every store evicts.
+  uint64_t Target = m_Limit / 10 * 9;
+  typedef std::map<std::string, Entry>::iterator EntryIt;
+  std::vector<EntryIt> ByUse;
+  for (EntryIt I = m_Entries.begin(), E = m_Entries.end(); I != E; ++I)
+    ByUse.push_back(I);
+  std::sort(ByUse.begin(), ByUse.end(), [](EntryIt A, EntryIt B) {
+    return A->second.LastUse < B->second.LastUse;
+  });
+  for (EntryIt I : ByUse) {
+    if (m_Size <= Target)
+      break;
+    sys::fs::remove(getPath(I->first));
+    m_Size -= I->second.Size;
+    m_Entries.erase(I);
+    ++m_Stats.evictions;
+  }
+}
+
+void JITObjectCache::printStats(raw_ostream& OS, bool JSON) const {
+  unsigned Lookups = m_Stats.hits + m_Stats.misses;
+  double HitRate = Lookups ? double(m_Stats.hits) / Lookups : 0.;
+  if (JSON) {
+    OS << "{\"enabled\": " << (m_Enabled ? "true" : "false")
+       << ", \"hits\": " << m_Stats.hits
+       << ", \"misses\": " << m_Stats.misses
+       << ", \"hit_rate\": " << HitRate
+       << ", \"stores\": " << m_Stats.stores
+       << ", \"store_failures\": " << m_Stats.failures
+       << ", \"evictions\": " << m_Stats.evictions
+       << ", \"bytes_loaded\": " << m_Stats.bytesLoaded
+       << ", \"bytes_stored\": " << m_Stats.bytesStored
+       << ", \"entries\": " << m_Entries.size()
+       << ", \"bytes\": " << m_Size
+       << ", \"limit\": " << m_Limit
+       << ", \"hash_seconds\": " << m_Stats.hashSeconds << "}\n";
+    return;
+  }
+  OS << "JIT object cache " << m_Dir
+     << (m_Enabled ? ":\n" : " (disabled):\n")
+     << "  hits:           " << m_Stats.hits << " of " << Lookups << " ("
+     << unsigned(HitRate * 100) << "%), " << m_Stats.bytesLoaded
+     << " bytes loaded\n"
+     << "  stores:         " << m_Stats.stores << ", " << m_Stats.bytesStored
+     << " bytes (" << m_Stats.failures << " failed)\n"
+     << "  evictions:      " << m_Stats.evictions << "\n"
+     << "  size:           " << m_Size << " of " << m_Limit << " bytes in "
+     << m_Entries.size() << " objects\n"
+     << "  hashing:        " << m_Stats.hashSeconds << " s\n";
+}
+
+} // end namespace cling
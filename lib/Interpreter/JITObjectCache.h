@@ -0,0 +1,96 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_JIT_OBJECT_CACHE_H
+#define CLING_JIT_OBJECT_CACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/Support/Chrono.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace llvm {
+class MemoryBuffer;
+class MemoryBufferRef;
+class Module;
+class TargetMachine;
+class raw_ostream;
+}
+
+namespace cling {
+
+///\brief On-disk cache of the objects compiled by an IncrementalJIT
+/// (cling --jit-cache=<dir>), so that sessions running the same code, e.g.
+/// including the same headers at startup, load objects instead of compiling
+/// them again.
+///
+/// An object is keyed on the SHA1 of the optimized module's bitcode, the
+/// target triple, CPU, features and codegen optimization level; it is stored
+/// as <dir>/<key>.o. Entries are written atomically, so sessions can share a
+/// directory. Once the cache grows beyond its limit, the least recently used
+/// entries are removed.
+class JITObjectCache: public llvm::ObjectCache {
+  struct Entry {
+    uint64_t Size;
+    llvm::sys::TimePoint<> LastUse;
+  };
+
+  std::string m_Dir;
+  uint64_t m_Limit;
+  ///\brief Identifies the TargetMachine compiling the objects.
+  std::string m_TargetKey;
+  bool m_Enabled;
+
+  ///\brief The entries of the directory, by key, and their total size.
+  std::map<std::string, Entry> m_Entries;
+  uint64_t m_Size;
+
+  ///\brief The key of the last module looked up, which is the one being
+  /// compiled when notifyObjectCompiled() is called.
+  const llvm::Module* m_LastModule;
+  std::string m_LastKey;
+
+  struct Stats {
+    unsigned hits = 0;
+    unsigned misses = 0;
+    unsigned stores = 0;
+    unsigned failures = 0;
+    unsigned evictions = 0;
+    uint64_t bytesLoaded = 0;
+    uint64_t bytesStored = 0;
+    double hashSeconds = 0.;
+  } m_Stats;
+
+  std::string getKey(const llvm::Module& M);
+  std::string getPath(llvm::StringRef Key) const;
+  void evict();
+
+public:
+  ///\param [in] Dir - The cache directory, created if needed.
+  ///\param [in] Limit - Size of the cache, in bytes, beyond which entries are
+  ///   evicted.
+  ///\param [in] TM - The TargetMachine compiling the objects.
+  JITObjectCache(llvm::StringRef Dir, uint64_t Limit,
+                 const llvm::TargetMachine& TM);
+
+  void notifyObjectCompiled(const llvm::Module* M,
+                            llvm::MemoryBufferRef Obj) override;
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module* M) override;
+
+  ///\brief Print the cache's hit rate and size (`.stats jitcache`).
+  void printStats(llvm::raw_ostream& OS, bool JSON) const;
+};
+
+} // end namespace cling
+
+#endif // CLING_JIT_OBJECT_CACHE_H
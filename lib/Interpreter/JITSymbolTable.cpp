@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "JITSymbolTable.h"
+
+#include "llvm/ADT/Hashing.h"
+
+#include <cstring>
+#include <new>
+
+using namespace llvm;
+
+namespace cling {
+
+JITSymbolTable::JITSymbolTable(): m_Buckets(1024), m_NumSymbols(0) {}
+
+uint32_t JITSymbolTable::hash(StringRef Name) {
+  return uint32_t(hash_value(Name));
+}
+
+JITSymbolTable::Symbol* const*
+JITSymbolTable::findBucket(StringRef Name, uint32_t Hash) const {
+  size_t Mask = m_Buckets.size() - 1;
+  for (size_t I = Hash & Mask; ; I = (I + 1) & Mask) {
+    Symbol* const* Bucket = &m_Buckets[I];
+    const Symbol* S = *Bucket;
+    if (!S || (S->Hash == Hash && S->name() == Name))
+      return Bucket;
+  }
+}
+
+void JITSymbolTable::grow() {
+  std::vector<Symbol*> Old(m_Buckets.size() * 2);
+  Old.swap(m_Buckets);
+  size_t Mask = m_Buckets.size() - 1;
+  for (Symbol* S : Old) {
+    if (!S)
+      continue;
+    size_t I = S->Hash & Mask;
+    while (m_Buckets[I])
+      I = (I + 1) & Mask;
+    m_Buckets[I] = S;
+  }
+}
+
+JITSymbolTable::Symbol* JITSymbolTable::intern(StringRef Name) {
+  uint32_t Hash = hash(Name);
+  Symbol* const* Bucket = findBucket(Name, Hash);
+  if (*Bucket)
+    return *Bucket;
+
+  // Keep the table at most three quarters full.
+  if (4 * (m_NumSymbols + 1) > 3 * m_Buckets.size()) {
+    grow();
+    Bucket = findBucket(Name, Hash);
+  }
+  void* Mem = m_Pool.Allocate(sizeof(Symbol) + Name.size() + 1,
+                              alignof(Symbol));
+  Symbol* S = new (Mem) Symbol{0, Hash, uint32_t(Name.size())};
+  char* Str = reinterpret_cast<char*>(S + 1);
+  std::memcpy(Str, Name.data(), Name.size());
+  Str[Name.size()] = 0;
+  ++m_NumSymbols;
+  return *const_cast<Symbol**>(Bucket) = S;
+}
+
+} // end namespace cling
@@ -0,0 +1,76 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_JIT_SYMBOL_TABLE_H
+#define CLING_JIT_SYMBOL_TABLE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/Support/Allocator.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace cling {
+
+///\brief The addresses of the symbols known to an IncrementalJIT, by
+/// interned name.
+///
+/// Each distinct name is stored once, in a pool, together with its address,
+/// and never freed: a Symbol pointer stays valid and identifies its name, so
+/// that maps keyed on names can be keyed on pointers instead. Names are
+/// found through an open-addressing hash table of Symbol pointers; looking a
+/// name up does not allocate.
+class JITSymbolTable {
+public:
+  struct Symbol {
+    ///\brief Address of the symbol's definition, 0 if there is none.
+    llvm::JITTargetAddress Address;
+    uint32_t Hash;
+    uint32_t Length;
+
+    ///\brief The name, which is also NUL-terminated.
+    llvm::StringRef name() const {
+      return llvm::StringRef(reinterpret_cast<const char*>(this + 1), Length);
+    }
+  };
+
+private:
+  llvm::BumpPtrAllocator m_Pool;
+  ///\brief Power-of-two sized, null for empty buckets.
+  std::vector<Symbol*> m_Buckets;
+  size_t m_NumSymbols;
+
+  static uint32_t hash(llvm::StringRef Name);
+  ///\brief The bucket holding Name, or the empty one where it would go.
+  Symbol* const* findBucket(llvm::StringRef Name, uint32_t Hash) const;
+  void grow();
+
+public:
+  JITSymbolTable();
+
+  ///\brief The symbol of this name, or null if the name was never interned.
+  Symbol* find(llvm::StringRef Name) const {
+    return *findBucket(Name, hash(Name));
+  }
+
+  ///\brief The symbol of this name, added without address if needed.
+  Symbol* intern(llvm::StringRef Name);
+
+  ///\brief The address of a symbol, 0 if it is not defined.
+  llvm::JITTargetAddress lookup(llvm::StringRef Name) const {
+    const Symbol* S = find(Name);
+    return S ? S->Address : 0;
+  }
+
+  size_t size() const { return m_NumSymbols; }
+};
+
+} // end namespace cling
+
+#endif // CLING_JIT_SYMBOL_TABLE_H
@@ -0,0 +1,409 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "ParallelBackend.h"
+
+#include "BackendPasses.h"
+
+#include "clang/Frontend/CodeGenOptions.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace llvm;
+
+namespace {
+  ///\brief Modules of fewer instructions are compiled as a whole: splitting
+  /// them costs more than it saves.
+  const uint64_t MinInstructions = 2000;
+
+  ///\brief Functions of at most this many instructions are copied into the
+  /// partitions that refer to them, for inlining.
+  const unsigned CopyLimit = 64;
+
+  const unsigned NoPartition = ~0U;
+
+  ///\brief The global values of M, in the order the partitions refer to
+  /// them by. Writing and reading bitcode keeps this order.
+  void enumerate(const Module& M, std::vector<const GlobalValue*>& GVs) {
+    for (const Function& F : M)
+      GVs.push_back(&F);
+    for (const GlobalVariable& GV : M.globals())
+      GVs.push_back(&GV);
+    for (const GlobalAlias& GA : M.aliases())
+      GVs.push_back(&GA);
+  }
+
+  ///\brief The static initializers are run by name, from the transaction's
+  /// module; the partitions do not need them.
+  bool isDropped(const GlobalValue& GV) {
+    return GV.getName() == "llvm.global_ctors" ||
+           GV.getName() == "llvm.global_dtors";
+  }
+
+  ///\brief Collect the global values a constant refers to, and the
+  /// functions whose blocks it takes the address of.
+  void collectRefs(const Constant* C, SmallPtrSetImpl<const Constant*>& Seen,
+                   SmallVectorImpl<const GlobalValue*>& Refs,
+                   SmallVectorImpl<const Function*>& Blocks) {
+    if (auto* GV = dyn_cast<GlobalValue>(C)) {
+      Refs.push_back(GV);
+      return;
+    }
+    if (auto* BA = dyn_cast<BlockAddress>(C)) {
+      Blocks.push_back(BA->getFunction());
+      return;
+    }
+    if (!Seen.insert(C).second)
+      return;
+    for (const Use& Op : C->operands())
+      collectRefs(cast<Constant>(Op), Seen, Refs, Blocks);
+  }
+
+  struct Node {
+    ///\brief Indices of the definitions this one refers to.
+    SmallVector<unsigned, 8> Refs;
+    ///\brief Indices of the definitions that must be in the same partition.
+    SmallVector<unsigned, 2> Joined;
+    uint64_t Cost = 0;
+    bool Defined = false;
+    ///\brief A local constant, copied into each partition that uses it.
+    bool Duplicable = false;
+    ///\brief May be copied as available_externally.
+    bool Copyable = false;
+    unsigned Part = NoPartition;
+  };
+
+  unsigned findLeader(std::vector<unsigned>& Leaders, unsigned I) {
+    while (Leaders[I] != I)
+      I = Leaders[I] = Leaders[Leaders[I]];
+    return I;
+  }
+
+  void join(std::vector<unsigned>& Leaders, unsigned A, unsigned B) {
+    A = findLeader(Leaders, A);
+    B = findLeader(Leaders, B);
+    // The lower index leads, so that the groups do not depend on the order
+    // of the joins.
+    if (A != B)
+      Leaders[std::max(A, B)] = std::min(A, B);
+  }
+} // unnamed namespace
+
+namespace cling {
+
+ParallelBackend::ParallelBackend(
+    std::vector<std::unique_ptr<llvm::TargetMachine>> TMs,
+    const clang::CodeGenOptions& CGOpts, const clang::TargetOptions& TOpts,
+    const clang::LangOptions& LOpts)
+    : m_TMs(std::move(TMs)), m_CGOpts(CGOpts), m_TOpts(TOpts), m_LOpts(LOpts),
+      m_Pool(m_TMs.size()) {}
+
+// Keep in source: ~unique_ptr<TargetMachine> needs TargetMachine
+ParallelBackend::~ParallelBackend() {}
+
+bool ParallelBackend::partition(const Module& M,
+                                std::vector<Partition>& Parts) const {
+  // Where an ifunc resolves to is only known at run time.
+  if (!M.ifunc_empty())
+    return false;
+  std::vector<const GlobalValue*> GVs;
+  enumerate(M, GVs);
+  DenseMap<const GlobalValue*, unsigned> Index;
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I)
+    Index[GVs[I]] = I;
+
+  std::vector<Node> Nodes(GVs.size());
+  uint64_t Instructions = 0;
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I) {
+    const GlobalValue& GV = *GVs[I];
+    Node& N = Nodes[I];
+    if (GV.isDeclaration() || isDropped(GV))
+      continue;
+    N.Defined = true;
+
+    SmallPtrSet<const Constant*, 32> Seen;
+    SmallVector<const GlobalValue*, 8> Refs;
+    SmallVector<const Function*, 2> Blocks;
+    if (auto* F = dyn_cast<Function>(&GV)) {
+      for (const Use& Op : F->operands())
+        collectRefs(cast<Constant>(Op), Seen, Refs, Blocks);
+      for (const BasicBlock& BB : *F) {
+        N.Cost += BB.size();
+        for (const Instruction& Inst : BB)
+          for (const Use& Op : Inst.operands())
+            if (auto* C = dyn_cast<Constant>(Op))
+              collectRefs(C, Seen, Refs, Blocks);
+      }
+      Instructions += N.Cost;
+    } else if (auto* Var = dyn_cast<GlobalVariable>(&GV)) {
+      N.Cost = 1;
+      collectRefs(Var->getInitializer(), Seen, Refs, Blocks);
+    } else
+      collectRefs(cast<GlobalAlias>(GV).getAliasee(), Seen, Refs, Blocks);
+
+    for (const GlobalValue* Ref : Refs)
+      if (Ref != &GV)
+        N.Refs.push_back(Index[Ref]);
+    // Taking the address of a block needs its function at hand.
+    for (const Function* F : Blocks)
+      if (F != &GV)
+        N.Joined.push_back(Index[F]);
+  }
+  if (Instructions < MinInstructions)
+    return false;
+
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I) {
+    Node& N = Nodes[I];
+    auto* Var = dyn_cast<GlobalVariable>(GVs[I]);
+    N.Duplicable = N.Defined && Var && Var->hasLocalLinkage() &&
+                   Var->isConstant() && Var->hasGlobalUnnamedAddr() &&
+                   !Var->isThreadLocal() && N.Refs.empty() &&
+                   N.Joined.empty();
+  }
+
+  // A definition can be copied if it refers to nothing that is local to
+  // another partition, and if its copy may replace it.
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I) {
+    const GlobalValue& GV = *GVs[I];
+    Node& N = Nodes[I];
+    if (!N.Defined || N.Duplicable || GV.hasLocalLinkage() ||
+        GV.isInterposable() || !N.Joined.empty() ||
+        GV.getName().startswith("llvm."))
+      continue;
+    bool RefersToLocal = false;
+    for (unsigned Ref : N.Refs)
+      if (Nodes[Ref].Defined && GVs[Ref]->hasLocalLinkage() &&
+          !Nodes[Ref].Duplicable)
+        RefersToLocal = true;
+    if (RefersToLocal)
+      continue;
+    if (auto* F = dyn_cast<Function>(&GV))
+      N.Copyable = GV.hasAvailableExternallyLinkage() ||
+                   (N.Cost <= CopyLimit &&
+                    !F->hasFnAttribute(Attribute::NoInline));
+    else if (auto* Var = dyn_cast<GlobalVariable>(&GV))
+      N.Copyable = Var->isConstant() && !Var->isThreadLocal();
+  }
+
+  // Group what must stay together: a local definition with its users, an
+  // alias with what it aliases, a comdat, a block with the code taking its
+  // address. Available_externally definitions are only ever copied.
+  std::vector<unsigned> Leaders(GVs.size());
+  std::iota(Leaders.begin(), Leaders.end(), 0);
+  DenseMap<const Comdat*, unsigned> Comdats;
+  auto isGrouped = [&](unsigned I) {
+    return Nodes[I].Defined && !Nodes[I].Duplicable &&
+           !(Nodes[I].Copyable && GVs[I]->hasAvailableExternallyLinkage());
+  };
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I) {
+    if (!isGrouped(I))
+      continue;
+    const GlobalValue& GV = *GVs[I];
+    bool JoinAll = isa<GlobalAlias>(GV) || GV.hasAppendingLinkage();
+    for (unsigned Ref : Nodes[I].Refs)
+      if (isGrouped(Ref) && (JoinAll || GVs[Ref]->hasLocalLinkage()))
+        join(Leaders, I, Ref);
+    for (unsigned J : Nodes[I].Joined)
+      if (Nodes[J].Defined)
+        join(Leaders, I, J);
+    if (const Comdat* C = GV.getComdat()) {
+      auto IComdat = Comdats.insert(std::make_pair(C, I)).first;
+      join(Leaders, I, IComdat->second);
+    }
+  }
+
+  // Spread the groups, largest first, over the least loaded partitions.
+  std::vector<unsigned> Groups;
+  std::vector<uint64_t> GroupCost(GVs.size());
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I) {
+    if (!isGrouped(I))
+      continue;
+    unsigned Leader = findLeader(Leaders, I);
+    if (Leader == I)
+      Groups.push_back(I);
+    GroupCost[Leader] += Nodes[I].Cost;
+  }
+  unsigned NumParts = std::min<size_t>(m_TMs.size(), Groups.size());
+  if (NumParts < 2)
+    return false;
+  std::stable_sort(Groups.begin(), Groups.end(),
+                   [&GroupCost](unsigned A, unsigned B) {
+                     return GroupCost[A] > GroupCost[B];
+                   });
+  std::vector<uint64_t> Load(NumParts);
+  for (unsigned Leader : Groups) {
+    auto ILeast = std::min_element(Load.begin(), Load.end());
+    *ILeast += GroupCost[Leader];
+    Nodes[Leader].Part = ILeast - Load.begin();
+  }
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I)
+    if (isGrouped(I))
+      Nodes[I].Part = Nodes[findLeader(Leaders, I)].Part;
+
+  // Each partition gets the local constants and the copies its definitions
+  // refer to, and those its copies refer to in turn.
+  Parts.assign(NumParts, Partition());
+  std::vector<bool> Exported(GVs.size());
+  for (unsigned P = 0; P != NumParts; ++P) {
+    Partition& Part = Parts[P];
+    std::vector<unsigned> Worklist;
+    for (unsigned I = 0, E = GVs.size(); I != E; ++I)
+      if (Nodes[I].Part == P) {
+        Part.Defines.push_back(I);
+        Worklist.push_back(I);
+      }
+    std::vector<bool> Added(GVs.size());
+    while (!Worklist.empty()) {
+      unsigned I = Worklist.back();
+      Worklist.pop_back();
+      for (unsigned Ref : Nodes[I].Refs) {
+        const Node& R = Nodes[Ref];
+        if (!R.Defined || R.Part == P || Added[Ref])
+          continue;
+        if (R.Duplicable) {
+          Added[Ref] = true;
+          Part.Locals.push_back(Ref);
+          continue;
+        }
+        if (R.Part != NoPartition && GVs[Ref]->hasLinkOnceLinkage())
+          Exported[Ref] = true;
+        if (R.Copyable) {
+          Added[Ref] = true;
+          Part.Copies.push_back(Ref);
+          Worklist.push_back(Ref);
+        }
+      }
+    }
+    std::sort(Part.Locals.begin(), Part.Locals.end());
+    std::sort(Part.Copies.begin(), Part.Copies.end());
+  }
+  for (unsigned I = 0, E = GVs.size(); I != E; ++I)
+    if (Exported[I])
+      Parts[Nodes[I].Part].Exported.push_back(I);
+
+  // A group might have been too small to get a partition of its own.
+  Parts.erase(std::remove_if(Parts.begin(), Parts.end(),
+                             [](const Partition& Part) {
+                               return Part.Defines.empty();
+                             }),
+              Parts.end());
+  return Parts.size() > 1;
+}
+
+ParallelBackend::ObjectPtr
+ParallelBackend::compilePartition(const std::string& Bitcode,
+                                  const std::string& Name,
+                                  const Partition& Part, unsigned Index,
+                                  int OptLevel) const {
+  LLVMContext Ctx;
+  auto ModuleOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode, Name), Ctx);
+  if (!ModuleOrErr) {
+    consumeError(ModuleOrErr.takeError());
+    return nullptr;
+  }
+  std::unique_ptr<Module> M = std::move(*ModuleOrErr);
+  std::vector<const GlobalValue*> GVs;
+  enumerate(*M, GVs);
+
+  DenseSet<const GlobalValue*> Clone;
+  for (const std::vector<unsigned>* List :
+       {&Part.Defines, &Part.Copies, &Part.Locals})
+    for (unsigned I : *List) {
+      if (I >= GVs.size())
+        return nullptr;
+      Clone.insert(GVs[I]);
+    }
+  ValueToValueMapTy VMap;
+  std::unique_ptr<Module> P = CloneModule(M.get(), VMap,
+                                          [&Clone](const GlobalValue* GV) {
+                                            return Clone.count(GV) != 0;
+                                          });
+
+  for (unsigned I : Part.Copies) {
+    auto* GV = cast<GlobalValue>(VMap[GVs[I]]);
+    GV->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    if (auto* GO = dyn_cast<GlobalObject>(GV))
+      GO->setComdat(nullptr);
+  }
+  // Other partitions might refer to these, even if this one does not.
+  for (unsigned I : Part.Exported) {
+    auto* GV = cast<GlobalValue>(VMap[GVs[I]]);
+    GV->setLinkage(GV->hasLinkOnceODRLinkage() ? GlobalValue::WeakODRLinkage
+                                               : GlobalValue::WeakAnyLinkage);
+  }
+  // The special variables not defined here were turned into declarations.
+  std::vector<GlobalVariable*> Special;
+  for (GlobalVariable& GV : P->globals())
+    if (GV.getName().startswith("llvm.") &&
+        (GV.isDeclaration() || isDropped(GV)))
+      Special.push_back(&GV);
+  for (GlobalVariable* GV : Special)
+    GV->eraseFromParent();
+
+  TargetMachine& TM = *m_TMs[Index];
+  P->setDataLayout(TM.createDataLayout());
+  // The pass managers of a BackendPasses are bound to the first module and
+  // to its context.
+  BackendPasses Passes(m_CGOpts, m_TOpts, m_LOpts, TM);
+  Passes.runOnModule(*P, OptLevel);
+  auto Object = orc::SimpleCompiler(TM)(*P);
+  if (!Object.getBinary())
+    return nullptr;
+  return std::make_shared<object::OwningBinary<object::ObjectFile>>(
+      std::move(Object));
+}
+
+bool ParallelBackend::compile(const Module& M, int OptLevel,
+                              std::vector<ObjectPtr>& Objects) {
+  // BackendPasses would not optimize, and the CUDA structors are renamed
+  // after the module that is run.
+  if (OptLevel < 1 || m_CGOpts.DisableLLVMPasses ||
+      !m_CGOpts.CudaGpuBinaryFileNames.empty())
+    return false;
+  std::vector<Partition> Parts;
+  if (!partition(M, Parts))
+    return false;
+
+  std::string Bitcode;
+  {
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(&M, OS);
+  }
+  const std::string Name = M.getModuleIdentifier();
+  std::vector<ObjectPtr> Results(Parts.size());
+  for (unsigned I = 0, E = Parts.size(); I != E; ++I)
+    m_Pool.async([&, I] {
+      Results[I] = compilePartition(Bitcode, Name, Parts[I], I, OptLevel);
+    });
+  m_Pool.wait();
+
+  for (const ObjectPtr& Object : Results)
+    if (!Object)
+      return false;
+  Objects = std::move(Results);
+  return true;
+}
+
+} // end namespace cling
@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_PARALLEL_BACKEND_H
+#define CLING_PARALLEL_BACKEND_H
+
+#include "llvm/Object/Binary.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace clang {
+  class CodeGenOptions;
+  class LangOptions;
+  class TargetOptions;
+}
+
+namespace llvm {
+  class Module;
+  class TargetMachine;
+}
+
+namespace cling {
+  ///\brief Optimizes and compiles the partitions of a large module
+  /// concurrently (cling -fparallel-jit).
+  ///
+  /// As llvm's SplitModule does, the definitions of the module are grouped
+  /// so that local symbols stay with their users, and aliases and comdats
+  /// stay whole; the groups are then spread over the partitions by size.
+  /// Small functions and constants of other partitions are kept as
+  /// available_externally copies, so that they can still be inlined and
+  /// folded. The module is handed to the threads as bitcode: each partition
+  /// is cloned from it, optimized and compiled in an LLVMContext, and with a
+  /// TargetMachine, of its own.
+  ///
+  /// The partitioning only depends on the module and on the number of
+  /// threads; the objects are returned in partition order. The result is the
+  /// same from one run to the next, whichever thread finishes first.
+  class ParallelBackend {
+  public:
+    typedef std::shared_ptr<llvm::object::OwningBinary<
+        llvm::object::ObjectFile>> ObjectPtr;
+
+    ///\brief What a partition is made of, by index of the global values of
+    /// the module: functions, then variables, then aliases.
+    struct Partition {
+      ///\brief The definitions the partition provides.
+      std::vector<unsigned> Defines;
+      ///\brief The definitions copied as available_externally.
+      std::vector<unsigned> Copies;
+      ///\brief Local constants copied into each partition using them.
+      std::vector<unsigned> Locals;
+      ///\brief The linkonce definitions other partitions refer to, which
+      /// must survive optimization.
+      std::vector<unsigned> Exported;
+    };
+
+  private:
+    ///\brief One per partition; a partition only uses its own.
+    std::vector<std::unique_ptr<llvm::TargetMachine>> m_TMs;
+    const clang::CodeGenOptions& m_CGOpts;
+    const clang::TargetOptions& m_TOpts;
+    const clang::LangOptions& m_LOpts;
+    llvm::ThreadPool m_Pool;
+
+    ///\brief Split M into at most m_TMs.size() partitions.
+    ///\returns false if M is not worth splitting.
+    bool partition(const llvm::Module& M, std::vector<Partition>& Parts) const;
+
+    ObjectPtr compilePartition(const std::string& Bitcode,
+                               const std::string& Name,
+                               const Partition& Part, unsigned Index,
+                               int OptLevel) const;
+
+  public:
+    ///\param [in] TMs - The TargetMachines, one per thread.
+    ParallelBackend(std::vector<std::unique_ptr<llvm::TargetMachine>> TMs,
+                    const clang::CodeGenOptions& CGOpts,
+                    const clang::TargetOptions& TOpts,
+                    const clang::LangOptions& LOpts);
+    ~ParallelBackend();
+
+    ///\brief Optimize and compile a module in partitions.
+    ///
+    ///\param [in] M - The module, before any pass ran on it.
+    ///\param [in] OptLevel - The optimization level.
+    ///\param [out] Objects - The objects, to be linked together.
+    ///\returns false if the module should be compiled as a whole instead:
+    ///   it is too small, or not optimized, or a partition failed.
+    bool compile(const llvm::Module& M, int OptLevel,
+                 std::vector<ObjectPtr>& Objects);
+  };
+} // end namespace cling
+
+#endif // CLING_PARALLEL_BACKEND_H
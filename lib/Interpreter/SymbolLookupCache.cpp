@@ -0,0 +1,182 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "SymbolLookupCache.h"
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DynamicLibrary.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <link.h>
+#endif
+
+using namespace llvm;
+
+namespace {
+#if defined(__GLIBC__)
+  struct LinkMapState {
+    unsigned long long Adds = 0;
+    unsigned long long Subs = 0;
+    std::vector<std::string>* Objects = nullptr;
+  };
+
+  int visitObject(dl_phdr_info* Info, size_t Size, void* Data) {
+    LinkMapState& State = *static_cast<LinkMapState*>(Data);
+    // Older glibc do not count the objects; then the link map is walked
+    // each time.
+    if (Size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(Info->dlpi_subs)) {
+      State.Adds = Info->dlpi_adds;
+      State.Subs = Info->dlpi_subs;
+    } else
+      State.Adds = State.Subs = ~0ULL;
+    if (!State.Objects)
+      return 1;
+    // The executable and the vDSO have no (file) name.
+    if (Info->dlpi_name && Info->dlpi_name[0])
+      State.Objects->push_back(Info->dlpi_name);
+    return 0;
+  }
+
+  ///\brief Call F with each symbol the library at Path exports.
+  ///\returns false if the library could not be read.
+  template <class F>
+  bool forEachExport(StringRef Path, F Fn) {
+    auto ObjOrErr = object::ObjectFile::createObjectFile(Path);
+    if (!ObjOrErr) {
+      consumeError(ObjOrErr.takeError());
+      return false;
+    }
+    auto* ELF = dyn_cast<object::ELFObjectFileBase>(ObjOrErr->getBinary());
+    if (!ELF)
+      return false;
+    for (const object::SymbolRef& Sym : ELF->getDynamicSymbolIterators()) {
+      uint32_t Flags = Sym.getFlags();
+      if ((Flags & object::BasicSymbolRef::SF_Undefined) ||
+          !(Flags & object::BasicSymbolRef::SF_Global))
+        continue;
+      if (auto Name = Sym.getName())
+        Fn(*Name);
+      else
+        consumeError(Name.takeError());
+    }
+    return true;
+  }
+#endif
+} // unnamed namespace
+
+namespace cling {
+
+SymbolLookupCache::SymbolLookupCache() {
+#if defined(__GLIBC__)
+  std::vector<std::string> Objects;
+  LinkMapState State;
+  State.Objects = &Objects;
+  dl_iterate_phdr(visitObject, &State);
+  m_Adds = State.Adds;
+  m_Subs = State.Subs;
+  for (auto& Object : Objects)
+    m_Objects.insert(Object);
+#endif
+}
+
+SymbolLookupCache& SymbolLookupCache::get() {
+  static SymbolLookupCache Cache;
+  return Cache;
+}
+
+#if defined(__GLIBC__)
+void SymbolLookupCache::sync() {
+  LinkMapState State;
+  dl_iterate_phdr(visitObject, &State);
+  if (State.Adds == m_Adds && State.Subs == m_Subs && State.Adds != ~0ULL)
+    return;
+  if (State.Subs != m_Subs)
+    m_Found.clear();
+
+  std::vector<std::string> Objects;
+  State.Objects = &Objects;
+  dl_iterate_phdr(visitObject, &State);
+  m_Adds = State.Adds;
+  m_Subs = State.Subs;
+
+  llvm::StringSet<> Current;
+  for (auto& Object : Objects) {
+    Current.insert(Object);
+    if (m_Objects.count(Object) || m_Missing.empty())
+      continue;
+    // Only the missing symbols the new object exports can now be found.
+    bool Read = forEachExport(Object, [this](StringRef Name) {
+      m_Missing.erase(Name);
+    });
+    if (!Read)
+      m_Missing.clear();
+  }
+  m_Objects = std::move(Current);
+}
+#endif
+
+void* SymbolLookupCache::lookup(StringRef Name) {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+#if defined(__GLIBC__)
+  sync();
+#endif
+  auto IFound = m_Found.find(Name);
+  if (IFound != m_Found.end())
+    return IFound->second;
+  if (m_Missing.count(Name))
+    return nullptr;
+
+#if defined(__GLIBC__)
+  // Also finds the few functions of the C library that are not exported,
+  // such as stat().
+  void* Addr = reinterpret_cast<void*>(
+      RTDyldMemoryManager::getSymbolAddressInProcess(Name.str()));
+#else
+  void* Addr = sys::DynamicLibrary::SearchForAddressOfSymbol(Name);
+#endif
+  if (Addr)
+    m_Found[Name] = Addr;
+  else
+    m_Missing.insert(Name);
+  return Addr;
+}
+
+void SymbolLookupCache::libraryLoaded(StringRef Path) {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+#if defined(__GLIBC__)
+  // The library and its dependencies are new objects of the link map.
+  sync();
+#else
+  m_Missing.clear();
+#endif
+}
+
+void SymbolLookupCache::libraryUnloaded() {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+  m_Found.clear();
+}
+
+void SymbolLookupCache::symbolAdded(StringRef Name) {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+  m_Found.erase(Name);
+  m_Missing.erase(Name);
+}
+
+void SymbolLookupCache::invalidate() {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+  m_Found.clear();
+  m_Missing.clear();
+}
+
+} // end namespace cling
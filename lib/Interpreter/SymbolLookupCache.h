@@ -0,0 +1,75 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_SYMBOL_LOOKUP_CACHE_H
+#define CLING_SYMBOL_LOOKUP_CACHE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <mutex>
+
+namespace cling {
+
+///\brief Remembers the symbols the process' libraries provide, and those
+/// they do not, so that the JIT searches the loaded libraries once per
+/// symbol instead of each time it is resolved.
+///
+/// Addresses found stay valid until a library is unloaded. Missing symbols
+/// stay missing until a library that exports them is loaded: with glibc,
+/// each object new to the link map is noticed, however it was loaded, and
+/// its export table read once; only the missing symbols it exports are
+/// forgotten. Elsewhere, loading a library through the
+/// DynamicLibraryManager forgets all missing symbols.
+///
+/// There is one cache per process, as the libraries are.
+class SymbolLookupCache {
+  std::mutex m_Lock;
+  llvm::StringMap<void*> m_Found;
+  llvm::StringSet<> m_Missing;
+
+#if defined(__GLIBC__)
+  ///\brief The link map's counts of loaded and unloaded objects, and the
+  /// objects it contained, when the cache was last synchronized.
+  unsigned long long m_Adds;
+  unsigned long long m_Subs;
+  llvm::StringSet<> m_Objects;
+
+  ///\brief Look for objects that were loaded or unloaded since the last
+  /// call. Called with m_Lock held.
+  void sync();
+#endif
+
+  SymbolLookupCache();
+
+public:
+  static SymbolLookupCache& get();
+
+  ///\brief The address of a symbol of the process, as
+  /// DynamicLibrary::SearchForAddressOfSymbol() finds it, or null.
+  void* lookup(llvm::StringRef Name);
+
+  ///\brief A library was loaded through the DynamicLibraryManager.
+  void libraryLoaded(llvm::StringRef Path);
+
+  ///\brief A library was unloaded: addresses found might be gone.
+  void libraryUnloaded();
+
+  ///\brief A symbol was added to the process, see
+  /// DynamicLibrary::AddSymbol().
+  void symbolAdded(llvm::StringRef Name);
+
+  ///\brief Forget everything, e.g. when the symbols of a library were made
+  /// visible to DynamicLibrary.
+  void invalidate();
+};
+
+} // end namespace cling
+
+#endif // CLING_SYMBOL_LOOKUP_CACHE_H
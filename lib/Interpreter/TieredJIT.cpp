@@ -0,0 +1,649 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "TieredJIT.h"
+
+#include "BackendPasses.h"
+#include "IncrementalJIT.h"
+
+#include "cling/Utils/AST.h"
+#include "cling/Utils/Casting.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+using namespace llvm;
+
+namespace {
+  ///\brief A function gets hot when its count reaches the threshold; a call
+  /// counts CallWeight, a loop iteration one.
+  const int64_t Threshold = 100000;
+  const int64_t CallWeight = 100;
+
+  ///\brief Count of a function that tierUp() does not need to hear about.
+  const int64_t Parked = std::numeric_limits<int64_t>::min();
+
+  ///\brief Switches with more cases are not profiled.
+  const unsigned MaxSwitchCases = 16;
+
+  ///\brief Values of ProfileSummaryBuilder::DefaultCutoffs.
+  const uint32_t SummaryCutoffs[] = {10000,  100000, 200000, 300000,
+                                     400000, 500000, 600000, 700000,
+                                     800000, 900000, 950000, 990000,
+                                     999000, 999900, 999990, 999999};
+
+  std::string tierName(StringRef Name, const char* Kind, uint64_t Id) {
+    return (Name + ".cling." + Kind + "." + Twine(Id)).str();
+  }
+
+  ///\brief Whether a function is worth counting: it must do some work of its
+  /// own, and not be one that runs only once.
+  bool isCandidate(const Function& F) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage() ||
+        F.isVarArg() || F.hasFnAttribute(Attribute::Naked))
+      return false;
+    StringRef Name = F.getName();
+    if (Name.empty() || Name.startswith("_GLOBAL__") ||
+        Name.startswith("__cxx_global_var_init") ||
+        Name.find(cling::utils::Synthesize::UniquePrefix) != StringRef::npos)
+      return false;
+    for (const Argument& Arg : F.args())
+      if (Arg.hasInAllocaAttr())
+        return false;
+
+    SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> BackEdges;
+    FindFunctionBackedges(F, BackEdges);
+    if (!BackEdges.empty())
+      return true;
+    for (const BasicBlock& BB : F)
+      for (const Instruction& I : BB)
+        if (ImmutableCallSite(&I) && !isa<IntrinsicInst>(I))
+          return true;
+    return false;
+  }
+
+  ///\brief Reduce a copy of a transaction's module to what is needed to
+  /// compile one function on its own: the other definitions of the
+  /// transaction already live in the JIT and are only kept for inlining.
+  void isolateFunction(Module& M, Function& Hot) {
+    // Nothing of this copy runs but the function itself.
+    for (const char* Name : {"llvm.global_ctors", "llvm.global_dtors",
+                             "llvm.used", "llvm.compiler.used"})
+      if (GlobalVariable* GV = M.getNamedGlobal(Name))
+        GV->eraseFromParent();
+
+    for (auto I = M.alias_begin(), E = M.alias_end(); I != E;) {
+      GlobalAlias& GA = *I++;
+      GlobalValue* Decl;
+      if (auto* FTy = dyn_cast<FunctionType>(GA.getValueType()))
+        Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+      else
+        Decl = new GlobalVariable(M, GA.getValueType(), false,
+                                  GlobalValue::ExternalLinkage, nullptr);
+      GA.replaceAllUsesWith(ConstantExpr::getBitCast(Decl, GA.getType()));
+      Decl->takeName(&GA);
+      GA.eraseFromParent();
+    }
+
+    for (Function& F : M) {
+      if (F.isDeclaration())
+        continue;
+      F.setComdat(nullptr);
+      // Local functions cannot be referred to, so they are duplicated; being
+      // code, that is harmless.
+      if (&F != &Hot && !F.hasLocalLinkage())
+        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+
+    // Variables must be shared with the -O0 code, only local constants may
+    // be duplicated.
+    for (GlobalVariable& GV : M.globals()) {
+      if (GV.isDeclaration())
+        continue;
+      GV.setComdat(nullptr);
+      if (GV.hasLocalLinkage() && GV.isConstant())
+        continue;
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::DefaultVisibility);
+    }
+  }
+  ///\brief The number of outcomes of a terminator that are counted, 0 if
+  /// it is not profiled.
+  unsigned numOutcomes(const TerminatorInst* T) {
+    if (auto* Br = dyn_cast<BranchInst>(T))
+      return Br->isConditional() ? 2 : 0;
+    if (auto* SI = dyn_cast<SwitchInst>(T))
+      return SI->getNumCases() <= MaxSwitchCases ? SI->getNumCases() + 1 : 0;
+    return 0;
+  }
+
+  ///\brief Set the entry count and branch weights of a function from the
+  /// counts of its -O0 code.
+  ///\returns false if the counts are not those of this function.
+  bool applyProfile(Function& F, const std::vector<uint64_t>& Counts) {
+    size_t NumCounts = 1;
+    for (BasicBlock& BB : F)
+      NumCounts += numOutcomes(BB.getTerminator());
+    if (NumCounts != Counts.size())
+      return false;
+
+    F.setEntryCount(Counts[0]);
+    MDBuilder MDB(F.getContext());
+    size_t Next = 1;
+    for (BasicBlock& BB : F) {
+      TerminatorInst* T = BB.getTerminator();
+      unsigned N = numOutcomes(T);
+      if (!N)
+        continue;
+      ArrayRef<uint64_t> Outcomes(&Counts[Next], N);
+      Next += N;
+      uint64_t Max = *std::max_element(Outcomes.begin(), Outcomes.end());
+      if (!Max)
+        continue; // Never ran: nothing is known.
+      // Weights are 32 bits wide.
+      uint64_t Scale = Max / std::numeric_limits<uint32_t>::max() + 1;
+      SmallVector<uint32_t, 4> Weights;
+      for (uint64_t Outcome : Outcomes)
+        Weights.push_back(uint32_t(Outcome / Scale));
+      T->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(Weights));
+    }
+    return true;
+  }
+
+  ///\brief Annotate the functions of a module with the profiles collected
+  /// for them, and describe the counts to the ProfileSummaryInfo, which
+  /// tells hot from cold code by them.
+  void applyProfiles(Module& M,
+                     const std::map<std::string,
+                                    cling::TieredJIT::ProfilePtr>& Profiles) {
+    std::vector<uint64_t> All;
+    uint64_t MaxFunctionCount = 0, MaxInternalCount = 0;
+    uint32_t NumFunctions = 0;
+    for (Function& F : M) {
+      if (F.isDeclaration())
+        continue;
+      auto I = Profiles.find(F.getName());
+      if (I == Profiles.end())
+        continue;
+      // The -O0 code keeps counting: take a snapshot.
+      const std::vector<uint64_t> Counts = *I->second;
+      if (!applyProfile(F, Counts))
+        continue;
+      ++NumFunctions;
+      MaxFunctionCount = std::max(MaxFunctionCount, Counts[0]);
+      for (size_t C = 1, E = Counts.size(); C < E; ++C)
+        MaxInternalCount = std::max(MaxInternalCount, Counts[C]);
+      All.insert(All.end(), Counts.begin(), Counts.end());
+    }
+    if (!NumFunctions)
+      return;
+
+    std::sort(All.begin(), All.end(), std::greater<uint64_t>());
+    uint64_t Total = 0;
+    for (uint64_t Count : All)
+      Total += Count;
+    SummaryEntryVector Detailed;
+    uint64_t Sum = 0, MinCount = 0;
+    size_t Seen = 0;
+    for (uint32_t Cutoff : SummaryCutoffs) {
+      uint64_t Desired = uint64_t(double(Total) * Cutoff /
+                                  ProfileSummary::Scale);
+      while (Sum < Desired && Seen < All.size()) {
+        MinCount = All[Seen++];
+        Sum += MinCount;
+      }
+      Detailed.emplace_back(Cutoff, MinCount, Seen);
+    }
+    ProfileSummary Summary(ProfileSummary::PSK_Instr, Detailed, Total,
+                           std::max(MaxFunctionCount, MaxInternalCount),
+                           MaxInternalCount, MaxFunctionCount, All.size(),
+                           NumFunctions);
+    M.setProfileSummary(Summary.getMD(M.getContext()));
+  }
+} // unnamed namespace
+
+namespace cling {
+
+TieredJIT::RunningUserCode::RunningUserCode(TieredJIT* TJ) : m_TJ(TJ) {
+  if (!m_TJ)
+    return;
+  m_TJ->installReady();
+  std::lock_guard<std::mutex> Lock(m_TJ->m_Lock);
+  if (!m_TJ->m_UserCodeDepth++)
+    m_TJ->m_UserThread = std::this_thread::get_id();
+}
+
+TieredJIT::RunningUserCode::~RunningUserCode() {
+  if (!m_TJ)
+    return;
+  std::lock_guard<std::mutex> Lock(m_TJ->m_Lock);
+  --m_TJ->m_UserCodeDepth;
+}
+
+TieredJIT::TieredJIT(IncrementalJIT& JIT,
+                     std::unique_ptr<llvm::TargetMachine> TM,
+                     const clang::CodeGenOptions& CGOpts,
+                     const clang::TargetOptions& TOpts,
+                     const clang::LangOptions& LOpts, bool Profile)
+    : m_JIT(JIT), m_TM(std::move(TM)), m_CGOpts(CGOpts), m_TOpts(TOpts),
+      m_LOpts(LOpts), m_Profile(Profile), m_Stop(false), m_UserCodeDepth(0) {}
+
+TieredJIT::~TieredJIT() {
+  {
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    m_Stop = true;
+  }
+  m_Work.notify_one();
+  if (m_Worker.joinable())
+    m_Worker.join();
+}
+
+void TieredJIT::instrumentModule(llvm::Module& M, int OptLevel) {
+  std::vector<Function*> Candidates;
+  for (Function& F : M)
+    if (isCandidate(F))
+      Candidates.push_back(&F);
+  if (Candidates.empty())
+    return;
+
+  uint64_t FirstId;
+  {
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    FirstId = m_Functions.size();
+  }
+
+  // The optimized copies refer to the variables of the module by name; local
+  // ones must not be confused with those of another transaction.
+  for (GlobalVariable& GV : M.globals())
+    if (!GV.isDeclaration() && GV.hasLocalLinkage() && !GV.isConstant())
+      GV.setName(tierName(GV.getName(), "var", FirstId));
+
+  auto Bitcode = std::make_shared<std::string>();
+  {
+    raw_string_ostream OS(*Bitcode);
+    WriteBitcodeToFile(&M, OS);
+  }
+
+  std::vector<uint64_t> Ids;
+  std::vector<ProfilePtr> Profiles;
+  {
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    std::vector<uint64_t>& OfModule = m_ModuleFunctions[&M];
+    for (Function* F : Candidates) {
+      Ids.push_back(m_Functions.size());
+      OfModule.push_back(Ids.back());
+      Profiles.push_back(m_Profile ? std::make_shared<std::vector<uint64_t>>()
+                                   : nullptr);
+      m_Functions.push_back({&M, Bitcode, F->getName().str(), OptLevel,
+                             kCold, nullptr, nullptr, nullptr,
+                             Profiles.back()});
+    }
+  }
+  for (size_t I = 0, E = Candidates.size(); I < E; ++I)
+    instrumentFunction(*Candidates[I], Ids[I], Profiles[I].get());
+}
+
+void TieredJIT::instrumentFunction(llvm::Function& F, uint64_t Id,
+                                   std::vector<uint64_t>* Profile) {
+  Module& M = *F.getParent();
+  LLVMContext& Ctx = M.getContext();
+  const DataLayout& DL = M.getDataLayout();
+  Type* I8PtrTy = Type::getInt8PtrTy(Ctx);
+  IntegerType* I64Ty = Type::getInt64Ty(Ctx);
+  IntegerType* IntPtrTy = DL.getIntPtrType(Ctx);
+  auto toPtr = [IntPtrTy](const void* Addr, Type* Ty) {
+    return ConstantExpr::getIntToPtr(
+        ConstantInt::get(IntPtrTy, reinterpret_cast<uintptr_t>(Addr)), Ty);
+  };
+  auto increment = [I64Ty](IRBuilder<>& B, Value* Counter) {
+    B.CreateStore(B.CreateAdd(B.CreateLoad(Counter),
+                              ConstantInt::get(I64Ty, 1)), Counter);
+  };
+
+  // optimizeProfiled() looks them up by name in the JIT: they must not be
+  // local, but nothing outside of the module refers to them.
+  auto* Impl = new GlobalVariable(M, I8PtrTy, false,
+                                  GlobalValue::ExternalLinkage,
+                                  Constant::getNullValue(I8PtrTy),
+                                  tierName(F.getName(), "impl", Id));
+  Impl->setVisibility(GlobalValue::HiddenVisibility);
+  auto* Count = new GlobalVariable(M, I64Ty, false,
+                                   GlobalValue::ExternalLinkage,
+                                   ConstantInt::get(I64Ty, 0),
+                                   tierName(F.getName(), "count", Id));
+  Count->setVisibility(GlobalValue::HiddenVisibility);
+
+  SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> BackEdges;
+  FindFunctionBackedges(F, BackEdges);
+
+  // Count the outcomes of the branches and switches of the body, in the
+  // order of its blocks, after the calls (below).
+  Constant* Counters = nullptr;
+  if (Profile) {
+    std::vector<TerminatorInst*> Profiled;
+    size_t NumCounts = 1;
+    for (BasicBlock& BB : F)
+      if (unsigned N = numOutcomes(BB.getTerminator())) {
+        Profiled.push_back(BB.getTerminator());
+        NumCounts += N;
+      }
+    Profile->assign(NumCounts, 0);
+    Counters = toPtr(Profile->data(), I64Ty->getPointerTo());
+
+    uint64_t Next = 1;
+    for (TerminatorInst* T : Profiled) {
+      IRBuilder<> PB(T);
+      Value* Index;
+      if (auto* Br = dyn_cast<BranchInst>(T))
+        Index = PB.CreateSelect(Br->getCondition(),
+                                ConstantInt::get(I64Ty, Next),
+                                ConstantInt::get(I64Ty, Next + 1));
+      else {
+        // The default outcome comes first, as in the branch weights.
+        auto* SI = cast<SwitchInst>(T);
+        Index = ConstantInt::get(I64Ty, Next);
+        uint64_t Case = Next + 1;
+        for (auto& C : SI->cases())
+          Index = PB.CreateSelect(PB.CreateICmpEQ(SI->getCondition(),
+                                                  C.getCaseValue()),
+                                  ConstantInt::get(I64Ty, Case++), Index);
+      }
+      Next += numOutcomes(T);
+      increment(PB, PB.CreateInBoundsGEP(Counters, Index));
+    }
+  }
+
+  BasicBlock* Body = &F.getEntryBlock();
+  BasicBlock* Entry = BasicBlock::Create(Ctx, "cling.tier", &F, Body);
+  BasicBlock* CallOpt = BasicBlock::Create(Ctx, "cling.tier.opt", &F, Body);
+  BasicBlock* Counting = BasicBlock::Create(Ctx, "cling.tier.count", &F, Body);
+  BasicBlock* Hot = BasicBlock::Create(Ctx, "cling.tier.up", &F, Body);
+
+  // Static allocas must stay in the entry block.
+  for (auto I = Body->begin(), E = Body->end(); I != E;) {
+    auto* AI = dyn_cast<AllocaInst>(&*I++);
+    if (AI && isa<Constant>(AI->getArraySize())) {
+      AI->removeFromParent();
+      Entry->getInstList().push_back(AI);
+    }
+  }
+
+  // Call the optimized version once it is installed.
+  IRBuilder<> B(Entry);
+  LoadInst* Target = B.CreateLoad(Impl, "cling.tier.impl");
+  Target->setAtomic(AtomicOrdering::Monotonic);
+  Target->setAlignment(DL.getPointerABIAlignment());
+  B.CreateCondBr(B.CreateIsNotNull(Target), CallOpt, Counting);
+
+  B.SetInsertPoint(CallOpt);
+  SmallVector<Value*, 8> Args;
+  for (Argument& Arg : F.args())
+    Args.push_back(&Arg);
+  CallInst* Call = B.CreateCall(B.CreatePointerCast(Target, F.getType()),
+                                Args);
+  AttributeList Attrs = F.getAttributes();
+  SmallVector<AttributeSet, 8> ArgAttrs;
+  for (unsigned I = 0, E = F.arg_size(); I < E; ++I)
+    ArgAttrs.push_back(Attrs.getParamAttributes(I));
+  Call->setAttributes(AttributeList::get(Ctx, AttributeSet(),
+                                         Attrs.getRetAttributes(), ArgAttrs));
+  Call->setCallingConv(F.getCallingConv());
+  Call->setTailCall();
+  if (F.getReturnType()->isVoidTy())
+    B.CreateRetVoid();
+  else
+    B.CreateRet(Call);
+
+  // Otherwise count the call, and tell tierUp() when the function got hot.
+  B.SetInsertPoint(Counting);
+  Value* N = B.CreateAdd(B.CreateLoad(Count), ConstantInt::get(I64Ty,
+                                                               CallWeight));
+  B.CreateStore(N, Count);
+  if (Counters)
+    increment(B, Counters);
+  B.CreateCondBr(B.CreateICmpSGE(N, ConstantInt::get(I64Ty, Threshold)),
+                 Hot, Body);
+
+  B.SetInsertPoint(Hot);
+  Type* HookArgs[] = {I8PtrTy, I64Ty, I64Ty->getPointerTo(),
+                      I8PtrTy->getPointerTo()};
+  FunctionType* HookTy = FunctionType::get(Type::getVoidTy(Ctx), HookArgs,
+                                           false);
+  Value* HookArgValues[] = {toPtr(this, I8PtrTy), ConstantInt::get(I64Ty, Id),
+                            Count, Impl};
+  B.CreateCall(toPtr(utils::FunctionToVoidPtr(&tierUp),
+                     HookTy->getPointerTo()),
+               HookArgValues);
+  B.CreateBr(Body);
+
+  // Loop iterations count as well, the next call checks the total.
+  SmallPtrSet<const BasicBlock*, 8> Headers;
+  for (auto& Edge : BackEdges)
+    Headers.insert(Edge.second);
+  for (const BasicBlock* Header : Headers) {
+    BasicBlock* BB = const_cast<BasicBlock*>(Header);
+    auto InsertPt = BB->getFirstInsertionPt();
+    if (InsertPt == BB->end())
+      continue;
+    IRBuilder<> LB(BB, InsertPt);
+    increment(LB, Count);
+  }
+}
+
+void TieredJIT::tierUp(void* Self, uint64_t Id, int64_t* Count, void** Impl) {
+  TieredJIT& TJ = *static_cast<TieredJIT*>(Self);
+  {
+    std::lock_guard<std::mutex> Lock(TJ.m_Lock);
+    TieredFunction& TF = TJ.m_Functions[Id];
+    if (TF.St == kCold) {
+      TJ.enqueue(Id, Count, Impl);
+      return;
+    }
+    // Only the interpreter thread may add to the JIT, and only while it runs
+    // user code: not while it is itself JITting. Otherwise, a queued or
+    // ready function asks again after counting to the threshold once more.
+    // The counter is only written by the thread that runs the -O0 code.
+    if (TF.St != kReady || !TJ.m_UserCodeDepth ||
+        TJ.m_UserThread != std::this_thread::get_id()) {
+      *Count = TF.St == kQueued || TF.St == kReady ? 0 : Parked;
+      return;
+    }
+  }
+  TJ.installReady();
+}
+
+void TieredJIT::enqueue(uint64_t Id, int64_t* Count, void** Impl) {
+  TieredFunction& TF = m_Functions[Id];
+  TF.St = kQueued;
+  TF.Count = Count;
+  TF.Impl = Impl;
+  *Count = 0;
+  m_Queue.push_back(Id);
+  if (!m_Worker.joinable())
+    m_Worker = std::thread(&TieredJIT::workerLoop, this);
+  m_Work.notify_one();
+}
+
+void TieredJIT::workerLoop() {
+  std::unique_lock<std::mutex> Lock(m_Lock);
+  while (true) {
+    m_Work.wait(Lock, [this] { return m_Stop || !m_Queue.empty(); });
+    if (m_Stop)
+      return;
+    uint64_t Id = m_Queue.front();
+    m_Queue.pop_front();
+    if (m_Functions[Id].St != kQueued)
+      continue;
+    std::shared_ptr<const std::string> Bitcode = m_Functions[Id].Bitcode;
+    std::string Name = m_Functions[Id].Name;
+    int OptLevel = m_Functions[Id].OptLevel;
+    // The functions of the module, which the copy might inline.
+    std::map<std::string, ProfilePtr> Profiles;
+    auto IModule = m_ModuleFunctions.find(m_Functions[Id].Owner);
+    if (m_Profile && IModule != m_ModuleFunctions.end())
+      for (uint64_t Other : IModule->second)
+        if (const ProfilePtr& Profile = m_Functions[Other].Profile)
+          Profiles[m_Functions[Other].Name] = Profile;
+
+    Lock.unlock();
+    ObjectPtr Object = optimize(*Bitcode, Name, Id, OptLevel, Profiles);
+    Lock.lock();
+
+    TieredFunction& TF = m_Functions[Id];
+    if (TF.St != kQueued)
+      continue;
+    if (!Object) {
+      TF.St = kFailed;
+      continue;
+    }
+    TF.Object = std::move(Object);
+    TF.St = kReady;
+    m_Ready.push_back(Id);
+  }
+}
+
+TieredJIT::ObjectPtr
+TieredJIT::optimize(const std::string& Bitcode, const std::string& Name,
+                    uint64_t Id, int OptLevel,
+                    const std::map<std::string, ProfilePtr>& Profiles) {
+  LLVMContext Ctx;
+  auto ModuleOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode, "cling-tier"),
+                                      Ctx);
+  if (!ModuleOrErr) {
+    consumeError(ModuleOrErr.takeError());
+    return nullptr;
+  }
+  std::unique_ptr<Module> M = std::move(*ModuleOrErr);
+  M->setDataLayout(m_TM->createDataLayout());
+  Function* Hot = M->getFunction(Name);
+  if (!Hot || Hot->isDeclaration())
+    return nullptr;
+
+  isolateFunction(*M, *Hot);
+  if (!Profiles.empty())
+    applyProfiles(*M, Profiles);
+  Hot->setName(tierName(Name, "opt", Id));
+  Hot->setLinkage(GlobalValue::ExternalLinkage);
+  Hot->setVisibility(GlobalValue::DefaultVisibility);
+
+  // The pass managers of a BackendPasses are bound to the first module and
+  // to its context.
+  BackendPasses Passes(m_CGOpts, m_TOpts, m_LOpts, *m_TM);
+  Passes.runOnModule(*M, OptLevel);
+  auto Object = orc::SimpleCompiler(*m_TM)(*M);
+  if (!Object.getBinary())
+    return nullptr;
+  return std::make_shared<object::OwningBinary<object::ObjectFile>>(
+      std::move(Object));
+}
+
+void TieredJIT::installReady() {
+  std::vector<uint64_t> Ready;
+  {
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    Ready.swap(m_Ready);
+  }
+  for (uint64_t Id : Ready) {
+    llvm::Module* Owner;
+    ObjectPtr Object;
+    std::string Name;
+    {
+      std::lock_guard<std::mutex> Lock(m_Lock);
+      TieredFunction& TF = m_Functions[Id];
+      if (TF.St != kReady)
+        continue;
+      Owner = TF.Owner;
+      Object = std::move(TF.Object);
+      Name = tierName(TF.Name, "opt", Id);
+    }
+    // May JIT and run static initializers, hence outside of the lock.
+    uint64_t Addr = m_JIT.addTierObject(Owner, std::move(Object), Name);
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    TieredFunction& TF = m_Functions[Id];
+    if (TF.St != kReady)
+      continue;
+    if (!Addr) {
+      TF.St = kFailed;
+      *TF.Count = Parked;
+      continue;
+    }
+    *static_cast<void* volatile*>(TF.Impl) = reinterpret_cast<void*>(Addr);
+    TF.St = kInstalled;
+  }
+}
+
+void TieredJIT::forgetModule(llvm::Module* M) {
+  std::lock_guard<std::mutex> Lock(m_Lock);
+  auto I = m_ModuleFunctions.find(M);
+  if (I == m_ModuleFunctions.end())
+    return;
+  for (uint64_t Id : I->second) {
+    TieredFunction& TF = m_Functions[Id];
+    TF.St = kDropped;
+    TF.Owner = nullptr;
+    TF.Bitcode.reset();
+    TF.Count = nullptr;
+    TF.Impl = nullptr;
+    TF.Object.reset();
+    TF.Profile.reset();
+  }
+  m_ModuleFunctions.erase(I);
+}
+
+size_t TieredJIT::optimizeProfiled() {
+  std::vector<std::pair<uint64_t, std::string>> Ran;
+  {
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    for (uint64_t Id = 0, E = m_Functions.size(); Id < E; ++Id) {
+      const TieredFunction& TF = m_Functions[Id];
+      if (TF.St == kCold && TF.Profile && TF.Profile->front())
+        Ran.emplace_back(Id, TF.Name);
+    }
+  }
+
+  size_t Queued = 0;
+  for (auto& IdName : Ran) {
+    // Until the function calls tierUp(), only the JIT knows where its counter
+    // and its pointer to the optimized version are; instrumentFunction() gave
+    // them external linkage for this.
+    auto* Count = reinterpret_cast<int64_t*>(m_JIT.getSymbolAddress(
+        tierName(IdName.second, "count", IdName.first), false));
+    auto* Impl = reinterpret_cast<void**>(m_JIT.getSymbolAddress(
+        tierName(IdName.second, "impl", IdName.first), false));
+    if (!Count || !Impl)
+      continue;
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    if (m_Functions[IdName.first].St != kCold)
+      continue;
+    enqueue(IdName.first, Count, Impl);
+    ++Queued;
+  }
+  return Queued;
+}
+
+} // end namespace cling
@@ -0,0 +1,173 @@
+//--------------------------------------------------------------------*- C++ -*-
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#ifndef CLING_TIERED_JIT_H
+#define CLING_TIERED_JIT_H
+
+#include "llvm/Object/Binary.h"
+#include "llvm/Object/ObjectFile.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace clang {
+  class CodeGenOptions;
+  class LangOptions;
+  class TargetOptions;
+}
+
+namespace llvm {
+  class Function;
+  class Module;
+  class TargetMachine;
+}
+
+namespace cling {
+  class IncrementalJIT;
+
+  ///\brief Runs transactions at -O0 and re-optimizes their hot functions on a
+  /// background thread (cling -ftiered-jit).
+  ///
+  /// Before a module is compiled at -O0, a copy of it is kept as bitcode and
+  /// each function that loops or calls gets a dispatch prologue: if the
+  /// optimized version is installed it tail-calls it, otherwise it counts the
+  /// call (loop back edges count too) and calls tierUp() once the count
+  /// reaches a threshold. The function is then optimized from the copy on
+  /// the worker thread. The resulting object is added to the IncrementalJIT
+  /// on the interpreter thread only, as the JIT is not thread-safe: either
+  /// when the next statement is run, or by the hook itself if it is called
+  /// from the interpreter thread. Running frames stay in the -O0 code.
+  ///
+  /// With profiling (cling -fjit-pgo), the -O0 code also counts the calls of
+  /// each function and the outcomes of its branches and switches. The
+  /// optimized version, and the copies of the functions it might inline, get
+  /// these counts as entry counts and branch weights, as if they came from
+  /// an instrumented build.
+  class TieredJIT {
+  public:
+    typedef std::shared_ptr<llvm::object::OwningBinary<
+        llvm::object::ObjectFile>> ObjectPtr;
+    ///\brief The counts of a function: calls, then the outcomes of each
+    /// branch or switch, in the order of the function's blocks.
+    typedef std::shared_ptr<std::vector<uint64_t>> ProfilePtr;
+
+    ///\brief Marks the interpreter thread as running user code, during which
+    /// tierUp() may install optimized code directly.
+    class RunningUserCode {
+      TieredJIT* m_TJ;
+    public:
+      RunningUserCode(TieredJIT* TJ);
+      ~RunningUserCode();
+    };
+
+  private:
+    enum State {
+      kCold,      ///< Not hot yet.
+      kQueued,    ///< Waiting for or being optimized by the worker.
+      kReady,     ///< Optimized, waiting to be installed.
+      kInstalled, ///< The prologue calls the optimized version.
+      kFailed,    ///< Could not be optimized; stays at -O0.
+      kDropped    ///< Its module was unloaded.
+    };
+
+    struct TieredFunction {
+      llvm::Module* Owner;
+      ///\brief The module as it was before instrumentation.
+      std::shared_ptr<const std::string> Bitcode;
+      ///\brief Name of the function in Bitcode.
+      std::string Name;
+      int OptLevel;
+      State St;
+      ///\brief The counter and the pointer to the optimized version in the
+      /// -O0 code, known once the function called tierUp().
+      int64_t* Count;
+      void** Impl;
+      ObjectPtr Object;
+      ///\brief Written by the -O0 code, null without profiling.
+      ProfilePtr Profile;
+    };
+
+    IncrementalJIT& m_JIT;
+
+    ///\brief Used by the worker only.
+    std::unique_ptr<llvm::TargetMachine> m_TM;
+    const clang::CodeGenOptions& m_CGOpts;
+    const clang::TargetOptions& m_TOpts;
+    const clang::LangOptions& m_LOpts;
+    const bool m_Profile;
+
+    ///\brief Protects everything below.
+    std::mutex m_Lock;
+    std::condition_variable m_Work;
+    std::thread m_Worker;
+    bool m_Stop;
+
+    ///\brief Indexed by the id passed to tierUp().
+    std::vector<TieredFunction> m_Functions;
+    std::unordered_map<llvm::Module*, std::vector<uint64_t>> m_ModuleFunctions;
+    std::deque<uint64_t> m_Queue;
+    std::vector<uint64_t> m_Ready;
+
+    std::thread::id m_UserThread;
+    unsigned m_UserCodeDepth;
+
+    ///\brief Called by the instrumented code when a function got hot.
+    static void tierUp(void* Self, uint64_t Id, int64_t* Count, void** Impl);
+
+    ///\brief Hand a cold function to the worker. Called with m_Lock held.
+    void enqueue(uint64_t Id, int64_t* Count, void** Impl);
+
+    ///\param [in] Profile - Where the code counts its calls and outcomes,
+    ///   or null.
+    void instrumentFunction(llvm::Function& F, uint64_t Id,
+                            std::vector<uint64_t>* Profile);
+    void workerLoop();
+    ObjectPtr optimize(const std::string& Bitcode, const std::string& Name,
+                       uint64_t Id, int OptLevel,
+                       const std::map<std::string, ProfilePtr>& Profiles);
+
+  public:
+    TieredJIT(IncrementalJIT& JIT, std::unique_ptr<llvm::TargetMachine> TM,
+              const clang::CodeGenOptions& CGOpts,
+              const clang::TargetOptions& TOpts,
+              const clang::LangOptions& LOpts, bool Profile);
+    ~TieredJIT();
+
+    ///\brief Instrument the hot-function candidates of a module that is
+    /// about to be compiled at -O0.
+    ///
+    ///\param [in] M - The module, before any pass ran on it.
+    ///\param [in] OptLevel - Level at which its hot functions are optimized.
+    void instrumentModule(llvm::Module& M, int OptLevel);
+
+    ///\brief Install the optimized functions that are ready. Must be called
+    /// on the interpreter thread.
+    void installReady();
+
+    ///\brief Forget the functions of a module that is being unloaded.
+    void forgetModule(llvm::Module* M);
+
+    ///\brief Re-optimize, with the profile collected so far, each function
+    /// that ran but did not get hot yet. Must be called on the interpreter
+    /// thread.
+    ///\returns The number of functions handed to the worker.
+    size_t optimizeProfiled();
+
+    bool isProfiling() const { return m_Profile; }
+  };
+} // end namespace cling
+
+#endif // CLING_TIERED_JIT_H
@@ -131,7 +131,8 @@ namespace cling {
       || isTypedefCommand()
       || isShellCommand(actionResult, resultValue) || isstoreStateCommand()
       || iscompareStateCommand() || isstatsCommand() || isundoCommand()
-      || isRedirectCommand(actionResult) || istraceCommand();
+      || isRedirectCommand(actionResult) || istraceCommand()
+      || ispgoCommand() || issnapshotCommand(actionResult);
   }
 
   // L := 'L' FilePath Comment
@@ -527,6 +528,29 @@ namespace cling {
     return false;
   }
 
+  bool MetaParser::ispgoCommand() {
+    if (getCurTok().is(tok::ident) && getCurTok().getIdent().equals("pgo")) {
+      m_Actions->actOnpgoCommand();
+      return true;
+    }
+    return false;
+  }
+
+  // SnapshotCommand := 'snapshot' FilePath
+  // FilePath := AnyString
+  // AnyString := .*^('\t' Comment)
+  bool MetaParser::issnapshotCommand(MetaSema::ActionResult& actionResult) {
+    if (getCurTok().is(tok::ident) &&
+        getCurTok().getIdent().equals("snapshot")) {
+      consumeAnyStringToken(tok::eof);
+      if (!getCurTok().is(tok::raw_ident))
+        return false; // FIXME: Issue proper diagnostics
+      actionResult = m_Actions->actOnsnapshotCommand(getCurTok().getIdent());
+      return true;
+    }
+    return false;
+  }
+
   bool MetaParser::isundoCommand() {
     if (getCurTok().is(tok::ident) &&
         getCurTok().getIdent().equals("undo")) {
@@ -312,6 +312,15 @@ namespace cling {
     m_Interpreter.dump(name, args);
   }
 
+  void MetaSema::actOnpgoCommand() const {
+    m_Interpreter.optimizeWithProfile(m_MetaProcessor.getOuts());
+  }
+
+  MetaSema::ActionResult
+  MetaSema::actOnsnapshotCommand(llvm::StringRef file) const {
+    return m_Interpreter.saveSnapshot(file) ? AR_Success : AR_Failure;
+  }
+
   void MetaSema::actOndynamicExtensionsCommand(SwitchMode mode/* = kToggle*/)
     const {
     if (mode == kToggle) {
@@ -385,6 +394,15 @@ namespace cling {
                              "\t\t\t\t  'asttree [filter]'  abstract syntax tree layout\n"
                              "\t\t\t\t  'decl' dump ast declarations\n"
                              "\t\t\t\t  'undo' show undo stack\n"
+                             "\t\t\t\t  'sycl [json]' SYCL device compiler timers\n"
+                             "\t\t\t\t  'jitmem [json]' JIT code and data memory\n"
+                             "\t\t\t\t  'jitcache [json]' JIT object cache hits\n"
+      "\n"
+      "   " << metaString << "pgo\t\t\t- Re-optimize the code that ran with its profile\n"
+                             "\t\t\t\t  (cling -fjit-pgo)\n"
+      "\n"
+      "   " << metaString << "snapshot <filename>\t\t- Save the session, to start from it with"
+                             "\n\t\t\t\t  cling --restore=<filename>\n"
       "\n"
       "   " << metaString << "help\t\t\t- Shows this information\n"
       "\n"
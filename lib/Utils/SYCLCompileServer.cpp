@@ -0,0 +1,320 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+#include "cling/Utils/SYCLCompileServer.h"
+
+#include "llvm/Config/llvm-config.h"
+
+#if defined(LLVM_ON_UNIX)
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A message is the number of its strings followed by each string, prefixed by
+// its length; numbers are 32-bit in host order, since both ends run on the
+// same host. A request is the program followed by its arguments; the reply is
+// the JobStatus, the exit code and the output of the program.
+
+namespace cling {
+namespace utils {
+namespace sycl {
+
+namespace {
+  // Never let a peer hanging up kill the process with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+  const int SendFlags = MSG_NOSIGNAL;
+#else
+  const int SendFlags = 0;
+#endif
+
+  ///\brief Bounds of a message, so that a confused peer cannot make the
+  /// other end allocate without limit.
+  const uint32_t MaxStrings = 1 << 16;
+  const uint32_t MaxLength = 1 << 26;
+
+  bool sendAll(int FD, const char* Data, size_t Size) {
+    while (Size) {
+      ssize_t N = ::send(FD, Data, Size, SendFlags);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return false;
+      Data += N;
+      Size -= N;
+    }
+    return true;
+  }
+
+  bool recvAll(int FD, char* Data, size_t Size) {
+    while (Size) {
+      ssize_t N = ::recv(FD, Data, Size, 0);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return false;
+      Data += N;
+      Size -= N;
+    }
+    return true;
+  }
+
+  bool sendMessage(int FD, const std::vector<std::string>& Strings) {
+    std::string Buf;
+    auto appendLength = [&Buf](size_t Length) {
+      uint32_t L = Length;
+      Buf.append(reinterpret_cast<const char*>(&L), sizeof(L));
+    };
+    appendLength(Strings.size());
+    for (auto& Str : Strings) {
+      appendLength(Str.size());
+      Buf += Str;
+    }
+    return sendAll(FD, Buf.data(), Buf.size());
+  }
+
+  bool recvMessage(int FD, std::vector<std::string>& Strings) {
+    uint32_t Count;
+    if (!recvAll(FD, reinterpret_cast<char*>(&Count), sizeof(Count)) ||
+        Count > MaxStrings)
+      return false;
+    Strings.resize(Count);
+    for (auto& Str : Strings) {
+      uint32_t Length;
+      if (!recvAll(FD, reinterpret_cast<char*>(&Length), sizeof(Length)) ||
+          Length > MaxLength)
+        return false;
+      Str.resize(Length);
+      if (Length && !recvAll(FD, &Str[0], Length))
+        return false;
+    }
+    return true;
+  }
+
+  int openSocket(const std::string& Path, sockaddr_un& Addr) {
+    if (Path.size() >= sizeof(Addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    ::memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    ::memcpy(Addr.sun_path, Path.c_str(), Path.size());
+    int FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+#ifdef SO_NOSIGPIPE
+    if (FD >= 0) {
+      int On = 1;
+      ::setsockopt(FD, SOL_SOCKET, SO_NOSIGPIPE, &On, sizeof(On));
+    }
+#endif
+    return FD;
+  }
+
+  int connectTo(const std::string& Path) {
+    sockaddr_un Addr;
+    int FD = openSocket(Path, Addr);
+    if (FD < 0)
+      return -1;
+    if (::connect(FD, reinterpret_cast<sockaddr*>(&Addr), sizeof(Addr))) {
+      ::close(FD);
+      return -1;
+    }
+    return FD;
+  }
+
+  ///\brief Run a job in this process, collecting its stdout and stderr.
+  std::string runLocalJob(const Job& J, int& ExitCode) {
+    ExitCode = -1;
+    llvm::SmallString<128> OutPath;
+    if (llvm::sys::fs::createTemporaryFile("cling-sycl-job", "log", OutPath))
+      return "cannot create a temporary file\n";
+
+    std::vector<const char*> Argv;
+    Argv.push_back(J.first.c_str());
+    for (auto& Arg : J.second)
+      Argv.push_back(Arg.c_str());
+    Argv.push_back(nullptr);
+    const llvm::StringRef Empty, Out(OutPath);
+    const llvm::StringRef* Redirects[] = {&Empty, &Out, &Out};
+    std::string ErrMsg;
+    ExitCode = llvm::sys::ExecuteAndWait(J.first, Argv.data(), nullptr,
+                                         Redirects, 0, 0, &ErrMsg);
+
+    std::string Output;
+    if (auto Buffer = llvm::MemoryBuffer::getFile(OutPath))
+      Output = (*Buffer)->getBuffer();
+    llvm::sys::fs::remove(OutPath);
+    if (ExitCode < 0)
+      Output += "could not run " + J.first + ": " + ErrMsg + "\n";
+    return Output;
+  }
+
+  struct ServerState {
+    std::string AllowedDir;
+    unsigned Workers;
+    std::mutex Lock;
+    std::condition_variable Free;
+    unsigned Running = 0;
+  };
+
+  bool isAllowed(const ServerState& State, const std::string& Program) {
+    llvm::SmallString<256> Real;
+    if (llvm::sys::fs::real_path(Program, Real))
+      return false;
+    return llvm::sys::path::parent_path(Real) == State.AllowedDir;
+  }
+
+  void serveConnection(std::shared_ptr<ServerState> State, int Conn) {
+    std::vector<std::string> Request;
+    if (recvMessage(Conn, Request) && !Request.empty()) {
+      Job J;
+      J.first = Request.front();
+      J.second.assign(Request.begin() + 1, Request.end());
+      std::vector<std::string> Reply;
+      if (!isAllowed(*State, J.first)) {
+        Reply = {std::to_string(kJobRejected), "-1",
+                 J.first + " is not in " + State->AllowedDir + "\n"};
+      } else {
+        {
+          std::unique_lock<std::mutex> Lock(State->Lock);
+          State->Free.wait(
+              Lock, [&State] { return State->Running < State->Workers; });
+          ++State->Running;
+        }
+        int ExitCode;
+        std::string Output = runLocalJob(J, ExitCode);
+        {
+          std::lock_guard<std::mutex> Lock(State->Lock);
+          --State->Running;
+        }
+        State->Free.notify_one();
+        Reply = {std::to_string(kJobRun), std::to_string(ExitCode),
+                 std::move(Output)};
+      }
+      sendMessage(Conn, Reply);
+    }
+    ::close(Conn);
+  }
+} // unnamed namespace
+
+JobStatus RunRemoteJob(const std::string& Socket, const Job& J, int& ExitCode,
+                       std::string& Output) {
+  ExitCode = -1;
+  int FD = connectTo(Socket);
+  if (FD < 0)
+    return kServerFailure;
+
+  std::vector<std::string> Request;
+  Request.push_back(J.first);
+  Request.insert(Request.end(), J.second.begin(), J.second.end());
+  std::vector<std::string> Reply;
+  JobStatus Status = kServerFailure;
+  if (sendMessage(FD, Request) && recvMessage(FD, Reply) &&
+      Reply.size() == 3) {
+    Status = std::atoi(Reply[0].c_str()) == kJobRun ? kJobRun : kJobRejected;
+    ExitCode = std::atoi(Reply[1].c_str());
+    Output = std::move(Reply[2]);
+  }
+  ::close(FD);
+  return Status;
+}
+
+bool Serve(const std::string& Socket, const std::string& AllowedDir,
+           unsigned Workers, std::string& Err) {
+  auto State = std::make_shared<ServerState>();
+  llvm::SmallString<256> Allowed;
+  if (llvm::sys::fs::real_path(AllowedDir, Allowed)) {
+    Err = "cannot find " + AllowedDir;
+    return false;
+  }
+  State->AllowedDir = Allowed.str();
+  State->Workers = Workers ? Workers : 1;
+
+  // Replace the socket of a server that is gone, but not a live one.
+  int Live = connectTo(Socket);
+  if (Live >= 0) {
+    ::close(Live);
+    Err = "a server is already listening on " + Socket;
+    return false;
+  }
+  ::unlink(Socket.c_str());
+
+  sockaddr_un Addr;
+  int FD = openSocket(Socket, Addr);
+  if (FD < 0) {
+    Err = ::strerror(errno);
+    return false;
+  }
+  // Only the user may connect, since the jobs run on their behalf.
+  mode_t Mask = ::umask(0077);
+  int Result = ::bind(FD, reinterpret_cast<sockaddr*>(&Addr), sizeof(Addr));
+  ::umask(Mask);
+  if (Result || ::listen(FD, SOMAXCONN)) {
+    Err = ::strerror(errno);
+    ::close(FD);
+    return false;
+  }
+
+  while (true) {
+    int Conn = ::accept(FD, nullptr, nullptr);
+    if (Conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      Err = ::strerror(errno);
+      break;
+    }
+    std::thread(serveConnection, State, Conn).detach();
+  }
+  ::close(FD);
+  ::unlink(Socket.c_str());
+  return false;
+}
+
+} // namespace sycl
+} // namespace utils
+} // namespace cling
+
+#else // LLVM_ON_UNIX
+
+namespace cling {
+namespace utils {
+namespace sycl {
+
+JobStatus RunRemoteJob(const std::string& Socket, const Job& J, int& ExitCode,
+                       std::string& Output) {
+  ExitCode = -1;
+  return kServerFailure;
+}
+
+bool Serve(const std::string& Socket, const std::string& AllowedDir,
+           unsigned Workers, std::string& Err) {
+  Err = "the SYCL compile server needs Unix sockets";
+  return false;
+}
+
+} // namespace sycl
+} // namespace utils
+} // namespace cling
+
+#endif // LLVM_ON_UNIX
@@ -0,0 +1,13 @@
+/*------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//----------------------------------------------------------------------------*/
+
+// RUN: true
+// Used as library source by Snapshot.C
+CLING_EXPORT int snapshot_lib_function() {
+  return 42;
+}
@@ -0,0 +1 @@
+#define SYCL_FACTOR 2
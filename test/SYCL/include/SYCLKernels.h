@@ -0,0 +1,19 @@
+#ifndef SYCL_KERNELS_H
+#define SYCL_KERNELS_H
+
+#include <CL/sycl.hpp>
+
+inline int runDoubleKernel(int v) {
+  int result = 0;
+  {
+    cl::sycl::queue q;
+    cl::sycl::buffer<int, 1> buf(&result, cl::sycl::range<1>(1));
+    q.submit([&](cl::sycl::handler& cgh) {
+      auto acc = buf.get_access<cl::sycl::access::mode::write>(cgh);
+      cgh.single_task<class DoubleKernel>([=]() { acc[0] = 2 * v; });
+    });
+  }
+  return result;
+}
+
+#endif
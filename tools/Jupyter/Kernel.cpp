@@ -19,14 +19,31 @@
 #include "cling/Interpreter/Exception.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #ifndef LLVM_ON_WIN32
+# include <climits>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
 # include <unistd.h>
 #else
 # include <io.h>
 # define write _write
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
 #endif
 
 // FIXME: should be moved into a Jupyter interp struct that then gets returned
@@ -35,6 +52,83 @@ int pipeToJupyterFD = -1;
 
 namespace cling {
   namespace Jupyter {
+    /// A ring buffer shared with the kernel, through which pushOutput() passes
+    /// large payloads instead of the pipe. The kernel reads them in the order
+    /// of the frames referring to them, and then stores in the header how far
+    /// it has read.
+    class OutputRing {
+      /// Set by the kernel: the position up to which it has read.
+      struct Header {
+        std::atomic<uint64_t> Tail;
+        char Padding[64 - sizeof(uint64_t)];
+      };
+
+      Header* m_Header;
+      char* m_Data;
+      uint64_t m_Capacity;
+      /// The position up to which pushOutput() wrote.
+      uint64_t m_Head = 0;
+
+    public:
+      OutputRing(void* Mapping, uint64_t Capacity):
+        m_Header((Header*)Mapping), m_Data((char*)Mapping + sizeof(Header)),
+        m_Capacity(Capacity) {}
+
+      /// The size of the mapping for a ring of Capacity bytes.
+      static uint64_t mappingSize(uint64_t Capacity) {
+        return sizeof(Header) + Capacity;
+      }
+
+      /// Copy a payload into the ring, if it has room for it.
+      ///\returns the position of the payload, or -1 if the ring is too full.
+      long put(const char* Data, uint64_t Size) {
+        uint64_t Tail = m_Header->Tail.load(std::memory_order_acquire);
+        if (m_Capacity - (m_Head - Tail) < Size)
+          return -1;
+        uint64_t Offset = m_Head % m_Capacity;
+        uint64_t First = std::min(Size, m_Capacity - Offset);
+        memcpy(m_Data + Offset, Data, First);
+        memcpy(m_Data, Data + First, Size - First);
+        long Pos = (long)m_Head;
+        m_Head += Size;
+        return Pos;
+      }
+
+      /// Give back the room of the last payloads put, which the kernel will
+      /// never read because no frame refers to them.
+      void unput(uint64_t Size) { m_Head -= Size; }
+    };
+
+    /// Set by cling_output_ring().
+    OutputRing* outputRingToJupyter = nullptr;
+
+    /// Payloads from this size on go through the ring, if there is one.
+    const long kRingThreshold = 64 * 1024;
+
+    /// Write the buffers of a frame to the pipe, resuming after short writes.
+    static bool writeFrame(int FD, struct iovec* Iov, size_t NumIov) {
+      while (NumIov) {
+#ifndef LLVM_ON_WIN32
+        long Written = (long)writev(FD, Iov, std::min(NumIov,
+                                                      (size_t)IOV_MAX));
+#else
+        long Written = (long)write(FD, Iov->iov_base, (unsigned)Iov->iov_len);
+#endif
+        if (Written < 0) {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+        for (; NumIov && (size_t)Written >= Iov->iov_len; ++Iov, --NumIov)
+          Written -= Iov->iov_len;
+        if (NumIov) {
+          Iov->iov_base = (char*)Iov->iov_base + Written;
+          Iov->iov_len -= Written;
+        }
+      }
+      return true;
+    }
+
     struct MIMEDataRef {
       const char* m_Data;
       const long m_Size;
@@ -42,54 +136,148 @@ namespace cling {
       MIMEDataRef(const std::string& str):
       m_Data(str.c_str()), m_Size((long)str.length() + 1) {}
       MIMEDataRef(const char* str):
-      MIMEDataRef(std::string(str)) {}
+      m_Data(str), m_Size((long)strlen(str) + 1) {}
       MIMEDataRef(const char* data, long size):
       m_Data(data), m_Size(size) {}
     };
 
     /// Push MIME stuff to Jupyter. To be called from user code.
     ///\param contentDict - dictionary of MIME type versus content. E.g.
-    /// {{"text/html", {"<div></div>", }}
+    /// {{"text/html", {"<div></div>", }}. The content is not copied, but for
+    /// large payloads going through the shared ring.
     ///\returns `false` if the output could not be sent.
-    bool pushOutput(const std::map<std::string, MIMEDataRef> contentDict) {
+    bool pushOutput(const std::map<std::string, MIMEDataRef>& contentDict) {
 
       // Pipe sees (all numbers are longs, except for the first:
       // - num bytes in a long (sent as a single unsigned char!)
+      // - num bytes of the frame that follows.
       // - num elements of the MIME dictionary; Jupyter selects one to display.
       // For each MIME dictionary element:
       //   - size of MIME type string  (including the terminating 0)
       //   - MIME type as 0-terminated string
       //   - size of MIME data buffer (including the terminating 0 for
-      //     0-terminated strings)
-      //   - MIME data buffer
+      //     0-terminated strings); negated if the buffer is in the ring
+      //   - MIME data buffer, or its position in the ring
+
+      // Frames of concurrent calls must not interleave.
+      static std::mutex outputLock;
+      std::lock_guard<std::mutex> Lock(outputLock);
 
-      // Write number of dictionary elements (and the size of that number in a
-      // char)
+      // The iovecs point into Numbers, which must not reallocate.
       unsigned char sizeLong = sizeof(long);
-      if (write(pipeToJupyterFD, &sizeLong, 1) != 1)
-        return false;
-      long dictSize = contentDict.size();
-      if (write(pipeToJupyterFD, &dictSize, sizeof(long)) != sizeof(long))
-        return false;
+      std::vector<long> Numbers;
+      Numbers.reserve(2 + 3 * contentDict.size());
+      std::vector<struct iovec> Iov;
+      Iov.reserve(3 + 4 * contentDict.size());
+      auto add = [&Iov](const void* Data, size_t Size) {
+        Iov.push_back({const_cast<void*>(Data), Size});
+      };
+      auto addNumber = [&Numbers, &add](long N) {
+        Numbers.push_back(N);
+        add(&Numbers.back(), sizeof(long));
+      };
 
-      for (auto iContent: contentDict) {
+      // Bytes put in the ring by this frame.
+      uint64_t ringSize = 0;
+      add(&sizeLong, 1);
+      addNumber(0); // The frame size, known below.
+      addNumber((long)contentDict.size());
+      for (const auto& iContent: contentDict) {
         const std::string& mimeType = iContent.first;
-        long mimeTypeSize = (long)mimeType.size();
-        if (write(pipeToJupyterFD, &mimeTypeSize, sizeof(long)) != sizeof(long))
-          return false;
-        if (write(pipeToJupyterFD, mimeType.c_str(), mimeType.size() + 1)
-            != (long)(mimeType.size() + 1))
-          return false;
+        addNumber((long)mimeType.size() + 1);
+        add(mimeType.c_str(), mimeType.size() + 1);
         const MIMEDataRef& mimeData = iContent.second;
-        if (write(pipeToJupyterFD, &mimeData.m_Size, sizeof(long))
-            != sizeof(long))
-          return false;
-        if (write(pipeToJupyterFD, mimeData.m_Data, mimeData.m_Size)
-            != mimeData.m_Size)
-          return false;
+        long Pos = -1;
+        if (outputRingToJupyter && mimeData.m_Size >= kRingThreshold)
+          Pos = outputRingToJupyter->put(mimeData.m_Data, mimeData.m_Size);
+        if (Pos >= 0) {
+          ringSize += mimeData.m_Size;
+          addNumber(-mimeData.m_Size);
+          addNumber(Pos);
+        } else {
+          addNumber(mimeData.m_Size);
+          add(mimeData.m_Data, mimeData.m_Size);
+        }
       }
-      return true;
+
+      long frameSize = 0;
+      for (size_t I = 2; I < Iov.size(); ++I)
+        frameSize += (long)Iov[I].iov_len;
+      Numbers[0] = frameSize;
+
+      if (writeFrame(pipeToJupyterFD, Iov.data(), Iov.size()))
+        return true;
+      if (ringSize)
+        outputRingToJupyter->unput(ringSize);
+      return false;
     }
+
+    /// The completions of some code, produced in batches by a thread of their
+    /// own, best ranked first. The interpreter looks at the whole scope and
+    /// ranks what matches the identifier typed before the first batch; the
+    /// kernel can then take the first ones, or cancel, while the texts of the
+    /// rest are being made.
+    class Completion {
+      /// Completions in a batch.
+      enum { kBatchSize = 64 };
+
+      std::mutex m_Lock;
+      std::condition_variable m_Ready;
+      std::deque<std::string> m_Queue;
+      /// The completion last returned by next().
+      std::string m_Current;
+      bool m_Done = false;
+      std::atomic<bool> m_Cancelled{false};
+      std::thread m_Thread;
+
+      bool push(std::vector<std::string>& Batch) {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        for (std::string& Text: Batch)
+          m_Queue.push_back(std::move(Text));
+        m_Ready.notify_one();
+        return !m_Cancelled;
+      }
+
+    public:
+      Completion(const Interpreter& Interp, std::string Code, size_t Cursor) {
+        m_Thread = std::thread([this, &Interp, Code, Cursor]() mutable {
+          Interp.codeComplete(Code, Cursor,
+                              [this](std::vector<std::string>& Batch) {
+                                return push(Batch);
+                              }, kBatchSize);
+          std::lock_guard<std::mutex> Lock(m_Lock);
+          m_Done = true;
+          m_Ready.notify_one();
+        });
+      }
+
+      ~Completion() {
+        cancel();
+        m_Thread.join();
+      }
+
+      /// Wait for the next completion. Returns nullptr once there are no
+      /// more, or the completion was cancelled. The string stays valid until
+      /// the next call.
+      const char* next() {
+        std::unique_lock<std::mutex> Lock(m_Lock);
+        m_Ready.wait(Lock, [this]() {
+          return !m_Queue.empty() || m_Done || m_Cancelled;
+        });
+        if (m_Queue.empty() || m_Cancelled)
+          return nullptr;
+        m_Current = std::move(m_Queue.front());
+        m_Queue.pop_front();
+        return m_Current.c_str();
+      }
+
+      /// Produce no more completions. May be called from any thread.
+      void cancel() {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        m_Cancelled = true;
+        m_Ready.notify_all();
+      }
+    };
   } // namespace Jupyter
 } // namespace cling
 
@@ -109,6 +297,30 @@ cling_create(int argc, const char *argv[], const char* llvmdir, int pipefd) {
   return new cling::MetaProcessor(*I, cling::errs());
 }
 
+/// Pass large MIME payloads through a ring of capacity bytes in the shared
+/// memory file at path, which the kernel created with room for a 64 byte
+/// header. Returns 0 on success; the pipe is used otherwise.
+int cling_output_ring(const char* path, long capacity) {
+#ifndef LLVM_ON_WIN32
+  if (cling::Jupyter::outputRingToJupyter || capacity <= 0)
+    return -1;
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    return -1;
+  size_t size = cling::Jupyter::OutputRing::mappingSize(capacity);
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return -1;
+  cling::Jupyter::outputRingToJupyter
+    = new cling::Jupyter::OutputRing(mapping, capacity);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 
 /// Destroy the interpreter.
 void cling_destroy(TheMetaProcessor *metaProc) {
@@ -179,22 +391,35 @@ void cling_eval_free(char* str) {
 }
 
 /// Code completion interfaces.
+/// The completion runs in the interpreter: it must be ended before the next
+/// cling_eval().
 
-/// Start completion of code. Returns a handle to be passed to
-/// cling_complete_next() to iterate over the completion options. Returns nulptr
-/// if no completions are known.
-void* cling_complete_start(const char* code) {
-  return new int(42);
+/// Start completion of code at the byte offset cursor. Returns a handle to be
+/// passed to cling_complete_next() to iterate over the completion options,
+/// and to cling_complete_end() once done.
+void* cling_complete_start(TheMetaProcessor *metaProc, const char* code,
+                           int cursor) {
+  cling::MetaProcessor *M = (cling::MetaProcessor*)metaProc;
+  return new cling::Jupyter::Completion(M->getInterpreter(), code, cursor);
 }
 
-/// Grab the next completion of some code. Returns nullptr if none is left.
+/// Grab the next completion of some code, the best ranked first: the text to
+/// insert in place of the identifier at the cursor. Waits for the completions
+/// still being computed. Returns nullptr if none is left, or the completion
+/// was cancelled. The string is valid until the next call.
 const char* cling_complete_next(void* completionHandle) {
-  int* counter = (int*) completionHandle;
-  if (++(*counter) > 43) {
-    delete counter;
-    return nullptr;
-  }
-  return "COMPLETE!";
+  return ((cling::Jupyter::Completion*)completionHandle)->next();
+}
+
+/// Stop producing completions, e.g. once the kernel has enough of them. May be
+/// called from any thread, while another waits in cling_complete_next().
+void cling_complete_cancel(void* completionHandle) {
+  ((cling::Jupyter::Completion*)completionHandle)->cancel();
+}
+
+/// Release a completion handle, cancelling the completion if it still runs.
+void cling_complete_end(void* completionHandle) {
+  delete (cling::Jupyter::Completion*)completionHandle;
 }
 
 ///\}
@@ -19,17 +19,24 @@ from __future__ import print_function
 
 __version__ = '0.0.3'
 
+import base64
 import ctypes
 from contextlib import contextmanager
 from fcntl import fcntl, F_GETFL, F_SETFL
+import json
+import logging
+import mmap
 import os
 import shutil
 import select
+import signal
+import socket
 import struct
 import sys
 import threading
+import time
 
-from traitlets import Unicode, Float, Dict, List, CaselessStrEnum
+from traitlets import Unicode, Float, Integer, Dict, List, CaselessStrEnum
 from ipykernel.kernelbase import Kernel
 from ipykernel.kernelapp import kernel_aliases,kernel_flags, IPKernelApp
 from ipykernel.ipkernel import IPythonKernel
@@ -72,31 +79,9 @@ class FdReplacer:
         os.close(self.save_fd)
 
 
-class ClingKernel(Kernel):
-    """Cling Kernel for Jupyter"""
-    implementation = 'cling_kernel'
-    implementation_version = __version__
-    language_version = 'X'
-
-    banner = Unicode()
-    def _banner_default(self):
-        return 'cling-%s' % self.language_version
-        return self._banner
-
-    language_info = {'name': 'c++',
-                     'codemirror_mode': 'c++',
-                     'mimetype': 'text/x-c++src',
-                     'file_extension': '.c++'}
-
-    # Used in handle_input()
-    flush_interval = Float(0.25, config=True)
-
-    std = CaselessStrEnum(default_value='c++11',
-            values = ['c++11', 'c++14', 'c++1z', 'c++17'],
-            help="C++ standard to use, either c++17, c++1z, c++14 or c++11").tag(config=True);
-
-    def __init__(self, **kwargs):
-        super(ClingKernel, self).__init__(**kwargs)
+class ClingInstance(object):
+    """libclingJupyter, and an interpreter created with it."""
+    def __init__(self, std, log):
         clingInPath = shutil.which('cling')
         if not clingInPath:
             from distutils.spawn import find_executable
@@ -127,21 +112,26 @@ class ClingKernel(Kernel):
             for ext in ['so', 'dylib', 'dll']:
                 libFilename = clingInstDir + libFolder + ext
                 if os.access(libFilename, os.R_OK):
-                    self.libclingJupyter = ctypes.CDLL(clingInstDir + libFolder + ext,
-                                                    mode = ctypes.RTLD_GLOBAL)
+                    self.lib = ctypes.CDLL(clingInstDir + libFolder + ext,
+                                           mode = ctypes.RTLD_GLOBAL)
                     break
             else:
                 continue
             break
 
-        if not getattr(self, 'libclingJupyter', None):
+        if not getattr(self, 'lib', None):
             raise RuntimeError('Cannot find ' + clingInstDir + '/lib/libclingJupyter.{so,dylib,dll}')
 
-        self.libclingJupyter.cling_create.restype = my_void_p
-        self.libclingJupyter.cling_eval.restype = my_void_p
+        self.lib.cling_create.restype = my_void_p
+        self.lib.cling_eval.restype = my_void_p
+        self.lib.cling_complete_start.restype = my_void_p
+        self.lib.cling_complete_next.restype = my_void_p #c_char_p
+        self.lib.cling_complete_next.argtypes = [my_void_p]
+        self.lib.cling_complete_cancel.argtypes = [my_void_p]
+        self.lib.cling_complete_end.argtypes = [my_void_p]
         #build -std=c++11 or -std=c++14 option
-        stdopt = ("-std=" + self.std).encode('utf-8')
-        self.log.info("Using {}".format(stdopt.decode('utf-8')))
+        stdopt = ("-std=" + std).encode('utf-8')
+        log.info("Using {}".format(stdopt.decode('utf-8')))
         #from IPython.utils import io
         #io.rprint("DBG: Using {}".format(stdopt.decode('utf-8')))
         argv = [b"clingJupyter", stdopt, b"-I" + clingInstDir.encode('utf-8') + b"/include/"]
@@ -151,7 +141,10 @@ class ClingKernel(Kernel):
         if extra_opts:
             for x in extra_opts.split():
                 argv.append(x.encode('utf-8'))
-                self.log.info("Passing extra argument {} to cling".format(x))
+                log.info("Passing extra argument {} to cling".format(x))
+
+        self.std = std
+        self.cling_opts = extra_opts
 
         argc = len(argv)
         CharPtrArrayType = ctypes.c_char_p * argc
@@ -160,10 +153,56 @@ class ClingKernel(Kernel):
 
         # The sideband_pipe is used by cling::Jupyter::pushOutput() to publish MIME data to Jupyter.
         self.sideband_pipe, pipe_in = os.pipe()
-        self.interp = self.libclingJupyter.cling_create(ctypes.c_int(argc), CharPtrArrayType(*argv), llvmResourceDirCP, pipe_in)
+        self.interp = self.lib.cling_create(ctypes.c_int(argc), CharPtrArrayType(*argv), llvmResourceDirCP, pipe_in)
+
+
+# A ClingInstance created by the kernel host before the kernel started.
+_prewarmed = None
 
-        self.libclingJupyter.cling_complete_start.restype = my_void_p
-        self.libclingJupyter.cling_complete_next.restype = my_void_p #c_char_p
+
+class ClingKernel(Kernel):
+    """Cling Kernel for Jupyter"""
+    implementation = 'cling_kernel'
+    implementation_version = __version__
+    language_version = 'X'
+
+    banner = Unicode()
+    def _banner_default(self):
+        return 'cling-%s' % self.language_version
+        return self._banner
+
+    language_info = {'name': 'c++',
+                     'codemirror_mode': 'c++',
+                     'mimetype': 'text/x-c++src',
+                     'file_extension': '.c++'}
+
+    # Used in handle_input()
+    flush_interval = Float(0.25, config=True)
+
+    # Used in do_complete(): the best ranked completions come first.
+    max_completions = Integer(1000, config=True)
+    # Seconds after which do_complete() replies with the completions it got.
+    complete_timeout = Float(1.0, config=True)
+
+    # Size in bytes of the shared memory ring passing large MIME payloads of
+    # cling::Jupyter::pushOutput(); 0 to pass them through the pipe.
+    output_ring_size = Integer(64 * 1024 * 1024, config=True)
+
+    std = CaselessStrEnum(default_value='c++11',
+            values = ['c++11', 'c++14', 'c++1z', 'c++17'],
+            help="C++ standard to use, either c++17, c++1z, c++14 or c++11").tag(config=True);
+
+    def __init__(self, **kwargs):
+        super(ClingKernel, self).__init__(**kwargs)
+        global _prewarmed
+        if _prewarmed and _prewarmed.std == self.std:
+            cling, _prewarmed = _prewarmed, None
+        else:
+            cling = ClingInstance(self.std, self.log)
+        self.libclingJupyter = cling.lib
+        self.interp = cling.interp
+        self.sideband_pipe = cling.sideband_pipe
+        self.output_ring = self._create_output_ring()
 
     def _process_stdio_data(self, pipe, name):
         """Read from the pipe, send it to IOPub as name stream."""
@@ -174,6 +213,62 @@ class ClingKernel(Kernel):
           'text': data.decode('utf8', 'replace'),
         }, parent=self._parent_header)
 
+    def _create_output_ring(self):
+        """Share a ring buffer with cling for large MIME payloads.
+
+        Returns the mapping, or None if the pipe is to be used.
+        """
+        # Layout: the 8 byte position up to which we read, padded to 64 bytes,
+        # then the ring.
+        size = self.output_ring_size
+        if size <= 0 or not os.path.isdir('/dev/shm'):
+            return None
+        path = '/dev/shm/cling-jupyter-%d' % os.getpid()
+        fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0o600)
+        try:
+            os.ftruncate(fd, 64 + size)
+            ring = mmap.mmap(fd, 64 + size)
+        finally:
+            os.close(fd)
+        try:
+            if self.libclingJupyter.cling_output_ring(
+                    ctypes.c_char_p(path.encode('utf8')), ctypes.c_long(size)):
+                ring.close()
+                return None
+        finally:
+            os.unlink(path)
+        return ring
+
+    def _read_exact(self, pipe, size):
+        """Read size bytes from the pipe: large frames arrive in pieces."""
+        chunks = []
+        while size:
+            chunk = os.read(pipe, size)
+            if not chunk:
+                raise EOFError('cling closed the sideband pipe')
+            chunks.append(chunk)
+            size -= len(chunk)
+        return b''.join(chunks)
+
+    def _read_ring(self, pos, size):
+        """Read a payload from the output ring, and release its space."""
+        capacity = len(self.output_ring) - 64
+        offset = pos % capacity
+        first = min(size, capacity - offset)
+        value = self.output_ring[64 + offset:64 + offset + first] + \
+                self.output_ring[64:64 + size - first]
+        struct.pack_into('Q', self.output_ring, 0, pos + size)
+        return value
+
+    @staticmethod
+    def _mime_value(key, value):
+        """The JSON representation of MIME data: text, or base64."""
+        if key.startswith('text/') or key in ('application/json',
+                                              'application/javascript',
+                                              'image/svg+xml'):
+            return value.rstrip(b'\0').decode('utf8', 'replace')
+        return base64.b64encode(value).decode('ascii')
+
     def _recv_dict(self, pipe):
         """Receive a serialized dict on a pipe
 
@@ -182,30 +277,40 @@ class ClingKernel(Kernel):
         # Wire format:
         #   // Pipe sees (all numbers are longs, except for the first):
         #   // - num bytes in a long (sent as a single unsigned char!)
+        #   // - num bytes of the frame that follows.
         #   // - num elements of the MIME dictionary; Jupyter selects one to display.
         #   // For each MIME dictionary element:
-        #   //   - length of MIME type key
+        #   //   - length of MIME type key (including the terminating 0)
         #   //   - MIME type key
         #   //   - size of MIME data buffer (including the terminating 0 for
-        #   //     0-terminated strings)
-        #   //   - MIME data buffer
+        #   //     0-terminated strings); negated if the buffer is in the ring
+        #   //   - MIME data buffer, or its position in the ring
         data = {}
-        b1 = os.read(pipe, 1)
+        b1 = self._read_exact(pipe, 1)
         sizeof_long = struct.unpack('B', b1)[0]
         if sizeof_long == 8:
-            fmt = 'Q'
+            fmt = 'q'
         else:
-            fmt = 'L'
-        buf = os.read(pipe, sizeof_long)
-        num_elements = struct.unpack(fmt, buf)[0]
+            fmt = 'l'
+        buf = self._read_exact(pipe, sizeof_long)
+        frame = self._read_exact(pipe, struct.unpack(fmt, buf)[0])
+        num_elements, = struct.unpack_from(fmt, frame, 0)
+        at = sizeof_long
         for i in range(num_elements):
-            buf = os.read(pipe, sizeof_long)
-            len_key = struct.unpack(fmt, buf)[0]
-            key = os.read(pipe, len_key).decode('utf8')
-            buf = os.read(pipe, sizeof_long)
-            len_value = struct.unpack(fmt, buf)[0]
-            value = os.read(pipe, len_value).decode('utf8')
-            data[key] = value
+            len_key, = struct.unpack_from(fmt, frame, at)
+            at += sizeof_long
+            key = frame[at:at + len_key].rstrip(b'\0').decode('utf8')
+            at += len_key
+            len_value, = struct.unpack_from(fmt, frame, at)
+            at += sizeof_long
+            if len_value < 0:
+                pos, = struct.unpack_from(fmt, frame, at)
+                at += sizeof_long
+                value = self._read_ring(pos, -len_value)
+            else:
+                value = frame[at:at + len_value]
+                at += len_value
+            data[key] = self._mime_value(key, value)
         return data
 
 
@@ -340,12 +445,45 @@ class ClingKernel(Kernel):
         return reply
 
     def do_complete(self, code, cursor_pos):
-        """Provide completions here"""
-        # if cursor_pos = cursor_start = cursor_end,
-        # matches should be a list of strings to be appended after the cursor
-        return {'matches' : [],
+        """Complete the identifier at the cursor, as cling does at its prompt."""
+        # Cling completes a line; the matches replace the identifier typed.
+        line_start = code.rfind('\n', 0, cursor_pos) + 1
+        line_end = code.find('\n', cursor_pos)
+        if line_end < 0:
+            line_end = len(code)
+        cursor_start = cursor_pos
+        while cursor_start > line_start and \
+              (code[cursor_start - 1].isalnum() or code[cursor_start - 1] == '_'):
+            cursor_start -= 1
+        # Jupyter counts characters, cling bytes.
+        line = code[line_start:line_end].encode('utf8')
+        cursor = len(code[line_start:cursor_pos].encode('utf8'))
+
+        matches = []
+        handle = self.libclingJupyter.cling_complete_start(self.interp,
+                    ctypes.c_char_p(line), ctypes.c_int(cursor))
+        # Keep the frontend waiting no longer than complete_timeout: the
+        # cancellation wakes cling_complete_next() up.
+        timer = threading.Timer(self.complete_timeout,
+                                self.libclingJupyter.cling_complete_cancel,
+                                [handle])
+        timer.start()
+        try:
+            while len(matches) < self.max_completions:
+                match = self.libclingJupyter.cling_complete_next(handle)
+                if not match:
+                    break
+                matches.append(ctypes.cast(match, ctypes.c_char_p).value.decode('utf8', 'replace'))
+        finally:
+            # The handle must outlive a cancellation in progress.
+            timer.cancel()
+            timer.join()
+            # Cancels what is left of a large scope.
+            self.libclingJupyter.cling_complete_end(handle)
+
+        return {'matches' : matches,
                 'cursor_end' : cursor_pos,
-                'cursor_start' : cursor_pos,
+                'cursor_start' : cursor_start,
                 'metadata' : {},
                 'status' : 'ok'}
 
@@ -359,8 +497,151 @@ class ClingKernelApp(IPKernelApp):
     classes = List([ ClingKernel, IPythonKernel, ZMQInteractiveShell, ProfileDir, Session ])
     kernel_class = ClingKernel
 
+def _std_from_argv(argv):
+    """The C++ standard a kernel command line asks for."""
+    std = ClingKernel.std.default_value
+    for arg in argv:
+        for prefix in ('--std=', '--ClingKernel.std='):
+            if arg.startswith(prefix):
+                std = arg[len(prefix):].lower()
+    return std
+
+
+def _serve_kernel(server, taken, std):
+    """In a child of the kernel host: initialize cling, then wait for a kernel
+    start that wants the same C++ standard and CLING_OPTS, and run it."""
+    global _prewarmed
+    _prewarmed = ClingInstance(std, logging.getLogger('clingkernel'))
+    while True:
+        conn, _ = server.accept()
+        msg, fds, _, _ = socket.recv_fds(conn, 1 << 16, 3)
+        while msg and not msg.endswith(b'\n'):
+            chunk = conn.recv(1 << 16)
+            if not chunk:
+                break
+            msg += chunk
+        try:
+            request = json.loads(msg.decode('utf8'))
+        except ValueError:
+            request = None
+        if request and request['std'] == std and \
+           request['cling_opts'] == _prewarmed.cling_opts:
+            break
+        for fd in fds:
+            os.close(fd)
+        conn.sendall(b'no\n')
+        conn.close()
+
+    server.close()
+    os.write(taken, struct.pack('i', os.getpid()))
+    os.close(taken)
+    # Become the process that asked for the kernel.
+    for target, fd in enumerate(fds):
+        os.dup2(fd, target)
+        os.close(fd)
+    os.environ.clear()
+    os.environ.update(request['env'])
+    os.chdir(request['cwd'])
+    conn.sendall(('%d\n' % os.getpid()).encode())
+
+    # Jupyter may kill the process that asked without a chance to pass it on.
+    def exit_with_client():
+        while conn.recv(1):
+            pass
+        os._exit(1)
+    threading.Thread(target=exit_with_client, daemon=True).start()
+    ClingKernelApp.launch_instance(argv=request['argv'])
+
+
+def host(socket_path, pool_size, std):
+    """Keep pool_size processes with an initialized interpreter, each waiting
+    to run a kernel started with CLING_KERNEL_HOST=socket_path."""
+    if os.path.exists(socket_path):
+        os.unlink(socket_path)
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.bind(socket_path)
+    os.chmod(socket_path, 0o600)
+    server.listen(4 * pool_size)
+    taken_r, taken_w = os.pipe()
+
+    def spawn():
+        pid = os.fork()
+        if pid == 0:
+            os.close(taken_r)
+            try:
+                _serve_kernel(server, taken_w, std)
+            finally:
+                os._exit(0)
+        return pid
+
+    # The children still waiting for a kernel start.
+    waiting = set(spawn() for _ in range(pool_size))
+    while True:
+        r, _, _ = select.select([taken_r], [], [], 1.0)
+        if r:
+            pid, = struct.unpack('i', os.read(taken_r, 4))
+            waiting.discard(pid)
+            waiting.add(spawn())
+        while True:
+            try:
+                pid, _ = os.waitpid(-1, os.WNOHANG)
+            except ChildProcessError:
+                break
+            if not pid:
+                break
+            if pid in waiting:
+                # It died initializing: try again, without spinning.
+                waiting.discard(pid)
+                time.sleep(1.0)
+                waiting.add(spawn())
+
+
+def start_from_host(socket_path, argv):
+    """Have a child of the kernel host at socket_path run the kernel, and wait
+    for it to end. Returns False if the host cannot run this kernel."""
+    if not hasattr(socket, 'send_fds'):
+        return False
+    conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        conn.connect(socket_path)
+    except (OSError, IOError):
+        return False
+    request = json.dumps({'argv': argv, 'std': _std_from_argv(argv),
+                          'cling_opts': os.getenv('CLING_OPTS'),
+                          'env': dict(os.environ), 'cwd': os.getcwd()})
+    socket.send_fds(conn, [request.encode('utf8') + b'\n'], [0, 1, 2])
+    reply = conn.makefile('rb').readline()
+    if not reply or reply == b'no\n':
+        return False
+
+    # Jupyter signals this process, e.g. to interrupt the kernel.
+    pid = int(reply)
+    for sig in (signal.SIGINT, signal.SIGTERM, signal.SIGHUP):
+        signal.signal(sig, lambda signum, frame: os.kill(pid, signum))
+    while conn.recv(1):
+        pass
+    return True
+
+
 def main():
-    """launch a cling kernel"""
+    """launch a cling kernel
+
+    jupyter-cling-kernel --host SOCKET [--pool N] [--std=c++17] runs a kernel
+    host instead, keeping N interpreters initialized; kernels started with
+    CLING_KERNEL_HOST=SOCKET, the same C++ standard and the same CLING_OPTS
+    take one of them.
+    """
+    argv = sys.argv[1:]
+    if '--host' in argv:
+        socket_path = argv[argv.index('--host') + 1]
+        pool_size = 2
+        if '--pool' in argv:
+            pool_size = int(argv[argv.index('--pool') + 1])
+        host(socket_path, pool_size, _std_from_argv(argv))
+        return
+    socket_path = os.getenv('CLING_KERNEL_HOST')
+    if socket_path and start_from_host(socket_path, argv):
+        return
     ClingKernelApp.launch_instance()
 
 
@@ -0,0 +1,49 @@
+//------------------------------------------------------------------------------
+// CLING - the C++ LLVM-based InterpreterG :)
+//
+// This file is dual-licensed: you can choose to license it under the University
+// of Illinois Open Source License or the GNU Lesser General Public License. See
+// LICENSE.TXT for details.
+//------------------------------------------------------------------------------
+
+// Runs the SYCL device jobs of the cling sessions of a user, so that they
+// share the cores of the host instead of each starting its own compilers.
+// Sessions use it when $CLING_SYCL_SERVER names its socket.
+
+#include "cling/Utils/SYCLCompileServer.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+static int usage(const char* Argv0) {
+  llvm::errs() << "usage: " << Argv0 << " [-j <jobs>] <socket>\n"
+               << "Runs the SYCL compiler jobs of cling sessions that set "
+                  "$CLING_SYCL_SERVER=<socket>.\n"
+               << "Only the programs in $SYCL_BIN_PATH are run.\n";
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  unsigned Workers = std::thread::hardware_concurrency();
+  std::string Socket;
+  for (int i = 1; i < argc; ++i) {
+    if (!::strcmp(argv[i], "-j") && i + 1 < argc)
+      Workers = std::atoi(argv[++i]);
+    else if (argv[i][0] != '-' && Socket.empty())
+      Socket = argv[i];
+    else
+      return usage(argv[0]);
+  }
+  const char* BinPath = ::getenv("SYCL_BIN_PATH");
+  if (Socket.empty() || !BinPath)
+    return usage(argv[0]);
+
+  std::string Err;
+  cling::utils::sycl::Serve(Socket, BinPath, Workers, Err);
+  llvm::errs() << argv[0] << ": " << Err << "\n";
+  return 1;
+}